@@ -16,49 +16,51 @@
  See the License for the specific language governing permissions and
  limitations under the License.
 */
+/* JST_PRELUDE_VERSION 2: the page content and headers go through ccsp_output,
+   the parser only writes a page's static content as __jst_static(n) with this prefix */
 try
 {
-/* HEADERS: accumulate headers into a buffer
+/* HEADERS: accumulate headers into a native buffer
             to send to stdout in _jst_finish*/
-_jst_header_content_type_set = false;
-_jst_header_buffer = "";
 function header(str)
 {
-  lstr = str.toLowerCase();
-  if(lstr.indexOf('location:') == 0)
-  {
-    _jst_header_buffer = "HTTP/1.0 302 Ok\r\n";
-    _jst_header_buffer += "Status: 302 Moved\r\n";
-    _jst_header_buffer += str + "\r\n";
-  }
-  else
-  {
-    if(lstr.indexOf('content-type:') == 0)
-    {
-      _jst_header_content_type_set = true;
-      if(lstr.indexOf('application/json') != -1)
-        _jst_header_buffer += "Content-Type: text/html\r\n";
-    }
-    _jst_header_buffer += str + "\r\n";
-  }
+  ccsp_output.header(str);
 }
 
-/* ECHO: accumulate main content into a buffer
-         to send to stdout in _jst_finish */
-_jst_echo_buffer = "";
+/* ECHO: accumulate main content into a native buffer (shared with
+         the static content of the page) to send to stdout in _jst_finish */
 function echo(str)
 {
    str = (typeof(str)!="undefined") ? str : "";
-  _jst_echo_buffer += str;
+  ccsp_output.echo(str);
 }
 
 /* FINISH: _jst_finish is called at the very end of the script 
-           and it will send the headers and content to stdout */
+           and it will save any session changes and send the headers and
+           content to stdout, with an ETag, or just a 304 if the client has it already */
 function _jst_finish()
 {
-  if(!_jst_header_content_type_set)
-    print("Content-type: text/html\r");
-  print(_jst_header_buffer + "\r\n" + _jst_echo_buffer);
+  ccsp.timingBegin("_jst_finish");
+  session_write_close();
+  ccsp_output.finish();
+  ccsp.timingEnd("_jst_finish");
+}
+
+/* FRAGMENT CACHE: cache_fragment(key, ttl, fn) echoes what fn echoed when it was last run for
+                  key, if that was within ttl seconds, otherwise runs fn and keeps what it
+                  echoes (not its headers) for the next ttl seconds. key is a string or
+                  anything JSON.stringify can make one of, e.g. ["menu", lang, user_level].
+                  fragments are shared by every jst process through the on disk cache, and
+                  fn just runs every time when the cache is off */
+function cache_fragment(key, ttl, fn)
+{
+  if(typeof(key) !== "string")
+    key = JSON.stringify(key);
+  if(ccsp_output.loadFragment(key))
+    return;
+  var start = ccsp_output.bodyLength();
+  fn();
+  ccsp_output.storeFragment(key, ttl, start);
 }
 
 /* EXIT: there is no way to simply quit in the middle of a script, so
@@ -85,13 +87,19 @@ var $_SERVER = new Proxy({}, {
   }
 });
 
-/* SESSION: session data set by web app, saved to disk, and referenced by session id stored in cookie */
+/* SESSION: session data set by web app, saved to disk, and referenced by session id stored in cookie.
+            changes are kept in $_jst_session and saved once, by session_write_close, which
+            _jst_finish calls. as in php, changes made after session_write_close are not saved,
+            unless the session is started again */
 var $_SESSION = {};
 var $_jst_session = null;
+var $_jst_session_dirty = false;
+var $_jst_session_closed = false;
 function session_start()
 {
-  if($_jst_session)
+  if($_jst_session && !$_jst_session_closed)
     return;
+  $_jst_session_closed = false;
   ccsp_session.start();
   var host = getenv('HTTPS');
   if (host == false)
@@ -106,20 +114,23 @@ function session_start()
     },
     set: function(obj, prop, val){
       obj[prop] = val;
-      ccsp_session.setData(obj);
+      if(!$_jst_session_closed)
+        $_jst_session_dirty = true;
       return true;
     },
     deleteProperty(obj, prop) {
       if(prop in obj)
       {
         delete obj[prop];
-        ccsp_session.setData(obj);
+        if(!$_jst_session_closed)
+          $_jst_session_dirty = true;
       }
       return true;
     }
   });
 }
 function session_create(){
+  $_jst_session_closed = false;
   ccsp_session.create();
   var host = getenv('HTTPS');
   if (host == false)
@@ -134,14 +145,16 @@ function session_create(){
     },
     set: function(obj, prop, val){
       obj[prop] = val;
-      ccsp_session.setData(obj);
+      if(!$_jst_session_closed)
+        $_jst_session_dirty = true;
       return true;
     },
     deleteProperty(obj, prop) {
       if(prop in obj)
       {
         delete obj[prop];
-        ccsp_session.setData(obj);
+        if(!$_jst_session_closed)
+          $_jst_session_dirty = true;
       }
       return true;
     }
@@ -155,10 +168,22 @@ function session_status()
 {
   return ccsp_session.getStatus();
 }
+function session_write_close()
+{
+  if(!$_jst_session || $_jst_session_closed)
+    return true;
+  $_jst_session_closed = true;
+  if(!$_jst_session_dirty)
+    return true;
+  $_jst_session_dirty = false;
+  return ccsp_session.setData($_jst_session);
+}
 function session_destroy()
 {
   delete $_jst_session;
   $_jst_session = null;
+  $_jst_session_dirty = false;
+  $_jst_session_closed = false;
   delete $_SESSION;
   $_SESSION = {};
   return ccsp_session.destroy();
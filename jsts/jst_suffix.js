@@ -29,7 +29,8 @@ catch(err)
   }
   else
   {
- 
+    /* changes to the session made before the error are still saved */
+    session_write_close();
    /*print("<html><body>");
     if(typeof(err.stack) === 'string')
       print(err.stack.replace(/\n/g, "<br/>\n") + "<br/>");
@@ -107,6 +107,7 @@
 #define  MEM_LIMIT_NORMAL   (128*1024*1024)   /* 128 MB */
 #define  MEM_LIMIT_HIGH     (2047*1024*1024)  /* ~2 GB */
 #define  LINEBUF_SIZE       65536
+#define  MAX_PRECOMPILE_PRELOADS  16
 
 char* jst_debug_file_name = NULL;
 
@@ -234,8 +235,8 @@ static duk_ret_t wrapped_compile_execute(duk_context *ctx, void *udata) {
 	const char *src_data;
 	duk_size_t src_len;
 	duk_uint_t comp_flags;
-
-	(void) udata;
+	char src_filename[128];  /* copied, compiling pops the filename */
+	int cache_template = (udata != NULL && *(int *) udata);
 
 	/* XXX: Here it'd be nice to get some stats for the compilation result
 	 * when a suitable command line is given (e.g. code size, constant
@@ -251,6 +252,9 @@ static duk_ret_t wrapped_compile_execute(duk_context *ctx, void *udata) {
 
 	src_data = (const char *) duk_require_pointer(ctx, -3);
 	src_len = (duk_size_t) duk_require_uint(ctx, -2);
+	snprintf(src_filename, sizeof(src_filename), "%s", duk_require_string(ctx, -1));
+
+	jst_timing_begin("compile", src_filename);
 
 	if (src_data != NULL && src_len >= 1 && src_data[0] == (char) 0xbf) {
 		/* Bytecode. */
@@ -263,6 +267,7 @@ static duk_ret_t wrapped_compile_execute(duk_context *ctx, void *udata) {
 		comp_flags = DUK_COMPILE_SHEBANG;
 		duk_compile_lstring_filename(ctx, comp_flags, src_data, src_len);
 	}
+	jst_timing_end("compile");
 
 	/* [ ... bytecode_filename src_data src_len function ] */
 
@@ -303,6 +308,18 @@ static duk_ret_t wrapped_compile_execute(duk_context *ctx, void *udata) {
 		return 0;  /* duk_safe_call() cleans up */
 	}
 
+	/* Store a freshly compiled template in the bytecode cache. */
+	if (cache_template && !(src_len >= 1 && src_data[0] == (char) 0xbf)) {
+		void *bc_ptr;
+		duk_size_t bc_len;
+
+		duk_dup_top(ctx);
+		duk_dump_function(ctx);
+		bc_ptr = duk_require_buffer(ctx, -1, &bc_len);
+		(void) store_template_cached((const char *) bc_ptr, (size_t) bc_len);
+		duk_pop(ctx);
+	}
+
 #if 0
 	/* Manual test for bytecode dump/load cycle: dump and load before
 	 * execution.  Enable manually, then run "make ecmatest" for a
@@ -316,8 +333,10 @@ static duk_ret_t wrapped_compile_execute(duk_context *ctx, void *udata) {
 	lowmem_start_exec_timeout();
 #endif
 
+	jst_timing_begin("execute", src_filename);
 	duk_push_global_object(ctx);  /* 'this' binding */
 	duk_call_method(ctx, 0);
+	jst_timing_end("execute");
 
 #if defined(DUK_CMDLINE_LOWMEM)
 	lowmem_clear_exec_timeout();
@@ -559,15 +578,21 @@ static int handle_fh(duk_context *ctx, FILE *f, const char *filename, const char
 	size_t got;
 	int rc;
 	int retval = -1;
+	int cache_template = 0;
 
   if(strlen(filename) > 4 && !strcmp(filename + strlen(filename) - 4, ".jst"))
   {
     //fclose(f);
-    rc = load_template_file(filename, &buf, &bufoff, 1);
-    if(!rc )
+    rc = load_template_cached(filename, &buf, &bufoff);
+    if(!rc)
     {
-      fprintf(stderr, "load_template_file failed\n");
-      return 0;
+      rc = load_template_file(filename, &buf, &bufoff, 1);
+      if(!rc )
+      {
+        fprintf(stderr, "load_template_file failed\n");
+        return 0;
+      }
+      cache_template = 1;
     }
   }
   else
@@ -661,7 +686,7 @@ static int handle_fh(duk_context *ctx, FILE *f, const char *filename, const char
 
 	interactive_mode = 0;  /* global */
 
-	rc = duk_safe_call(ctx, wrapped_compile_execute, NULL /*udata*/, 4 /*nargs*/, 1 /*nret*/);
+	rc = duk_safe_call(ctx, wrapped_compile_execute, (void *) &cache_template /*udata*/, 4 /*nargs*/, 1 /*nret*/);
 
 #if defined(DUK_CMDLINE_LOWMEM)
 	lowmem_clear_exec_timeout();
@@ -692,10 +717,39 @@ static int handle_fh(duk_context *ctx, FILE *f, const char *filename, const char
 	goto cleanup;
 }
 
+/* Run the bytecode of a page from the site bundle, which stays mapped. */
+static int handle_bundled(duk_context *ctx, const char *filename, const char *code, size_t code_len) {
+	int rc;
+
+	duk_push_undefined(ctx);  /* no bytecode output */
+	duk_push_pointer(ctx, (void *) code);
+	duk_push_uint(ctx, (duk_uint_t) code_len);
+	duk_push_string(ctx, filename);
+
+	interactive_mode = 0;  /* global */
+
+	rc = duk_safe_call(ctx, wrapped_compile_execute, NULL /*udata*/, 4 /*nargs*/, 1 /*nret*/);
+
+#if defined(DUK_CMDLINE_LOWMEM)
+	lowmem_clear_exec_timeout();
+#endif
+
+	if (rc != DUK_EXEC_SUCCESS) {
+		print_pop_error(ctx, stderr);
+		fprintf(stderr, "error in executing file %s\n", filename);
+		fflush(stderr);
+		return -1;
+	}
+	duk_pop(ctx);
+	return 0;
+}
+
 static int handle_file(duk_context *ctx, const char *filename, const char *bytecode_filename) {
 	FILE *f = NULL;
 	int retval;
 	char fnbuf[256];
+	const char *bundled;
+	size_t bundled_len;
 
 	/* Example of sending an application specific debugger notification. */
 	duk_push_string(ctx, "DebuggerHandleFile");
@@ -713,6 +767,11 @@ static int handle_file(duk_context *ctx, const char *filename, const char *bytec
 #endif
 	fnbuf[sizeof(fnbuf) - 1] = (char) 0;
 
+	/* A page in the site bundle is run without opening anything in the docroot. */
+	if (!bytecode_filename && load_template_bundled(filename, &bundled, &bundled_len)) {
+		return handle_bundled(ctx, filename, bundled, bundled_len);
+	}
+
 	f = fopen(fnbuf, "rb");
 	if (!f) {
 		fprintf(stderr, "failed to open source file: %s\n", filename);
@@ -729,6 +788,85 @@ static int handle_file(duk_context *ctx, const char *filename, const char *bytec
 	return -1;
 }
 
+/* Evaluate a loaded preload buffer into the global object, takes ownership of buf. */
+static int eval_preload(duk_context *ctx, const char *filename, char *buf, size_t buflen) {
+	int rc;
+
+	duk_push_undefined(ctx);  /* no bytecode output */
+	duk_push_pointer(ctx, (void *) buf);
+	duk_push_uint(ctx, (duk_uint_t) buflen);
+	duk_push_string(ctx, filename);
+
+	interactive_mode = 0;  /* global */
+
+	rc = duk_safe_call(ctx, wrapped_compile_execute, NULL /*udata*/, 4 /*nargs*/, 1 /*nret*/);
+
+	free(buf);
+
+	if (rc != DUK_EXEC_SUCCESS) {
+		print_pop_error(ctx, stderr);
+		fprintf(stderr, "error in preloading file %s\n", filename);
+		fflush(stderr);
+		return -1;
+	}
+	duk_pop(ctx);
+	return 0;
+}
+
+/* Evaluate a file once into the global object, ahead of any request. */
+static int handle_preload(duk_context *ctx, const char *filename) {
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	if (!load_template_preload(filename, &buf, &buflen)) {
+		fprintf(stderr, "failed to preload %s\n", filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	return eval_preload(ctx, filename, buf, buflen);
+}
+
+#if defined(JST_EMBEDDED_PRELUDE)
+/* Evaluate php.jst (embedded bytecode unless overridden on disk) ahead of any request. */
+static int handle_php_prelude(duk_context *ctx) {
+	char *buf = NULL;
+	size_t buflen = 0;
+
+	if (!load_template_php_prelude(&buf, &buflen)) {
+		fprintf(stderr, "failed to load php.jst prelude\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	return eval_preload(ctx, "php.jst", buf, buflen);
+}
+#endif
+
+/* Run one request in a heap which is reused across requests. */
+static int handle_request(duk_context *ctx, const char *filename) {
+	const char *args[2];
+	int retval;
+
+	args[0] = main_argv[0];
+	args[1] = filename;
+
+	jst_timing_start();
+	jst_capture_begin(2, args);
+	ccsp_extensions_request_begin(ctx);
+	retval = handle_file(ctx, filename, NULL);
+	ccsp_extensions_request_end(ctx);
+
+	/* Keep the heap from growing across requests. */
+	jst_timing_begin("gc", NULL);
+	duk_gc(ctx, 0);
+	jst_timing_end("gc");
+
+	jst_capture_end();
+	jst_timing_report(filename);
+	return retval;
+}
+
 static int handle_eval(duk_context *ctx, char *code) {
 	int rc;
 	int retval = -1;
@@ -1344,11 +1482,21 @@ int main(int argc, char *argv[], char **envp) {
 	int verbose = 0;
 	int run_stdin = 0;
 	const char *compile_filename = NULL;
+	const char *fastcgi_addr = NULL;
+	const char *serve_addr = NULL;
+	const char *serve_root = NULL;
+	const char *script = NULL;
+	const char *page = NULL;
+	int have_preloads = 0;
+	int zygote = 0;
 	int i;
 
 	main_argc = argc;
 	main_argv = (char **) argv;
 
+	jst_timing_init();
+	jst_capture_init();
+
   //this allows testing the jst parser output
   if(argc == 3 && strcmp(argv[1], "--parse-only")==0)
   {
@@ -1365,6 +1513,36 @@ int main(int argc, char *argv[], char **envp) {
     exit(0);
   }
 
+  //builds the site bundle pages are run from, see jst_precompile.c
+  if(argc >= 3 && strcmp(argv[1], "--precompile")==0)
+  {
+    const char* output = NULL;
+    const char* preloads[MAX_PRECOMPILE_PRELOADS];
+    int preload_count = 0;
+
+    for(i = 3; i < argc - 1; i += 2)
+    {
+      if(strcmp(argv[i], "-o") == 0)
+        output = argv[i+1];
+      else if(strcmp(argv[i], "--preload") == 0 && preload_count < MAX_PRECOMPILE_PRELOADS)
+        preloads[preload_count++] = argv[i+1];
+      else
+        break;
+    }
+    if(!output || i != argc)
+    {
+      fprintf(stderr, "Usage: jst --precompile DOCROOT -o FILE [--preload FILE]...\n");
+      exit(1);
+    }
+    exit(jst_precompile(argv[2], output, preloads, preload_count));
+  }
+
+  //reports what each page includes and what that costs, see jst_analyze.c
+  if(argc == 3 && strcmp(argv[1], "--analyze-includes")==0)
+  {
+    exit(jst_analyze_includes(argv[2]));
+  }
+
   if(access("/tmp/jst_enable_dbg", F_OK) == 0 && argc >= 2)
   {
     char path[256];
@@ -1521,13 +1699,46 @@ int main(int argc, char *argv[], char **envp) {
 			verbose = 1;
 		} else if (strcmp(arg, "--run-stdin") == 0) {
 			run_stdin = 1;
+		} else if (strcmp(arg, "--fastcgi") == 0) {
+			if (i == argc - 1) {
+				goto usage;
+			}
+			i++;
+			fastcgi_addr = argv[i];
+		} else if (strcmp(arg, "--zygote") == 0) {
+			zygote = 1;
+		} else if (strcmp(arg, "--serve") == 0) {
+			if (i == argc - 1) {
+				goto usage;
+			}
+			i++;
+			serve_addr = argv[i];
+		} else if (strcmp(arg, "--root") == 0) {
+			if (i == argc - 1) {
+				goto usage;
+			}
+			i++;
+			serve_root = argv[i];
+		} else if (strcmp(arg, "--preload") == 0) {
+			if (i == argc - 1) {
+				goto usage;
+			}
+			i++;  /* evaluated after heap creation */
+			have_preloads = 1;
 		} else if (strlen(arg) >= 1 && arg[0] == '-') {
 			goto usage;
 		} else {
+			page = have_files ? NULL : arg;
 			have_files = 1;
 		}
 	}
-	if (!have_files && !have_eval && !run_stdin) {
+	if (zygote && !fastcgi_addr) {
+		goto usage;
+	}
+	if ((serve_addr != NULL) != (serve_root != NULL) || (serve_addr && fastcgi_addr)) {
+		goto usage;
+	}
+	if (!have_files && !have_eval && !run_stdin && !fastcgi_addr && !serve_addr) {
 		interactive = 1;
 	}
 
@@ -1548,7 +1759,76 @@ int main(int argc, char *argv[], char **envp) {
 	 *  Create heap
 	 */
 
+	if (!fastcgi_addr && !serve_addr) {
+		jst_capture_begin(argc, (const char * const *) argv);  /* before the post data is read */
+	}
+
+	/* A single page with no code is sent as it is, there is nothing to run it for. */
+	if (page && !have_eval && !have_preloads && !run_stdin && !interactive && !compile_filename &&
+	    !fastcgi_addr && !serve_addr && jst_static_page(page)) {
+		script = page;
+		goto cleanup;
+	}
+
+	jst_timing_begin("heap", NULL);
 	ctx = create_duktape_heap(alloc_provider, debugger, lowmem_log);
+	jst_timing_end("heap");
+
+	/*
+	 *  Evaluate any preload file(s)
+	 */
+
+#if defined(JST_EMBEDDED_PRELUDE)
+	if (fastcgi_addr || serve_addr) {
+		if (handle_php_prelude(ctx) != 0) {
+			template_php_prelude_failed();  /* pages include php.jst themselves */
+		}
+	} else {
+		template_set_lazy_php_prelude(1);  /* only evaluated for a page which includes it */
+	}
+#endif
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--preload") == 0) {
+			i++;
+			if (handle_preload(ctx, argv[i]) != 0) {
+				retval = 1;
+				goto cleanup;
+			}
+		}
+	}
+
+	/* Preloads keep their echo() calls, pages from here on write their content as static blocks
+	 * (unless compiled to a bytecode file, which couldn't hold the blocks). */
+	template_set_static_blocks(compile_filename == NULL);
+
+	/*
+	 *  Serve requests with a warm heap if requested
+	 */
+
+	if (fastcgi_addr) {
+		if (!load_template_prelude()) {
+			retval = 1;
+			goto cleanup;
+		}
+		jst_timing_report(NULL);  /* startup */
+		if (jst_fastcgi_run(ctx, fastcgi_addr, handle_request, zygote) != 0) {
+			retval = 1;
+		}
+		goto cleanup;
+	}
+
+	if (serve_addr) {
+		if (!load_template_prelude()) {
+			retval = 1;
+			goto cleanup;
+		}
+		jst_timing_report(NULL);  /* startup */
+		if (jst_http_run(ctx, serve_addr, serve_root, handle_request) != 0) {
+			retval = 1;
+		}
+		goto cleanup;
+	}
 
 	/*
 	 *  Execute any argument file(s)
@@ -1573,6 +1853,9 @@ int main(int argc, char *argv[], char **envp) {
 		} else if (strlen(arg) == 2 && strcmp(arg, "-c") == 0) {
 			i++;  /* skip filename */
 			continue;
+		} else if (strcmp(arg, "--preload") == 0) {
+			i++;  /* skip filename */
+			continue;
 		} else if (strlen(arg) >= 1 && arg[0] == '-') {
 			continue;
 		}
@@ -1582,6 +1865,7 @@ int main(int argc, char *argv[], char **envp) {
 			fflush(stderr);
 		}
 
+		script = arg;
 		if (handle_file(ctx, arg, compile_filename) != 0) {
 			retval = 1;
 			goto cleanup;
@@ -1645,10 +1929,17 @@ int main(int argc, char *argv[], char **envp) {
 		duk_gc(ctx, 0);
 	}
 	if (ctx && !no_heap_destroy) {
+		jst_timing_begin("heap_destroy", NULL);
 		destroy_duktape_heap(ctx, alloc_provider);
+		jst_timing_end("heap_destroy");
 	}
 	ctx = NULL;
 
+	if (!fastcgi_addr && !serve_addr) {
+		jst_capture_end();
+		jst_timing_report(script);
+	}
+
   if(jst_debug_file_name)
     free(jst_debug_file_name);
 
@@ -1665,6 +1956,19 @@ int main(int argc, char *argv[], char **envp) {
 	                "   -e CODE            evaluate code\n"
 			"   -c FILE            compile into bytecode (use with only one file argument)\n"
 			"   --run-stdin        treat stdin like a file, i.e. compile full input (not line by line)\n"
+			"   --fastcgi ADDR     serve requests as a FastCGI responder on ADDR (socket path, host:port,\n"
+			"                      or - for a listen socket passed in on stdin) reusing one heap\n"
+			"   --zygote           with --fastcgi, fork an initialized child for every request\n"
+			"   --serve ADDR       serve HTTP on ADDR (host:port or socket path) reusing one heap,\n"
+			"                      running .jst files and serving other files from --root\n"
+			"   --root DIR         document root for --serve\n"
+			"   --preload FILE     evaluate FILE (e.g. php.jst) once at startup; includes of it are skipped\n"
+			"   --precompile DIR -o FILE [--preload FILE]...\n"
+			"                      compile every .jst page under DIR into the site bundle FILE, which\n"
+			"                      pages are then run from when it is installed (or named by JST_BUNDLE)\n"
+			"   --analyze-includes DIR\n"
+			"                      print the include tree of every .jst page under DIR with the js size,\n"
+			"                      parse and compile time of each file, and which files cost the most\n"
 			"   --verbose          verbose messages to stderr\n"
 	                "   --restrict-memory  use lower memory limit (used by test runner)\n"
 	                "   --alloc-default    use Duktape default allocator\n"
@@ -27,8 +27,52 @@ extern "C" {
 
 duk_ret_t ccsp_extensions_load(duk_context *ctx);
 duk_ret_t ccsp_extensions_unload(duk_context *ctx);
+duk_ret_t ccsp_extensions_request_begin(duk_context *ctx);
+duk_ret_t ccsp_extensions_request_end(duk_context *ctx);
+duk_ret_t ccsp_extensions_after_fork(duk_context *ctx);
 
 int load_template_file(const char *filename, char** bufout, size_t* lenout, int top);
+int load_template_preload(const char *filename, char** bufout, size_t* lenout);
+int load_template_prelude(void);
+#ifdef JST_EMBEDDED_PRELUDE
+int load_template_php_prelude(char** bufout, size_t* lenout);
+void template_php_prelude_failed(void);
+#endif
+/* includes of php.jst evaluate the embedded bytecode when they are reached */
+void template_set_lazy_php_prelude(int on);
+int load_template_cached(const char *filename, char** bufout, size_t* lenout);
+int store_template_cached(const char* bytecode, size_t len);
+int load_template_bundled(const char *filename, const char** bufout, size_t* lenout);
+/* pages write their content from a table of static blocks instead of with echo('...') */
+void template_set_static_blocks(int on);
+
+/* sends a page which has no code as it is, without a heap. returns 0 if it has code */
+int jst_static_page(const char* filename);
+
+/* builds a bundle of every page under docroot for load_template_bundled, see jst_precompile.c */
+int jst_precompile(const char* docroot, const char* output, const char* const* preloads, int preload_count);
+
+/* prints the include tree and cost of every page under docroot, see jst_analyze.c */
+int jst_analyze_includes(const char* docroot);
+
+/* opt-in per request phase timing, see jst_timing.c */
+void jst_timing_init(void);
+void jst_timing_start(void);
+void jst_timing_begin(const char* phase, const char* detail);
+void jst_timing_end(const char* phase);
+void jst_timing_report(const char* script);
+
+/* opt-in request capture for tools/jst_replay.py, see jst_capture.c */
+void jst_capture_init(void);
+void jst_capture_begin(int argc, const char* const* argv);
+void jst_capture_body(const char* data, size_t len);
+void jst_capture_end(void);
+
+/* runs a single request for filename using the current environment, stdin and stdout */
+typedef int (*jst_request_handler)(duk_context *ctx, const char *filename);
+
+int jst_fastcgi_run(duk_context *ctx, const char *addr, jst_request_handler handler, int fork_per_request);
+int jst_http_run(duk_context *ctx, const char *addr, const char *root, jst_request_handler handler);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,476 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/* jst --analyze-includes: shows what every page under a document root includes and what each
+   included file costs, to find the partials worth making cheaper.
+
+   Each page is parsed as a request for it would be (see site_open) with the parser observed
+   (see template_observer). For each page its include tree is printed, static includes as they
+   nest and then the runtime includes which name a file, which are loaded afterwards the way
+   ccsp.include would load them. A runtime include of anything but a string is listed but can't
+   be followed. Each file in the tree shows the js it generated, the time to parse it and the
+   time to compile that js on its own (- if it isn't valid js by itself), all including whatever
+   it included in turn.
+
+   The summary then lists every file by its own cost, i.e. without what it included, times the
+   number of times it was loaded across all pages, with the number of pages loading it. */
+
+#define ANALYZE_MAX_DEPTH 64
+#define ANALYZE_NAME_WIDTH 48
+#define MAX_ANALYZE_ROOT_LEN 256
+
+enum analyze_kind
+{
+  analyze_loaded,
+  analyze_skipped,      /* already included once, or part of the prelude */
+  analyze_missing,
+  analyze_dynamic,      /* runtime include of something other than a string */
+  analyze_runtime       /* the runtime includes of the page follow */
+};
+
+typedef struct analyze_node
+{
+  char* name;
+  int pages;
+  int last_page;
+  int loads;
+  int compiled;
+  uint64_t self_len;
+  uint64_t self_parse_ns;
+  uint64_t self_compile_ns;
+}analyze_node;
+
+typedef struct analyze_event
+{
+  int kind;
+  int depth;
+  int node;
+  char* text;
+  size_t js_len;
+  uint64_t parse_ns;
+  int64_t compile_ns;   /* -1 if it didn't compile on its own */
+}analyze_event;
+
+typedef struct analyze_frame
+{
+  int event;
+  uint64_t start;
+  uint64_t excluded;
+  size_t child_len;
+  uint64_t child_parse_ns;
+  int64_t child_compile_ns;
+}analyze_frame;
+
+typedef struct analyze_state
+{
+  duk_context* ctx;
+  char root[MAX_ANALYZE_ROOT_LEN];
+  analyze_node* nodes;
+  int node_count;
+  int node_alloc;
+  analyze_event* events;
+  int event_count;
+  int event_alloc;
+  analyze_frame stack[ANALYZE_MAX_DEPTH];
+  int depth;
+  int base_depth;
+  int page;
+  uint64_t excluded;    /* time spent compiling, which isn't parse time */
+  char** runtime;       /* runtime includes of the current page to follow */
+  int runtime_count;
+  int runtime_alloc;
+}analyze_state;
+
+static uint64_t analyze_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int analyze_grow(void** p, int count, int* alloc, size_t size)
+{
+  void* n;
+
+  if(count < *alloc)
+    return 1;
+  n = realloc(*p, (*alloc ? *alloc * 2 : 64) * size);
+  if(!n)
+    return 0;
+  *p = n;
+  *alloc = *alloc ? *alloc * 2 : 64;
+  return 1;
+}
+
+/* the node of filename, by its real path so different paths to one file are one node */
+static int analyze_node_for(analyze_state* st, const char* filename)
+{
+  char* path;
+  const char* name;
+  size_t root_len = strlen(st->root);
+  int i;
+
+  path = realpath(filename, NULL);
+  if(!path)
+    return -1;
+  name = strncmp(path, st->root, root_len) == 0 ? path + root_len : path;
+
+  for(i = 0; i < st->node_count; ++i)
+  {
+    if(strcmp(st->nodes[i].name, name) == 0)
+    {
+      free(path);
+      return i;
+    }
+  }
+
+  if(!analyze_grow((void**)&st->nodes, st->node_count, &st->node_alloc, sizeof(analyze_node)))
+  {
+    free(path);
+    return -1;
+  }
+  memset(&st->nodes[st->node_count], 0, sizeof(analyze_node));
+  st->nodes[st->node_count].name = strdup(name);
+  st->nodes[st->node_count].last_page = -1;
+  free(path);
+  if(!st->nodes[st->node_count].name)
+    return -1;
+  return st->node_count++;
+}
+
+static int analyze_add_event(analyze_state* st, int kind, const char* text)
+{
+  analyze_event* ev;
+
+  if(!analyze_grow((void**)&st->events, st->event_count, &st->event_alloc, sizeof(analyze_event)))
+    return -1;
+  ev = &st->events[st->event_count];
+  memset(ev, 0, sizeof(analyze_event));
+  ev->kind = kind;
+  ev->depth = st->base_depth + st->depth;
+  ev->node = -1;
+  ev->text = text ? strdup(text) : NULL;
+  return st->event_count++;
+}
+
+static int64_t analyze_compile(analyze_state* st, const char* filename, const char* js, size_t js_len)
+{
+  uint64_t start = analyze_now();
+  int rc;
+
+  duk_push_string(st->ctx, filename);
+  rc = duk_pcompile_lstring_filename(st->ctx, DUK_COMPILE_SHEBANG, js, js_len);
+  duk_pop(st->ctx);
+  if(rc != 0)
+    return -1;
+  return analyze_now() - start;
+}
+
+static void analyze_begin(const char* filename, int top, void* arg)
+{
+  analyze_state* st = (analyze_state*)arg;
+  analyze_frame* frame;
+
+  (void)top;
+
+  if(st->depth == ANALYZE_MAX_DEPTH)
+    return;
+  frame = &st->stack[st->depth];
+  frame->event = analyze_add_event(st, analyze_loaded, filename);
+  frame->child_len = 0;
+  frame->child_parse_ns = 0;
+  frame->child_compile_ns = 0;
+  frame->excluded = st->excluded;
+  st->depth++;
+  frame->start = analyze_now();
+}
+
+static void analyze_end(const char* filename, const char* js, size_t js_len, void* arg)
+{
+  analyze_state* st = (analyze_state*)arg;
+  uint64_t now = analyze_now();
+  analyze_frame* frame;
+  analyze_event* ev;
+  analyze_node* node;
+  uint64_t start;
+
+  if(st->depth == 0)
+    return;
+  frame = &st->stack[--st->depth];
+  if(frame->event < 0)
+    return;
+  ev = &st->events[frame->event];
+
+  if(!js)
+  {
+    ev->kind = access(filename, F_OK) == 0 ? analyze_skipped : analyze_missing;
+    return;
+  }
+
+  ev->js_len = js_len;
+  ev->parse_ns = now - frame->start - (st->excluded - frame->excluded);
+  start = analyze_now();
+  ev->compile_ns = analyze_compile(st, filename, js, js_len);
+  st->excluded += analyze_now() - start;
+
+  ev->node = analyze_node_for(st, filename);
+  if(ev->node >= 0)
+  {
+    node = &st->nodes[ev->node];
+    if(node->last_page != st->page)
+    {
+      node->last_page = st->page;
+      node->pages++;
+    }
+    node->loads++;
+    node->self_len += js_len > frame->child_len ? js_len - frame->child_len : 0;
+    node->self_parse_ns += ev->parse_ns > frame->child_parse_ns ? ev->parse_ns - frame->child_parse_ns : 0;
+    if(ev->compile_ns >= 0 && frame->child_compile_ns >= 0)
+    {
+      node->compiled++;
+      node->self_compile_ns += ev->compile_ns > frame->child_compile_ns ? ev->compile_ns - frame->child_compile_ns : 0;
+    }
+  }
+
+  if(st->depth > 0)
+  {
+    frame = &st->stack[st->depth - 1];
+    frame->child_len += js_len;
+    frame->child_parse_ns += ev->parse_ns;
+    if(ev->compile_ns < 0 || frame->child_compile_ns < 0)
+      frame->child_compile_ns = -1;
+    else
+      frame->child_compile_ns += ev->compile_ns;
+  }
+}
+
+/* include ( 'path' ) is followed once the page is done, anything else is only listed */
+static void analyze_runtime_include(const char* s, const char* end, void* arg)
+{
+  analyze_state* st = (analyze_state*)arg;
+  const char* p = s + 7;
+  const char* path;
+  const char* eol;
+  char quote;
+  char text[ANALYZE_NAME_WIDTH + 1];
+
+  for(eol = s; eol < end && *eol != '\n' && *eol != ';' && eol - s < ANALYZE_NAME_WIDTH; ++eol)
+    ;
+
+  while(p < end && *p == ' ')
+    p++;
+  if(p < end && *p == '(')
+    p++;
+  while(p < end && *p == ' ')
+    p++;
+  if(p < end && (*p == '\'' || *p == '"'))
+  {
+    quote = *p++;
+    for(path = p; p < end && *p != quote && *p != '\n'; ++p)
+      ;
+    if(p < end && *p == quote)
+    {
+      const char* q = p + 1;
+
+      while(q < end && *q == ' ')
+        q++;
+      if(q < end && *q == ')' && analyze_grow((void**)&st->runtime, st->runtime_count, &st->runtime_alloc, sizeof(char*)))
+      {
+        st->runtime[st->runtime_count] = strndup(path, p - path);
+        if(st->runtime[st->runtime_count])
+          st->runtime_count++;
+        return;
+      }
+    }
+  }
+
+  snprintf(text, sizeof(text), "%.*s", (int)(eol - s), s);
+  analyze_add_event(st, analyze_dynamic, text);
+}
+
+static void analyze_print_page(analyze_state* st, int first, int last)
+{
+  analyze_event* ev;
+  char name[ANALYZE_NAME_WIDTH * 2];
+  int i;
+
+  for(i = first; i < last; ++i)
+  {
+    ev = &st->events[i];
+    snprintf(name, sizeof(name), "%*s%s", ev->depth * 2, "", ev->text ? ev->text : "");
+    switch(ev->kind)
+    {
+    case analyze_loaded:
+      if(ev->compile_ns >= 0)
+        fprintf(stdout, "%-*s js %8zu  parse %8.3f ms  compile %8.3f ms  pages %d\n", ANALYZE_NAME_WIDTH, name,
+          ev->js_len, ev->parse_ns / 1e6, ev->compile_ns / 1e6, ev->node >= 0 ? st->nodes[ev->node].pages : 0);
+      else
+        fprintf(stdout, "%-*s js %8zu  parse %8.3f ms  compile        - ms  pages %d\n", ANALYZE_NAME_WIDTH, name,
+          ev->js_len, ev->parse_ns / 1e6, ev->node >= 0 ? st->nodes[ev->node].pages : 0);
+      break;
+    case analyze_skipped:
+      fprintf(stdout, "%-*s already included\n", ANALYZE_NAME_WIDTH, name);
+      break;
+    case analyze_missing:
+      fprintf(stdout, "%-*s missing\n", ANALYZE_NAME_WIDTH, name);
+      break;
+    case analyze_dynamic:
+      fprintf(stdout, "%-*s runtime include, not followed\n", ANALYZE_NAME_WIDTH, name);
+      break;
+    case analyze_runtime:
+      fprintf(stdout, "%*sat runtime:\n", ev->depth * 2, "");
+      break;
+    }
+  }
+}
+
+static int analyze_compare(const void* a, const void* b)
+{
+  const analyze_node* na = (const analyze_node*)a;
+  const analyze_node* nb = (const analyze_node*)b;
+  uint64_t ca = na->self_parse_ns + (na->compiled ? na->self_compile_ns * na->loads / na->compiled : 0);
+  uint64_t cb = nb->self_parse_ns + (nb->compiled ? nb->self_compile_ns * nb->loads / nb->compiled : 0);
+
+  return ca < cb ? 1 : (ca > cb ? -1 : strcmp(na->name, nb->name));
+}
+
+static void analyze_print_summary(analyze_state* st)
+{
+  analyze_node* node;
+  uint64_t compile_ns;
+  int i;
+
+  qsort(st->nodes, st->node_count, sizeof(analyze_node), analyze_compare);
+
+  fprintf(stdout, "\n%-*s %6s %6s %12s %12s %12s %12s\n", ANALYZE_NAME_WIDTH, "file (own cost, all loads)",
+    "pages", "loads", "js bytes", "parse ms", "compile ms", "total ms");
+  for(i = 0; i < st->node_count; ++i)
+  {
+    node = &st->nodes[i];
+    /* files which don't compile on their own are costed as the average of their other loads */
+    if(node->compiled)
+    {
+      compile_ns = node->self_compile_ns * node->loads / node->compiled;
+      fprintf(stdout, "%-*s %6d %6d %12llu %12.3f %12.3f %12.3f\n", ANALYZE_NAME_WIDTH, node->name,
+        node->pages, node->loads, (unsigned long long)node->self_len,
+        node->self_parse_ns / 1e6, compile_ns / 1e6, (node->self_parse_ns + compile_ns) / 1e6);
+    }
+    else
+      fprintf(stdout, "%-*s %6d %6d %12llu %12.3f %12s %12.3f\n", ANALYZE_NAME_WIDTH, node->name,
+        node->pages, node->loads, (unsigned long long)node->self_len,
+        node->self_parse_ns / 1e6, "-", node->self_parse_ns / 1e6);
+  }
+}
+
+int jst_analyze_includes(const char* docroot)
+{
+  template_observer observer;
+  analyze_state st;
+  char** pages;
+  int* firsts = NULL;
+  char* buf;
+  size_t buflen;
+  int count;
+  int rc = 1;
+  int i;
+  int j;
+
+  memset(&st, 0, sizeof(st));
+
+  count = site_open(docroot, NULL, 0, &pages);
+  if(count < 0)
+    return 1;
+  template_set_static_blocks(1);
+
+  if(!getcwd(st.root, sizeof(st.root) - 1))
+    goto done;
+  strcat(st.root, "/");
+
+  firsts = (int*)malloc((count + 1) * sizeof(int));
+  st.ctx = duk_create_heap_default();
+  if(!firsts || !st.ctx)
+    goto done;
+
+  observer.begin = analyze_begin;
+  observer.end = analyze_end;
+  observer.runtime_include = analyze_runtime_include;
+  observer.arg = &st;
+  template_set_observer(&observer);
+
+  for(i = 0; i < count; ++i)
+  {
+    st.page = i;
+    st.depth = 0;
+    st.base_depth = 0;
+    firsts[i] = st.event_count;
+
+    if(load_template_file(pages[i], &buf, &buflen, 1))
+      free(buf);
+
+    /* the runtime includes are loaded after the page, as they would be when it runs */
+    if(st.runtime_count)
+    {
+      analyze_add_event(&st, analyze_runtime, NULL);
+      st.base_depth = 1;
+      for(j = 0; j < st.runtime_count; ++j)
+      {
+        if(load_template_file(st.runtime[j], &buf, &buflen, 0))
+          free(buf);
+        free(st.runtime[j]);
+      }
+      st.runtime_count = 0;
+    }
+  }
+  firsts[count] = st.event_count;
+  template_set_observer(NULL);
+
+  /* printed once every page is done so the page counts are complete */
+  for(i = 0; i < count; ++i)
+  {
+    analyze_print_page(&st, firsts[i], firsts[i + 1]);
+    fprintf(stdout, "\n");
+  }
+  analyze_print_summary(&st);
+  rc = 0;
+
+done:
+  template_set_observer(NULL);
+  if(st.ctx)
+    duk_destroy_heap(st.ctx);
+  for(i = 0; i < st.event_count; ++i)
+    free(st.events[i].text);
+  free(st.events);
+  for(i = 0; i < st.node_count; ++i)
+    free(st.nodes[i].name);
+  free(st.nodes);
+  free(st.runtime);
+  free(firsts);
+  site_free_pages(pages, count);
+  return rc;
+}
@@ -0,0 +1,181 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "jst_internal.h"
+
+/* Arena for the template parser.
+
+   Template sources and the code of included templates are allocated from chunks which are all
+   released at once by jst_arena_release when the outermost load_template_file of a request is
+   done, so a page with many includes costs a handful of mallocs rather than several per
+   template. Each new chunk is at least twice the size of the one before it. Memory is not
+   zeroed.
+
+   Template files are mapped rather than copied into the arena (jst_arena_map_file), the
+   mappings are unmapped by jst_arena_release along with the chunks.
+
+   The first chunk is kept so a fastcgi or --serve process doesn't go back to malloc for every
+   request. */
+
+#define ARENA_FIRST_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk
+{
+  struct arena_chunk* prev;
+  size_t size;
+  size_t used;
+  size_t last;  /* offset of the most recent allocation, which can grow in place */
+}arena_chunk;
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct arena_mapping
+{
+  struct arena_mapping* next;
+  void* addr;
+  size_t len;
+}arena_mapping;
+
+static arena_chunk* g_arena = NULL;
+static arena_mapping* g_arena_mappings = NULL;
+
+static char* chunk_data(arena_chunk* chunk)
+{
+  return (char*)chunk + ARENA_HEADER_SIZE;
+}
+
+static arena_chunk* arena_new_chunk(size_t min_size)
+{
+  arena_chunk* chunk;
+  size_t size = g_arena ? g_arena->size * 2 : ARENA_FIRST_CHUNK_SIZE;
+
+  while(size < min_size)
+    size *= 2;
+
+  chunk = (arena_chunk*)malloc(ARENA_HEADER_SIZE + size);
+  if(!chunk)
+  {
+    CosaPhpExtLog("arena failed to alloc %zu bytes\n", size);
+    return NULL;
+  }
+  chunk->prev = g_arena;
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->last = 0;
+  g_arena = chunk;
+  return chunk;
+}
+
+void* jst_arena_alloc(size_t size)
+{
+  arena_chunk* chunk = g_arena;
+  size_t offset;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if(!chunk || chunk->size - chunk->used < size)
+  {
+    chunk = arena_new_chunk(size);
+    if(!chunk)
+      return NULL;
+  }
+  offset = chunk->used;
+  chunk->last = offset;
+  chunk->used += size;
+  return chunk_data(chunk) + offset;
+}
+
+/* like realloc, p (of old_size bytes) is grown in place if it was the last allocation and
+   there is room left in its chunk */
+void* jst_arena_grow(void* p, size_t old_size, size_t new_size)
+{
+  arena_chunk* chunk = g_arena;
+  void* np;
+
+  if(!p)
+    return jst_arena_alloc(new_size);
+
+  if(chunk && (char*)p == chunk_data(chunk) + chunk->last)
+  {
+    size_t size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(chunk->size - chunk->last >= size)
+    {
+      chunk->used = chunk->last + size;
+      return p;
+    }
+  }
+
+  np = jst_arena_alloc(new_size);
+  if(np)
+    memcpy(np, p, old_size < new_size ? old_size : new_size);
+  return np;
+}
+
+/* maps filename read only until jst_arena_release, see map_file */
+int jst_arena_map_file(const char* filename, const char** bufout, size_t* lenout)
+{
+  arena_mapping* mapping = (arena_mapping*)jst_arena_alloc(sizeof(arena_mapping));
+
+  if(!mapping)
+    return 0;
+
+  if(!map_file(filename, bufout, lenout))
+    return 0;
+
+  mapping->addr = (void*)*bufout;
+  mapping->len = *lenout;
+  mapping->next = g_arena_mappings;
+  g_arena_mappings = mapping;
+  return *lenout;
+}
+
+/* releases everything allocated for the request */
+void jst_arena_release(void)
+{
+  arena_chunk* chunk;
+
+  while(g_arena_mappings)
+  {
+    munmap(g_arena_mappings->addr, g_arena_mappings->len);
+    g_arena_mappings = g_arena_mappings->next;
+  }
+
+  while(g_arena && g_arena->prev)
+  {
+    chunk = g_arena;
+    g_arena = chunk->prev;
+    free(chunk);
+  }
+
+  /* keep the first chunk, unless a big request left it oversized */
+  if(g_arena && g_arena->size > ARENA_FIRST_CHUNK_SIZE)
+  {
+    free(g_arena);
+    g_arena = NULL;
+  }
+  if(g_arena)
+  {
+    g_arena->used = 0;
+    g_arena->last = 0;
+  }
+}
@@ -0,0 +1,362 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "jst_internal.h"
+
+/* Site bundle: the bytecode of every page of a site, built ahead of time by jst --precompile
+   (see jst_precompile.c) so a request runs its page without parsing or compiling anything.
+
+     header | hash table | entries | strings | bytecode
+
+   The hash table has a power of 2 number of slots, each the FNV-1a hash of a page name and the
+   index + 1 of its entry (0 for an empty slot), probed linearly. A page name is the path of the
+   page relative to the document root, e.g. actionHandler/ajaxSet_index_userbar.jst, i.e. the
+   SCRIPT_NAME of a request for it without the leading /. An entry holds the offsets of the name,
+   of the files the page statically included (relative to the document root, NUL separated)
+   and of its code, which is the static content blocks of the page followed by its bytecode
+   (see template_static_image). All offsets are from the start of the file.
+
+   The bundle is mapped once per process from JST_BUNDLE_FILE, or the file named by the
+   JST_BUNDLE environment variable, and is used if it exists and isn't writable by anyone but
+   its owner, since the bytecode is trusted like that in the cache. Pages are never checked
+   against the document root, the bundle has to be rebuilt when the site changes. */
+
+#ifndef JST_BUNDLE_FILE
+#define JST_BUNDLE_FILE "/usr/video_analytics/site.jstb"
+#endif
+
+#define BUNDLE_MAGIC "JSTB"
+#define BUNDLE_FORMAT 3
+#define BUNDLE_ALIGN 8
+
+typedef struct bundle_header
+{
+  char magic[4];
+  uint32_t format;
+  uint32_t duk_version;
+  uint32_t entry_count;
+  uint32_t table_size;
+  uint32_t pad;
+}bundle_header;
+
+typedef struct bundle_slot
+{
+  uint32_t hash;
+  uint32_t entry;
+}bundle_slot;
+
+typedef struct bundle_entry
+{
+  uint32_t name_off;
+  uint32_t name_len;
+  uint32_t deps_off;
+  uint32_t dep_count;
+  uint32_t code_off;
+  uint32_t code_len;
+}bundle_entry;
+
+static int g_bundle_state = -1; /* -1 unknown, 0 disabled, 1 enabled */
+static const char* g_bundle = NULL;
+static size_t g_bundle_len = 0;
+
+/* 32 bit FNV-1a */
+static uint32_t bundle_hash(const char* name, size_t len)
+{
+  uint32_t h = 0x811c9dc5;
+  size_t i;
+
+  for(i = 0; i < len; ++i)
+  {
+    h ^= (unsigned char)name[i];
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+static int bundle_range(size_t off, size_t len)
+{
+  return off <= g_bundle_len && len <= g_bundle_len - off;
+}
+
+/* count NUL terminated strings from off */
+static int bundle_strings(size_t off, uint32_t count)
+{
+  const char* p = g_bundle + off;
+  const char* end = g_bundle + g_bundle_len;
+  const char* nul;
+
+  while(count--)
+  {
+    nul = (const char*)memchr(p, 0, end - p);
+    if(!nul)
+      return 0;
+    p = nul + 1;
+  }
+  return 1;
+}
+
+/* maps the bundle and checks everything a lookup relies on, so bundle_find needn't */
+static int bundle_open(const char* filename)
+{
+  const bundle_header* hdr;
+  const bundle_entry* entries;
+  const bundle_slot* table;
+  struct stat st;
+  uint32_t i;
+
+  if(stat(filename, &st) != 0)
+    return 0;
+
+  if(!S_ISREG(st.st_mode) || (st.st_uid != geteuid() && st.st_uid != 0) || (st.st_mode & (S_IWGRP | S_IWOTH)))
+  {
+    CosaPhpExtLog("bundle %s ignored, must be a file owned by us or root and not group/other writable\n", filename);
+    return 0;
+  }
+
+  if(!map_file(filename, &g_bundle, &g_bundle_len))
+    return 0;
+
+  hdr = (const bundle_header*)g_bundle;
+  if(g_bundle_len < sizeof(bundle_header) ||
+     memcmp(hdr->magic, BUNDLE_MAGIC, 4) != 0 ||
+     hdr->format != BUNDLE_FORMAT ||
+     hdr->duk_version != DUK_VERSION ||
+     hdr->table_size == 0 || (hdr->table_size & (hdr->table_size - 1)) != 0 ||
+     hdr->entry_count >= hdr->table_size ||
+     !bundle_range(sizeof(bundle_header), (size_t)hdr->table_size * sizeof(bundle_slot) + (size_t)hdr->entry_count * sizeof(bundle_entry)))
+    goto invalid;
+
+  table = (const bundle_slot*)(g_bundle + sizeof(bundle_header));
+  entries = (const bundle_entry*)(table + hdr->table_size);
+  for(i = 0; i < hdr->table_size; ++i)
+    if(table[i].entry > hdr->entry_count)
+      goto invalid;
+  for(i = 0; i < hdr->entry_count; ++i)
+  {
+    if(!bundle_range(entries[i].name_off, entries[i].name_len) ||
+       !bundle_range(entries[i].code_off, entries[i].code_len) ||
+       !bundle_range(entries[i].deps_off, 0) ||
+       !bundle_strings(entries[i].deps_off, entries[i].dep_count))
+      goto invalid;
+  }
+
+  CosaPhpExtLog("bundle %s mapped, %u pages\n", filename, hdr->entry_count);
+  return 1;
+
+invalid:
+  fprintf(stderr, "Error: %s is not a site bundle for this jst\n", filename);
+  munmap((void*)g_bundle, g_bundle_len);
+  g_bundle = NULL;
+  g_bundle_len = 0;
+  return 0;
+}
+
+int bundle_enabled(void)
+{
+  const char* filename;
+
+  if(g_bundle_state != -1)
+    return g_bundle_state;
+
+  filename = getenv("JST_BUNDLE");
+  g_bundle_state = bundle_open(filename ? filename : JST_BUNDLE_FILE);
+  return g_bundle_state;
+}
+
+/* finds the code of page name, which points into the mapped bundle.
+   dep_fn is called with each file the page included, relative to the document root */
+int bundle_find(const char* name, cache_dep_fn dep_fn, void* arg, const char** bufout, size_t* lenout)
+{
+  const bundle_header* hdr;
+  const bundle_slot* table;
+  const bundle_entry* entry;
+  size_t len = strlen(name);
+  uint32_t hash;
+  uint32_t i;
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(!bundle_enabled())
+    return 0;
+
+  hdr = (const bundle_header*)g_bundle;
+  table = (const bundle_slot*)(g_bundle + sizeof(bundle_header));
+  hash = bundle_hash(name, len);
+
+  for(i = hash & (hdr->table_size - 1); table[i].entry; i = (i + 1) & (hdr->table_size - 1))
+  {
+    entry = (const bundle_entry*)(table + hdr->table_size) + table[i].entry - 1;
+    if(table[i].hash != hash || entry->name_len != len || memcmp(g_bundle + entry->name_off, name, len) != 0)
+      continue;
+
+    if(dep_fn)
+    {
+      const char* dep = g_bundle + entry->deps_off;
+      uint32_t n;
+
+      for(n = 0; n < entry->dep_count; ++n)
+      {
+        dep_fn(dep, arg);
+        dep += strlen(dep) + 1;
+      }
+    }
+
+    *bufout = g_bundle + entry->code_off;
+    *lenout = entry->code_len;
+    CosaPhpExtLog("bundle hit for %s\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+static size_t bundle_align(size_t len)
+{
+  return (len + BUNDLE_ALIGN - 1) & ~(size_t)(BUNDLE_ALIGN - 1);
+}
+
+/* writes pages as a bundle to filename, through a temp file renamed into place so a running
+   jst never maps a partial bundle */
+int bundle_write(const char* filename, const bundle_page* pages, int count)
+{
+  bundle_header hdr;
+  bundle_slot* table;
+  bundle_entry* entries;
+  char tmp_path[512];
+  char* buf;
+  size_t strings_len = 0;
+  size_t code_len = 0;
+  size_t len;
+  size_t off;
+  size_t code_off;
+  uint32_t size = 2;
+  int fd;
+  int ok;
+  int i;
+  int j;
+
+  while(size < (uint32_t)count * 2)
+    size *= 2;
+
+  for(i = 0; i < count; ++i)
+  {
+    strings_len += strlen(pages[i].name) + 1;
+    for(j = 0; j < pages[i].dep_count; ++j)
+      strings_len += strlen(pages[i].deps[j]) + 1;
+    code_len += bundle_align(pages[i].code_len);
+  }
+
+  off = sizeof(bundle_header) + size * sizeof(bundle_slot) + count * sizeof(bundle_entry);
+  code_off = bundle_align(off + strings_len);
+  len = code_off + code_len;
+  if(len > UINT32_MAX)
+  {
+    fprintf(stderr, "Error: bundle too large\n");
+    return 0;
+  }
+
+  buf = (char*)calloc(1, len);
+  if(!buf)
+  {
+    fprintf(stderr, "Error: malloc oom\n");
+    return 0;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BUNDLE_MAGIC, 4);
+  hdr.format = BUNDLE_FORMAT;
+  hdr.duk_version = DUK_VERSION;
+  hdr.entry_count = count;
+  hdr.table_size = size;
+  memcpy(buf, &hdr, sizeof(hdr));
+
+  table = (bundle_slot*)(buf + sizeof(bundle_header));
+  entries = (bundle_entry*)(table + size);
+  for(i = 0; i < count; ++i)
+  {
+    size_t name_len = strlen(pages[i].name);
+    uint32_t hash = bundle_hash(pages[i].name, name_len);
+    uint32_t slot;
+
+    entries[i].name_off = off;
+    entries[i].name_len = name_len;
+    memcpy(buf + off, pages[i].name, name_len + 1);
+    off += name_len + 1;
+
+    entries[i].deps_off = off;
+    entries[i].dep_count = pages[i].dep_count;
+    for(j = 0; j < pages[i].dep_count; ++j)
+    {
+      size_t dep_len = strlen(pages[i].deps[j]);
+      memcpy(buf + off, pages[i].deps[j], dep_len + 1);
+      off += dep_len + 1;
+    }
+
+    entries[i].code_off = code_off;
+    entries[i].code_len = pages[i].code_len;
+    memcpy(buf + code_off, pages[i].code, pages[i].code_len);
+    code_off += bundle_align(pages[i].code_len);
+
+    for(slot = hash & (size - 1); table[slot].entry; slot = (slot + 1) & (size - 1))
+      ;
+    table[slot].hash = hash;
+    table[slot].entry = i + 1;
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmpXXXXXX", filename);
+  fd = mkstemp(tmp_path);
+  if(fd < 0)
+  {
+    fprintf(stderr, "Error: cannot create %s error:%s\n", tmp_path, strerror(errno));
+    free(buf);
+    return 0;
+  }
+
+  for(off = 0, ok = 1; ok && off < len; )
+  {
+    ssize_t rc = write(fd, buf + off, len - off);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      ok = 0;
+    else
+      off += rc;
+  }
+  if(fchmod(fd, 0644) != 0 || close(fd) != 0)
+    ok = 0;
+  if(!ok || rename(tmp_path, filename) != 0)
+  {
+    fprintf(stderr, "Error: failed to write %s\n", filename);
+    unlink(tmp_path);
+    free(buf);
+    return 0;
+  }
+
+  free(buf);
+  return 1;
+}
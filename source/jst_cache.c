@@ -0,0 +1,478 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "jst_internal.h"
+
+/* On disk cache of data derived from a set of files (e.g. compiled template bytecode).
+   Each entry is one file in JST_CACHE_DIR named after a hash of its key:
+
+     header | key | dependency records | data
+
+   A dependency record holds the path, size, device, inode and mtime of a file the data was built
+   from, or a size of -1 for a file which did not exist (so creating it later invalidates the entry).
+   These are as the file was when it was read rather than when the entry is stored, so a file
+   edited while the data was being built leaves an entry which is already stale.
+   An entry is only used if every dependency still matches what is on disk.
+   Entries stored with a time to live (rendered fragments, see cache_fragment in jst_prefix.js)
+   are named .jfc rather than .jbc and have their expiry time as their mtime. As their keys come
+   from the pages they are removed once found expired and there are at most
+   JST_CACHE_MAX_FRAGMENTS of them, the ones closest to expiring make way for new ones.
+   Being plain files the entries are shared by every jst process.
+   Entries are written to a temp file and renamed into place so readers never see a partial entry.
+
+   The cache is off unless JST_CACHE_DIR exists, is owned by us and is not writable by anyone else,
+   since whatever is read back from it is trusted (bytecode is not validated when loaded) */
+
+#ifndef JST_CACHE_DIR
+#define JST_CACHE_DIR "/tmp/jst_cache"
+#endif
+
+#ifndef JST_CACHE_MAX_FRAGMENTS
+#define JST_CACHE_MAX_FRAGMENTS 256
+#endif
+
+#define CACHE_EXT ".jbc"
+#define CACHE_TTL_EXT ".jfc"
+#define CACHE_MAGIC "JSTC"
+#define CACHE_FORMAT 5
+#define MAX_CACHE_PATH_LEN 512
+
+typedef struct cache_header
+{
+  char magic[4];
+  uint32_t format;
+  uint32_t duk_version;
+  uint32_t key_len;
+  uint32_t dep_count;
+  uint32_t data_len;
+  int64_t expires; /* time(), 0 for never */
+}cache_header;
+
+typedef struct cache_dep
+{
+  uint32_t path_len;
+  uint32_t pad;
+  int64_t size;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+}cache_dep;
+
+static int g_cache_state = -1; /* -1 unknown, 0 disabled, 1 enabled */
+
+static int cache_enabled(void)
+{
+  struct stat st;
+
+  if(g_cache_state != -1)
+    return g_cache_state;
+
+  g_cache_state = 0;
+  if(lstat(JST_CACHE_DIR, &st) != 0)
+    return 0;
+
+  if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+  {
+    CosaPhpExtLog("cache dir %s ignored, must be a directory owned by us and not group/other writable\n", JST_CACHE_DIR);
+    return 0;
+  }
+
+  g_cache_state = 1;
+  return 1;
+}
+
+/* 64 bit FNV-1a */
+static void cache_entry_path(const char* key, const char* ext, char* path, size_t path_len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char* p;
+
+  for(p = (const unsigned char*)key; *p; ++p)
+  {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(path, path_len, "%s/%016llx%s", JST_CACHE_DIR, (unsigned long long)h, ext);
+}
+
+static void cache_dep_from_stat(cache_dep* dep, const struct stat* st)
+{
+  memset(dep, 0, sizeof(cache_dep));
+  dep->size = st->st_size;
+  dep->dev = st->st_dev;
+  dep->ino = st->st_ino;
+  dep->mtime_sec = st->st_mtim.tv_sec;
+  dep->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static void cache_dep_absent(cache_dep* dep)
+{
+  memset(dep, 0, sizeof(cache_dep));
+  dep->size = -1;
+}
+
+static int read_fd(int fd, char* buf, size_t len)
+{
+  ssize_t rc;
+
+  while(len)
+  {
+    rc = read(fd, buf, len);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return 0;
+    buf += rc;
+    len -= rc;
+  }
+  return 1;
+}
+
+static int write_fd(int fd, const char* buf, size_t len)
+{
+  ssize_t rc;
+
+  while(len)
+  {
+    rc = write(fd, buf, len);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return 0;
+    buf += rc;
+    len -= rc;
+  }
+  return 1;
+}
+
+static int cache_read(const char* key, const char* ext, cache_dep_fn dep_fn, void* arg, char** bufout, size_t* lenout)
+{
+  char path[MAX_CACHE_PATH_LEN];
+  struct stat st;
+  struct stat cur_st;
+  cache_header* hdr;
+  cache_dep dep;
+  cache_dep cur;
+  char* buf;
+  char* p;
+  char* end;
+  size_t len;
+  uint32_t i;
+  int fd;
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(!cache_enabled())
+    return 0;
+
+  cache_entry_path(key, ext, path, sizeof(path));
+  fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if(fd < 0)
+    return 0;
+
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+     (st.st_mode & (S_IWGRP | S_IWOTH)) || (size_t)st.st_size < sizeof(cache_header))
+  {
+    close(fd);
+    return 0;
+  }
+
+  len = st.st_size;
+  buf = (char*)malloc(len);
+  if(!buf)
+  {
+    close(fd);
+    return 0;
+  }
+  if(!read_fd(fd, buf, len))
+  {
+    close(fd);
+    free(buf);
+    return 0;
+  }
+  close(fd);
+
+  end = buf + len;
+  hdr = (cache_header*)buf;
+  if(memcmp(hdr->magic, CACHE_MAGIC, 4) != 0 ||
+     hdr->format != CACHE_FORMAT ||
+     hdr->duk_version != DUK_VERSION ||
+     hdr->dep_count > (len - sizeof(cache_header)) / sizeof(cache_dep) ||
+     hdr->key_len != strlen(key))
+    goto miss;
+
+  if(hdr->expires && time(NULL) >= hdr->expires)
+  {
+    /* unless it was replaced since */
+    if(lstat(path, &cur_st) == 0 && cur_st.st_dev == st.st_dev && cur_st.st_ino == st.st_ino)
+      unlink(path);
+    goto miss;
+  }
+
+  p = buf + sizeof(cache_header);
+  if((size_t)(end - p) < hdr->key_len || memcmp(p, key, hdr->key_len) != 0)
+    goto miss;
+  p += hdr->key_len;
+
+  /* first pass validates every dependency, second pass reports them */
+  for(i = 0; i < hdr->dep_count; ++i)
+  {
+    char dep_path[MAX_CACHE_PATH_LEN];
+
+    if((size_t)(end - p) < sizeof(cache_dep))
+      goto miss;
+    memcpy(&dep, p, sizeof(cache_dep));
+    p += sizeof(cache_dep);
+    if(dep.path_len >= MAX_CACHE_PATH_LEN || (size_t)(end - p) < dep.path_len)
+      goto miss;
+    memcpy(dep_path, p, dep.path_len);
+    dep_path[dep.path_len] = 0;
+    p += dep.path_len;
+
+    if(stat(dep_path, &st) == 0)
+      cache_dep_from_stat(&cur, &st);
+    else if(errno == ENOENT)
+      cache_dep_absent(&cur);
+    else
+      goto miss;
+    if(cur.size != dep.size || cur.dev != dep.dev || cur.ino != dep.ino ||
+       cur.mtime_sec != dep.mtime_sec || cur.mtime_nsec != dep.mtime_nsec)
+    {
+      CosaPhpExtLog("cache entry for %s is stale, %s changed\n", key, dep_path);
+      goto miss;
+    }
+  }
+
+  if((size_t)(end - p) != hdr->data_len)
+    goto miss;
+
+  if(dep_fn)
+  {
+    char dep_path[MAX_CACHE_PATH_LEN];
+    char* q = buf + sizeof(cache_header) + hdr->key_len;
+
+    for(i = 0; i < hdr->dep_count; ++i)
+    {
+      memcpy(&dep, q, sizeof(cache_dep));
+      q += sizeof(cache_dep);
+      memcpy(dep_path, q, dep.path_len);
+      dep_path[dep.path_len] = 0;
+      q += dep.path_len;
+      dep_fn(dep_path, arg);
+    }
+  }
+
+  /* hand back the data in place */
+  len = hdr->data_len;
+  memmove(buf, p, len);
+  *bufout = buf;
+  *lenout = len;
+  CosaPhpExtLog("cache hit for %s\n", key);
+  return 1;
+
+miss:
+  free(buf);
+  return 0;
+}
+
+/* returns the cached data for key if every file it was built from is unchanged.
+   dep_fn is called with each dependency path of a valid entry before returning */
+int cache_load(const char* key, cache_dep_fn dep_fn, void* arg, char** bufout, size_t* lenout)
+{
+  return cache_read(key, CACHE_EXT, dep_fn, arg, bufout, lenout);
+}
+
+/* returns the data stored for key with cache_store_ttl if it hasn't expired */
+int cache_load_ttl(const char* key, char** bufout, size_t* lenout)
+{
+  return cache_read(key, CACHE_TTL_EXT, NULL, NULL, bufout, lenout);
+}
+
+/* removes the expired entries stored with a ttl and, if there are still
+   JST_CACHE_MAX_FRAGMENTS left, the one which would expire first */
+static void cache_sweep_ttl(void)
+{
+  char path[MAX_CACHE_PATH_LEN];
+  char first[MAX_CACHE_PATH_LEN] = {0};
+  time_t first_expires = 0;
+  time_t now = time(NULL);
+  struct dirent* ent;
+  struct stat st;
+  size_t len;
+  int count = 0;
+  DIR* d;
+
+  d = opendir(JST_CACHE_DIR);
+  if(!d)
+    return;
+
+  while((ent = readdir(d)) != NULL)
+  {
+    len = strlen(ent->d_name);
+    if(len <= sizeof(CACHE_TTL_EXT) - 1 || strcmp(ent->d_name + len - (sizeof(CACHE_TTL_EXT) - 1), CACHE_TTL_EXT) != 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", JST_CACHE_DIR, ent->d_name);
+    if(lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    /* the mtime is when it expires */
+    if(st.st_mtime <= now)
+    {
+      unlink(path);
+      continue;
+    }
+    if(!count++ || st.st_mtime < first_expires)
+    {
+      first_expires = st.st_mtime;
+      snprintf(first, sizeof(first), "%s", path);
+    }
+  }
+  closedir(d);
+
+  if(count >= JST_CACHE_MAX_FRAGMENTS)
+  {
+    CosaPhpExtLog("cache has %d fragments, removing %s\n", count, first);
+    unlink(first);
+  }
+}
+
+static int cache_write(const char* key, const char* ext, const cache_file* deps, int dep_count, int64_t expires, const char* data, size_t data_len)
+{
+  char path[MAX_CACHE_PATH_LEN];
+  char tmp_path[MAX_CACHE_PATH_LEN];
+  cache_header hdr;
+  cache_dep dep;
+  char* buf;
+  char* p;
+  size_t len;
+  int fd;
+  int i;
+  int ok;
+
+  if(!cache_enabled() || dep_count < 0 || data_len > UINT32_MAX)
+    return 0;
+
+  len = sizeof(cache_header) + strlen(key) + data_len;
+  for(i = 0; i < dep_count; ++i)
+    len += sizeof(cache_dep) + strlen(deps[i].path);
+
+  buf = (char*)malloc(len);
+  if(!buf)
+    return 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, 4);
+  hdr.format = CACHE_FORMAT;
+  hdr.duk_version = DUK_VERSION;
+  hdr.key_len = strlen(key);
+  hdr.dep_count = dep_count;
+  hdr.data_len = data_len;
+  hdr.expires = expires;
+
+  p = buf;
+  memcpy(p, &hdr, sizeof(hdr));
+  p += sizeof(hdr);
+  memcpy(p, key, hdr.key_len);
+  p += hdr.key_len;
+
+  for(i = 0; i < dep_count; ++i)
+  {
+    if(strlen(deps[i].path) >= MAX_CACHE_PATH_LEN)
+    {
+      free(buf);
+      return 0;
+    }
+    if(deps[i].found)
+      cache_dep_from_stat(&dep, &deps[i].st);
+    else
+      cache_dep_absent(&dep);
+    dep.path_len = strlen(deps[i].path);
+    memcpy(p, &dep, sizeof(dep));
+    p += sizeof(dep);
+    memcpy(p, deps[i].path, dep.path_len);
+    p += dep.path_len;
+  }
+  memcpy(p, data, data_len);
+
+  cache_entry_path(key, ext, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.tmpXXXXXX", JST_CACHE_DIR);
+  fd = mkstemp(tmp_path);
+  if(fd < 0)
+  {
+    free(buf);
+    return 0;
+  }
+
+  ok = write_fd(fd, buf, len);
+  if(ok && expires)
+  {
+    struct timespec times[2];
+
+    times[0].tv_sec = times[1].tv_sec = (time_t)expires;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    ok = futimens(fd, times) == 0;
+  }
+  if(close(fd) != 0)
+    ok = 0;
+  if(!ok || rename(tmp_path, path) != 0)
+  {
+    CosaPhpExtLog("failed to write cache entry for %s\n", key);
+    unlink(tmp_path);
+    free(buf);
+    return 0;
+  }
+
+  free(buf);
+  CosaPhpExtLog("cache stored %s\n", key);
+  return 1;
+}
+
+/* records the state of path, to be taken just before it is read */
+void cache_file_stat(cache_file* file, const char* path)
+{
+  file->path = path;
+  file->found = stat(path, &file->st) == 0;
+}
+
+/* stores data for key along with the state each dependency was in when it was read */
+int cache_store(const char* key, const cache_file* deps, int dep_count, const char* data, size_t data_len)
+{
+  return cache_write(key, CACHE_EXT, deps, dep_count, 0, data, data_len);
+}
+
+/* stores data for key, good for ttl seconds */
+int cache_store_ttl(const char* key, int ttl, const char* data, size_t data_len)
+{
+  if(ttl <= 0 || !cache_enabled())
+    return 0;
+  cache_sweep_ttl();
+  return cache_write(key, CACHE_TTL_EXT, NULL, 0, (int64_t)time(NULL) + ttl, data, data_len);
+}
@@ -0,0 +1,176 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/* Request capture, for replaying real web ui traffic with tools/jst_replay.py.
+
+   Off unless JST_CAPTURE_FLAG_FILE exists or the JST_CAPTURE environment variable names a
+   corpus file. Each request (arguments, working directory, environment and post body) is
+   appended to the corpus (JST_CAPTURE_FILE by default) as one record, all integers little endian:
+
+     "JSTQ" | u32 record length (after this field) | u32 argc | u32 envc | u32 body length |
+     cwd | argv[0..argc) | env[0..envc) | body
+
+   where cwd, each argument and each environment entry are a u32 length followed by the bytes.
+   Records are written with a single write under an exclusive lock so concurrent cgi processes
+   can share one corpus.
+
+   The corpus holds cookies and post data (i.e. passwords) so it is created readable by us only,
+   and capture should only be turned on for test traffic. */
+
+#define JST_CAPTURE_FLAG_FILE "/tmp/jst_enable_capture"
+#define JST_CAPTURE_FILE "/tmp/jst_capture.jcr"
+#define CAPTURE_MAGIC "JSTQ"
+#define MAX_CAPTURE_ARGS 16
+
+static const char* g_capture_file = NULL;
+static int g_capture_argc = 0;
+static const char* g_capture_argv[MAX_CAPTURE_ARGS];
+static char* g_capture_body = NULL;
+static size_t g_capture_body_len = 0;
+static int g_capture_active = 0;
+
+void jst_capture_init(void)
+{
+  g_capture_file = getenv("JST_CAPTURE");
+  if(!g_capture_file && access(JST_CAPTURE_FLAG_FILE, F_OK) == 0)
+    g_capture_file = JST_CAPTURE_FILE;
+}
+
+/* starts capturing a request run with the given arguments */
+void jst_capture_begin(int argc, const char* const* argv)
+{
+  int i;
+
+  if(!g_capture_file)
+    return;
+
+  g_capture_argc = argc < MAX_CAPTURE_ARGS ? argc : MAX_CAPTURE_ARGS;
+  for(i = 0; i < g_capture_argc; ++i)
+    g_capture_argv[i] = argv[i];
+  if(g_capture_body)
+    free(g_capture_body);
+  g_capture_body = NULL;
+  g_capture_body_len = 0;
+  g_capture_active = 1;
+}
+
+/* records the post body read from stdin */
+void jst_capture_body(const char* data, size_t len)
+{
+  if(!g_capture_active || !len)
+    return;
+
+  g_capture_body = (char*)malloc(len);
+  if(!g_capture_body)
+    return;
+  memcpy(g_capture_body, data, len);
+  g_capture_body_len = len;
+}
+
+static char* put_u32(char* p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+  return p + 4;
+}
+
+static char* put_string(char* p, const char* s)
+{
+  size_t len = strlen(s);
+  p = put_u32(p, len);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/* appends the request to the corpus */
+void jst_capture_end(void)
+{
+  extern char** environ;
+  char cwd[1024];
+  char* record;
+  char* p;
+  size_t len;
+  int envc = 0;
+  int fd;
+  int i;
+
+  if(!g_capture_active)
+    return;
+  g_capture_active = 0;
+
+  if(!getcwd(cwd, sizeof(cwd)))
+    cwd[0] = 0;
+
+  len = 4 + 4 * 4 + 4 + strlen(cwd) + g_capture_body_len;
+  for(i = 0; i < g_capture_argc; ++i)
+    len += 4 + strlen(g_capture_argv[i]);
+  for(envc = 0; environ[envc]; ++envc)
+    len += 4 + strlen(environ[envc]);
+
+  record = (char*)malloc(len);
+  if(!record)
+    return;
+
+  p = record;
+  memcpy(p, CAPTURE_MAGIC, 4);
+  p = put_u32(p + 4, len - 8);
+  p = put_u32(p, g_capture_argc);
+  p = put_u32(p, envc);
+  p = put_u32(p, g_capture_body_len);
+  p = put_string(p, cwd);
+  for(i = 0; i < g_capture_argc; ++i)
+    p = put_string(p, g_capture_argv[i]);
+  for(i = 0; i < envc; ++i)
+    p = put_string(p, environ[i]);
+  if(g_capture_body_len)
+    memcpy(p, g_capture_body, g_capture_body_len);
+
+  fd = open(g_capture_file, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if(fd < 0)
+  {
+    CosaPhpExtLog("capture cannot open %s: %s\n", g_capture_file, strerror(errno));
+  }
+  else
+  {
+    flock(fd, LOCK_EX);
+    if(write(fd, record, len) != (ssize_t)len)
+      CosaPhpExtLog("capture failed to write %s\n", g_capture_file);
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+
+  free(record);
+  if(g_capture_body)
+    free(g_capture_body);
+  g_capture_body = NULL;
+  g_capture_body_len = 0;
+}
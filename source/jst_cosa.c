@@ -39,6 +39,11 @@ char * dst_componentid            = NULL;
 char * dst_pathname               = NULL;
 char dst_pathname_cr[64]          = {0};
 static int gPcSim                 = 0;
+/* 1 connected, 0 not tried yet, -1 init failed during this request */
+static int gConnected             = 0;
+
+/* upper bound on waiting for the bus to answer after CCSP_Message_Bus_Init */
+#define COSA_READY_TIMEOUT_MS       1000
 
 #ifndef BUILD_RBUS /*FIXME: mrollins: completely removed the functionality when rbus enabled -- do we need to add it back with rbus ? */
 static const char* msg_path       = "/com/cisco/spvtg/ccsp/phpext" ;
@@ -118,12 +123,20 @@ DBusHandlerResult path_message_func(DBusConnection* conn, DBusMessage* message,
 }
 #endif
 
+static int cosa_connect(void);
+
 int UiDbusClientGetDestComponent(char* pObjName,char** ppDestComponentName, char** ppDestPath, char* pSystemPrefix)
 {
     int                         ret;
     int                         size = 0;
     componentStruct_t **        ppComponents = NULL;
 
+    /* every data model call comes through here first, so this is where the bus gets connected */
+    if (!cosa_connect())
+    {
+        return CCSP_FAILURE;
+    }
+
     ret =
         CcspBaseIf_discComponentSupportingNamespace
             (
@@ -185,6 +198,31 @@ void CheckAndSetSubsystemPrefix (char** ppDotStr, char* pSubSystemPrefix)
     }
 }
 
+#ifndef BUILD_RBUS
+/* poll the CR until the new connection answers rather than sleeping a fixed time */
+static void cosa_wait_ready(void)
+{
+  dbus_bool ready = 0;
+  int waited = 0;
+  int delay = 5;
+
+  while (CcspBaseIf_isSystemReady(bus_handle, dst_pathname_cr, &ready) != CCSP_SUCCESS || !ready)
+  {
+    if (waited >= COSA_READY_TIMEOUT_MS)
+    {
+      CosaPhpExtLog("Message bus not ready after %d ms\n", waited);
+      return;
+    }
+    if (delay > COSA_READY_TIMEOUT_MS - waited)
+      delay = COSA_READY_TIMEOUT_MS - waited;
+    CCSP_Msg_SleepInMilliSeconds(delay);
+    waited += delay;
+    delay *= 2;
+  }
+  CosaPhpExtLog("Message bus ready after %d ms\n", waited);
+}
+#endif
+
 int cosa_init()
 {
   FILE *fp = NULL;
@@ -220,20 +258,47 @@ int cosa_init()
   if ( iReturnStatus != 0 )
   {
     CosaPhpExtLog("Message bus init failed, error code = %d!\n", iReturnStatus);
+    return 0;
   }
   
 #ifndef BUILD_RBUS
-  CCSP_Msg_SleepInMilliSeconds(1000);
+  cosa_wait_ready();
   CCSP_Message_Bus_Register_Path(bus_handle, msg_path, path_message_func, 0);
 #endif
   return 1;
 }
 
+/* the bus is only connected once a page actually calls into the data model,
+   so pages which never do (static content, session only requests) don't pay for it.
+   a failed init is not retried until the next request */
+static int cosa_connect(void)
+{
+  if (!gConnected)
+    gConnected = cosa_init() ? 1 : -1;
+  return gConnected > 0;
+}
+
+/* called at the start of each request: give a failed init another chance */
+void ccsp_cosa_reset(void)
+{
+  if (gConnected < 0)
+    gConnected = 0;
+}
+
+/* a child forked from an initialized jst must not share the parent's bus connection.
+   the inherited handle is dropped, not closed, since closing it would affect the parent.
+   the child connects again on its first data model call */
+void ccsp_cosa_reinit(void)
+{
+  bus_handle = NULL;
+  gConnected = 0;
+}
+
 void cosa_shutdown()
 {
     CosaPhpExtLog("COSA PHP extension exits...\n");
 #ifndef BUILD_RBUS /*TODO fix ccsp_message_bus.h: it doesn't define CCSP_Message_Bus_Exit if BUILD_RBUS enabled*/
-    if (bus_handle)
+    if (gConnected > 0 && bus_handle)
       CCSP_Message_Bus_Exit(bus_handle); 
 #endif
 }
@@ -1123,9 +1188,8 @@ static const duk_function_list_entry ccsp_cosa_funcs[] = {
 
 duk_ret_t ccsp_cosa_module_open(duk_context *ctx)
 {
-  cosa_init();
   duk_push_object(ctx);
-  duk_put_function_list(ctx, -1, ccsp_cosa_funcs);
+  put_function_list(ctx, -1, ccsp_cosa_funcs);
   return 1;
 }
 
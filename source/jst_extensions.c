@@ -17,34 +17,154 @@
  limitations under the License.
 */
 #include "jst_internal.h"
+#include "jst.h"
 
 duk_ret_t ccsp_cosa_module_open(duk_context *ctx);
 duk_ret_t ccsp_session_module_open(duk_context *ctx);
 duk_ret_t ccsp_post_module_open(duk_context *ctx);
 duk_ret_t ccsp_functions_module_open(duk_context *ctx);
+duk_ret_t ccsp_output_module_open(duk_context *ctx);
+void ccsp_post_reset(void);
+void ccsp_output_reset(void);
+void ccsp_session_reset(void);
+#ifdef BUILD_RDK
+void ccsp_cosa_reinit(void);
+void ccsp_cosa_reset(void);
+#endif
+
+/* global stash key holding the names of all globals which exist before any request runs */
+#define GLOBALS_SNAPSHOT_KEY "jstGlobals"
+
+static void snapshot_globals(duk_context *ctx)
+{
+  duk_push_global_stash(ctx);
+  duk_push_object(ctx);
+  duk_push_global_object(ctx);
+  duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+  while(duk_next(ctx, -1, 0))
+  {
+    duk_push_true(ctx);
+    duk_put_prop(ctx, -5);
+  }
+  duk_pop_2(ctx);
+  duk_put_prop_string(ctx, -2, GLOBALS_SNAPSHOT_KEY);
+  duk_pop(ctx);
+}
 
 duk_ret_t ccsp_extensions_load(duk_context *ctx)
 {
   init_logger();
 
 #ifdef BUILD_RDK
+  jst_timing_begin("ccsp_cosa_module_open", NULL);
   duk_push_c_function(ctx, ccsp_cosa_module_open, 0);
   duk_call(ctx, 0);
+  jst_timing_end("ccsp_cosa_module_open");
   duk_put_global_string(ctx, "ccsp_cosa");
 #endif
 
+  jst_timing_begin("ccsp_session_module_open", NULL);
   duk_push_c_function(ctx, ccsp_session_module_open, 0);
   duk_call(ctx, 0);
+  jst_timing_end("ccsp_session_module_open");
   duk_put_global_string(ctx, "ccsp_session");
 
+  jst_timing_begin("ccsp_post_module_open", NULL);
   duk_push_c_function(ctx, ccsp_post_module_open, 0);
   duk_call(ctx, 0);
+  jst_timing_end("ccsp_post_module_open");
   duk_put_global_string(ctx, "ccsp_post");
 
+  jst_timing_begin("ccsp_functions_module_open", NULL);
   duk_push_c_function(ctx, ccsp_functions_module_open, 0);
   duk_call(ctx, 0);
+  jst_timing_end("ccsp_functions_module_open");
   duk_put_global_string(ctx, "ccsp");
 
+  jst_timing_begin("ccsp_output_module_open", NULL);
+  duk_push_c_function(ctx, ccsp_output_module_open, 0);
+  duk_call(ctx, 0);
+  jst_timing_end("ccsp_output_module_open");
+  duk_put_global_string(ctx, "ccsp_output");
+
+  return 1;
+}
+
+/* When a heap is reused for more then one request (e.g. fastcgi mode),
+   request_begin must be called before and request_end after each request.
+   Globals which exist at the first request_begin (including anything preloaded)
+   are kept, any other global is removed by request_end */
+duk_ret_t ccsp_extensions_request_begin(duk_context *ctx)
+{
+  duk_push_global_stash(ctx);
+  if(!duk_has_prop_string(ctx, -1, GLOBALS_SNAPSHOT_KEY))
+    snapshot_globals(ctx);
+  duk_pop(ctx);
+
+  ccsp_session_reset();
+  ccsp_post_reset();
+  ccsp_output_reset();
+#ifdef BUILD_RDK
+  ccsp_cosa_reset();
+#endif
+  return 1;
+}
+
+duk_ret_t ccsp_extensions_request_end(duk_context *ctx)
+{
+  /* remove any globals the request created so nothing leaks into the next request.
+     top level var declarations can't be deleted so those are set to undefined */
+  duk_push_global_stash(ctx);
+  if(!duk_get_prop_string(ctx, -1, GLOBALS_SNAPSHOT_KEY))
+  {
+    duk_pop_2(ctx);
+    return 1;
+  }
+  duk_push_global_object(ctx);
+  duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+  while(duk_next(ctx, -1, 0))
+  {
+    duk_dup(ctx, -1);
+    if(duk_has_prop(ctx, -5))
+    {
+      duk_pop(ctx);
+      continue;
+    }
+    duk_dup(ctx, -1);
+    duk_get_prop_desc(ctx, -4, 0);
+    duk_get_prop_string(ctx, -1, "configurable");
+    if(duk_get_boolean(ctx, -1))
+    {
+      duk_pop_2(ctx);
+      duk_del_prop(ctx, -3);
+    }
+    else
+    {
+      duk_pop(ctx);
+      duk_get_prop_string(ctx, -1, "writable");
+      if(duk_get_boolean(ctx, -1))
+      {
+        duk_pop_2(ctx);
+        duk_push_undefined(ctx);
+        duk_put_prop(ctx, -4);
+      }
+      else
+      {
+        duk_pop_3(ctx);
+      }
+    }
+  }
+  duk_pop_n(ctx, 4);
+  return 1;
+}
+
+/* called in a child forked from an initialized heap, before it runs its request */
+duk_ret_t ccsp_extensions_after_fork(duk_context *ctx)
+{
+  (void)ctx;
+#ifdef BUILD_RDK
+  ccsp_cosa_reinit();
+#endif
   return 1;
 }
 
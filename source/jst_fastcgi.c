@@ -0,0 +1,638 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/*
+  FastCGI responder (see https://fastcgi-archives.github.io/FastCGI_Specification.html)
+
+  The heap and extensions are created once and each request is run in the same heap.
+  For every request the FastCGI params become the process environment, the stdin stream
+  becomes stdin and whatever the script prints to stdout is sent back as the stdout stream,
+  so the rest of jst sees exactly what it would see when run as a cgi. What a script flush()'es
+  is sent right away, the rest when it is done.
+
+  Only one request is handled at a time. Multiplexed requests are refused.
+
+  With fork_per_request (zygote mode) the process which created the heap only accepts
+  connections and forks a child for each one. The child serves a single request from the
+  already initialized heap and exits, so requests stay isolated from each other.
+*/
+
+#define FCGI_VERSION_1            1
+#define FCGI_HEADER_LEN           8
+#define FCGI_MAX_CONTENT_LEN      65535
+
+#define FCGI_BEGIN_REQUEST        1
+#define FCGI_ABORT_REQUEST        2
+#define FCGI_END_REQUEST          3
+#define FCGI_PARAMS               4
+#define FCGI_STDIN                5
+#define FCGI_STDOUT               6
+#define FCGI_STDERR               7
+#define FCGI_DATA                 8
+#define FCGI_GET_VALUES           9
+#define FCGI_GET_VALUES_RESULT    10
+#define FCGI_UNKNOWN_TYPE         11
+
+#define FCGI_RESPONDER            1
+#define FCGI_KEEP_CONN            1
+
+#define FCGI_REQUEST_COMPLETE     0
+#define FCGI_CANT_MPX_CONN        1
+#define FCGI_UNKNOWN_ROLE         3
+
+/* when spawned by the web server the listen socket is passed in as stdin */
+#define FCGI_LISTENSOCK_FILENO    0
+
+typedef struct fcgi_header
+{
+  unsigned char version;
+  unsigned char type;
+  unsigned short request_id;
+  unsigned short content_len;
+  unsigned char padding_len;
+}fcgi_header;
+
+typedef struct fcgi_stream
+{
+  char* data;
+  size_t len;
+  size_t alloc_len;
+}fcgi_stream;
+
+typedef struct fcgi_request
+{
+  unsigned short id;
+  int keep_conn;
+  int params_done;
+  int stdin_done;
+  fcgi_stream params;
+  fcgi_stream body;
+}fcgi_request;
+
+static volatile sig_atomic_t g_stop = 0;
+static char** g_base_environ = NULL;
+
+static void fcgi_sighandler(int sig)
+{
+  (void)sig;
+  g_stop = 1;
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+  size_t got = 0;
+  while(got < len)
+  {
+    ssize_t rc = read(fd, (char*)buf + got, len - got);
+    if(rc < 0 && errno == EINTR && !g_stop)
+      continue;
+    if(rc <= 0)
+      return -1;
+    got += rc;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+  size_t sent = 0;
+  while(sent < len)
+  {
+    ssize_t rc = send(fd, (const char*)buf + sent, len - sent, MSG_NOSIGNAL);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return -1;
+    sent += rc;
+  }
+  return 0;
+}
+
+static int stream_push(fcgi_stream* stream, const char* data, size_t len)
+{
+  if(stream->len + len + 1 > stream->alloc_len)
+  {
+    size_t alloc_len = stream->alloc_len ? stream->alloc_len : 4096;
+    char* rdata;
+    while(alloc_len < stream->len + len + 1)
+      alloc_len *= 2;
+    rdata = (char*)realloc(stream->data, alloc_len);
+    if(!rdata)
+    {
+      CosaPhpExtLog("fastcgi failed to grow stream buffer\n");
+      return -1;
+    }
+    stream->data = rdata;
+    stream->alloc_len = alloc_len;
+  }
+  memcpy(stream->data + stream->len, data, len);
+  stream->len += len;
+  stream->data[stream->len] = 0;
+  return 0;
+}
+
+static void stream_free(fcgi_stream* stream)
+{
+  if(stream->data)
+    free(stream->data);
+  memset(stream, 0, sizeof(fcgi_stream));
+}
+
+static int read_record(int fd, fcgi_header* header, char* content)
+{
+  unsigned char raw[FCGI_HEADER_LEN];
+  char padding[255];
+
+  if(read_full(fd, raw, FCGI_HEADER_LEN) != 0)
+    return -1;
+
+  header->version = raw[0];
+  header->type = raw[1];
+  header->request_id = (raw[2] << 8) | raw[3];
+  header->content_len = (raw[4] << 8) | raw[5];
+  header->padding_len = raw[6];
+
+  if(header->version != FCGI_VERSION_1)
+  {
+    CosaPhpExtLog("fastcgi unsupported version %d\n", header->version);
+    return -1;
+  }
+
+  if(header->content_len && read_full(fd, content, header->content_len) != 0)
+    return -1;
+
+  if(header->padding_len && read_full(fd, padding, header->padding_len) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int write_record(int fd, unsigned char type, unsigned short request_id, const char* content, size_t len)
+{
+  unsigned char raw[FCGI_HEADER_LEN];
+  static const char padding[8] = {0};
+  unsigned char padding_len = (8 - (len % 8)) % 8;
+
+  raw[0] = FCGI_VERSION_1;
+  raw[1] = type;
+  raw[2] = (request_id >> 8) & 0xff;
+  raw[3] = request_id & 0xff;
+  raw[4] = (len >> 8) & 0xff;
+  raw[5] = len & 0xff;
+  raw[6] = padding_len;
+  raw[7] = 0;
+
+  if(write_full(fd, raw, FCGI_HEADER_LEN) != 0)
+    return -1;
+  if(len && write_full(fd, content, len) != 0)
+    return -1;
+  if(padding_len && write_full(fd, padding, padding_len) != 0)
+    return -1;
+  return 0;
+}
+
+/* sends data as a stream, split into as many records as needed, followed by the empty end of stream record */
+static int write_stream_data(int fd, unsigned char type, unsigned short request_id, const char* data, size_t len)
+{
+  while(len)
+  {
+    size_t chunk = len > FCGI_MAX_CONTENT_LEN ? FCGI_MAX_CONTENT_LEN : len;
+    if(write_record(fd, type, request_id, data, chunk) != 0)
+      return -1;
+    data += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+/* data and the empty record which ends the stream */
+static int write_stream(int fd, unsigned char type, unsigned short request_id, const char* data, size_t len)
+{
+  if(write_stream_data(fd, type, request_id, data, len) != 0)
+    return -1;
+  return write_record(fd, type, request_id, NULL, 0);
+}
+
+static int write_end_request(int fd, unsigned short request_id, unsigned char protocol_status)
+{
+  char body[8] = {0};
+  body[4] = protocol_status;
+  return write_record(fd, FCGI_END_REQUEST, request_id, body, sizeof(body));
+}
+
+/* name-value pair lengths are either 1 byte or 4 bytes with the high bit set */
+static int read_nv_length(const unsigned char** cur, const unsigned char* end, size_t* len)
+{
+  const unsigned char* p = *cur;
+  if(p >= end)
+    return -1;
+  if(*p & 0x80)
+  {
+    if(end - p < 4)
+      return -1;
+    *len = ((size_t)(p[0] & 0x7f) << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    *cur = p + 4;
+  }
+  else
+  {
+    *len = *p;
+    *cur = p + 1;
+  }
+  return 0;
+}
+
+static int push_nv_length(fcgi_stream* stream, size_t len)
+{
+  unsigned char raw[4];
+  if(len < 0x80)
+  {
+    raw[0] = (unsigned char)len;
+    return stream_push(stream, (const char*)raw, 1);
+  }
+  raw[0] = ((len >> 24) & 0x7f) | 0x80;
+  raw[1] = (len >> 16) & 0xff;
+  raw[2] = (len >> 8) & 0xff;
+  raw[3] = len & 0xff;
+  return stream_push(stream, (const char*)raw, 4);
+}
+
+/* replace the process environment with the startup environment plus the request params */
+static int apply_params(fcgi_stream* params)
+{
+  const unsigned char* cur = (const unsigned char*)params->data;
+  const unsigned char* end = cur + params->len;
+  char** env;
+
+  clearenv();
+  for(env = g_base_environ; env && *env; ++env)
+    putenv(*env);
+
+  while(cur < end)
+  {
+    size_t name_len;
+    size_t value_len;
+    char* name;
+    char* value;
+
+    if(read_nv_length(&cur, end, &name_len) != 0 ||
+       read_nv_length(&cur, end, &value_len) != 0 ||
+       (size_t)(end - cur) < name_len + value_len)
+    {
+      CosaPhpExtLog("fastcgi malformed params\n");
+      return -1;
+    }
+
+    name = strndup((const char*)cur, name_len);
+    value = strndup((const char*)cur + name_len, value_len);
+    if(name && value)
+      setenv(name, value, 1);
+    free(name);
+    free(value);
+
+    cur += name_len + value_len;
+  }
+  return 0;
+}
+
+static void handle_get_values(int fd, const char* content, size_t len)
+{
+  const unsigned char* cur = (const unsigned char*)content;
+  const unsigned char* end = cur + len;
+  fcgi_stream result;
+
+  memset(&result, 0, sizeof(result));
+
+  while(cur < end)
+  {
+    size_t name_len;
+    size_t value_len;
+    const char* value = NULL;
+
+    if(read_nv_length(&cur, end, &name_len) != 0 ||
+       read_nv_length(&cur, end, &value_len) != 0 ||
+       (size_t)(end - cur) < name_len + value_len)
+      break;
+
+    if(name_len == 14 && memcmp(cur, "FCGI_MAX_CONNS", 14) == 0)
+      value = "1";
+    else if(name_len == 13 && memcmp(cur, "FCGI_MAX_REQS", 13) == 0)
+      value = "1";
+    else if(name_len == 15 && memcmp(cur, "FCGI_MPXS_CONNS", 15) == 0)
+      value = "0";
+
+    if(value)
+    {
+      push_nv_length(&result, name_len);
+      push_nv_length(&result, strlen(value));
+      stream_push(&result, (const char*)cur, name_len);
+      stream_push(&result, value, strlen(value));
+    }
+    cur += name_len + value_len;
+  }
+
+  write_record(fd, FCGI_GET_VALUES_RESULT, 0, result.data, result.len);
+  stream_free(&result);
+}
+
+/* the stdout stream of a request, as far as it was sent by flush() */
+typedef struct fcgi_output
+{
+  int fd;
+  unsigned short request_id;
+  char** out;
+  size_t* out_len;
+  size_t sent;
+  int failed;
+}fcgi_output;
+
+/* flush hook, sends what the script wrote since the last flush() */
+static void output_flush(void* arg)
+{
+  fcgi_output* output = (fcgi_output*)arg;
+
+  fflush(stdout);
+  if(output->failed)
+    return;
+  if(write_stream_data(output->fd, FCGI_STDOUT, output->request_id, *output->out + output->sent, *output->out_len - output->sent) != 0)
+    output->failed = 1;
+  output->sent = *output->out_len;
+}
+
+static int run_request(int fd, fcgi_request* req, duk_context *ctx, jst_request_handler handler)
+{
+  fcgi_output output;
+  FILE* saved_stdin = stdin;
+  FILE* saved_stdout = stdout;
+  FILE* req_stdin;
+  FILE* req_stdout;
+  char* out = NULL;
+  size_t out_len = 0;
+  const char* script;
+  int rc;
+
+  if(apply_params(&req->params) != 0)
+    return write_end_request(fd, req->id, FCGI_REQUEST_COMPLETE);
+
+  if(req->body.len)
+    req_stdin = fmemopen(req->body.data, req->body.len, "r");
+  else
+    req_stdin = fopen("/dev/null", "r");
+
+  req_stdout = open_memstream(&out, &out_len);
+
+  if(!req_stdin || !req_stdout)
+  {
+    CosaPhpExtLog("fastcgi failed to open request streams\n");
+    if(req_stdin)
+      fclose(req_stdin);
+    if(req_stdout)
+      fclose(req_stdout);
+    free(out);
+    return write_end_request(fd, req->id, FCGI_REQUEST_COMPLETE);
+  }
+
+  stdin = req_stdin;
+  stdout = req_stdout;
+
+  memset(&output, 0, sizeof(output));
+  output.fd = fd;
+  output.request_id = req->id;
+  output.out = &out;
+  output.out_len = &out_len;
+
+  script = getenv("SCRIPT_FILENAME");
+  if(script)
+  {
+    CosaPhpExtLog("fastcgi request %s\n", script);
+    ccsp_output_set_flush_hook(output_flush, &output);
+    handler(ctx, script);
+    ccsp_output_set_flush_hook(NULL, NULL);
+  }
+  else
+  {
+    printf("Status: 500 Internal Server Error\r\nContent-type: text/plain\r\n\r\nSCRIPT_FILENAME not set\n");
+  }
+
+  fflush(stdout);
+  stdin = saved_stdin;
+  stdout = saved_stdout;
+  fclose(req_stdin);
+  fclose(req_stdout);
+
+  rc = output.failed ? -1 : write_stream(fd, FCGI_STDOUT, req->id, out + output.sent, out_len - output.sent);
+  if(rc == 0)
+    rc = write_end_request(fd, req->id, FCGI_REQUEST_COMPLETE);
+
+  free(out);
+  return rc;
+}
+
+/* serves requests on a connection until the web server closes it or a request completes without keep_conn */
+static void serve_connection(int fd, duk_context *ctx, jst_request_handler handler, int single_request)
+{
+  static char content[FCGI_MAX_CONTENT_LEN];
+  fcgi_header header;
+  fcgi_request req;
+
+  memset(&req, 0, sizeof(req));
+
+  while(!g_stop && read_record(fd, &header, content) == 0)
+  {
+    if(header.type == FCGI_GET_VALUES)
+    {
+      handle_get_values(fd, content, header.content_len);
+      continue;
+    }
+
+    if(header.type == FCGI_BEGIN_REQUEST)
+    {
+      unsigned short role;
+
+      if(header.content_len < 8)
+        break;
+
+      if(req.id)
+      {
+        write_end_request(fd, header.request_id, FCGI_CANT_MPX_CONN);
+        continue;
+      }
+
+      role = ((unsigned char)content[0] << 8) | (unsigned char)content[1];
+      if(role != FCGI_RESPONDER)
+      {
+        write_end_request(fd, header.request_id, FCGI_UNKNOWN_ROLE);
+        continue;
+      }
+
+      req.id = header.request_id;
+      req.keep_conn = content[2] & FCGI_KEEP_CONN;
+      continue;
+    }
+
+    if(header.request_id == 0)
+    {
+      char body[8] = {0};
+      body[0] = header.type;
+      write_record(fd, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+      continue;
+    }
+
+    if(header.request_id != req.id)
+      continue;
+
+    if(header.type == FCGI_ABORT_REQUEST)
+    {
+      write_end_request(fd, req.id, FCGI_REQUEST_COMPLETE);
+    }
+    else if(header.type == FCGI_PARAMS)
+    {
+      if(header.content_len == 0)
+        req.params_done = 1;
+      else if(stream_push(&req.params, content, header.content_len) != 0)
+        break;
+      if(!req.params_done)
+        continue;
+    }
+    else if(header.type == FCGI_STDIN)
+    {
+      if(header.content_len == 0)
+        req.stdin_done = 1;
+      else if(stream_push(&req.body, content, header.content_len) != 0)
+        break;
+    }
+    else
+    {
+      continue;
+    }
+
+    if(header.type != FCGI_ABORT_REQUEST)
+    {
+      if(!req.params_done || !req.stdin_done)
+        continue;
+
+      if(run_request(fd, &req, ctx, handler) != 0)
+        break;
+    }
+
+    if(!req.keep_conn || single_request)
+      break;
+
+    stream_free(&req.params);
+    stream_free(&req.body);
+    memset(&req, 0, sizeof(req));
+  }
+
+  stream_free(&req.params);
+  stream_free(&req.body);
+}
+
+static void fork_connection(int listen_fd, int fd, duk_context *ctx, jst_request_handler handler)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+  {
+    fprintf(stderr, "Error: fastcgi fork failed %s\n", strerror(errno));
+    return;
+  }
+  if(pid == 0)
+  {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    if(listen_fd != FCGI_LISTENSOCK_FILENO)
+      close(listen_fd);
+    ccsp_extensions_after_fork(ctx);
+    serve_connection(fd, ctx, handler, 1);
+    close(fd);
+    fflush(stderr);
+    _exit(0);
+  }
+}
+
+int jst_fastcgi_run(duk_context *ctx, const char *addr, jst_request_handler handler, int fork_per_request)
+{
+  struct sigaction sa;
+  int listen_fd;
+
+  if(addr && strcmp(addr, "-") != 0)
+  {
+    listen_fd = open_listen_socket(addr);
+    if(listen_fd < 0)
+      return -1;
+  }
+  else
+  {
+    listen_fd = FCGI_LISTENSOCK_FILENO;
+  }
+
+  g_base_environ = copy_environ();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = fcgi_sighandler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(fork_per_request)
+  {
+    /* children are never waited on so let the kernel reap them */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+  }
+
+  CosaPhpExtLog("fastcgi %s %d ready\n", fork_per_request ? "zygote" : "worker", (int)getpid());
+
+  while(!g_stop)
+  {
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0)
+    {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "Error: fastcgi accept failed %s\n", strerror(errno));
+      break;
+    }
+    if(fork_per_request)
+      fork_connection(listen_fd, fd, ctx, handler);
+    else
+      serve_connection(fd, ctx, handler, 0);
+    close(fd);
+  }
+
+  CosaPhpExtLog("fastcgi worker %d exiting\n", (int)getpid());
+
+  if(listen_fd != FCGI_LISTENSOCK_FILENO)
+    close(listen_fd);
+
+  return g_stop ? 0 : -1;
+}
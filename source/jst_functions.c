@@ -494,6 +494,28 @@ static duk_ret_t do_include(duk_context *ctx)
   }
 }
 
+/* evaluates the php.jst bytecode embedded in the binary into the global object, which is what
+   an include of php.jst is replaced with when a single page is run, see template_php_include */
+static duk_ret_t do_php_prelude(duk_context *ctx)
+{
+  const char* code;
+  size_t len;
+  void* buf;
+
+  if(!template_php_prelude_code(&code, &len))
+    RETURN_FALSE;
+
+  jst_timing_begin("php_prelude", NULL);
+  buf = duk_push_fixed_buffer(ctx, len);
+  memcpy(buf, code, len);
+  duk_load_function(ctx);
+  duk_push_global_object(ctx);
+  duk_call_method(ctx, 0);
+  duk_pop(ctx);
+  jst_timing_end("php_prelude");
+  RETURN_TRUE;
+}
+
 static duk_ret_t do_openssl_verify_with_cert(duk_context *ctx)
 {
   char* filepath;
@@ -774,6 +796,29 @@ static duk_ret_t do_unlink(duk_context *ctx)
 }
 
 
+/* lets script code mark phases for the per request timing (see jst_timing.c) */
+static duk_ret_t do_timing_begin(duk_context *ctx)
+{
+  char* phase = NULL;
+
+  if (!parse_parameter(__FUNCTION__, ctx, "s", &phase))
+    RETURN_FALSE;
+
+  jst_timing_begin(phase, NULL);
+  RETURN_TRUE;
+}
+
+static duk_ret_t do_timing_end(duk_context *ctx)
+{
+  char* phase = NULL;
+
+  if (!parse_parameter(__FUNCTION__, ctx, "s", &phase))
+    RETURN_FALSE;
+
+  jst_timing_end(phase);
+  RETURN_TRUE;
+}
+
 static const duk_function_list_entry ccsp_functions_funcs[] = {
   { "getenv", do_getenv, 1 },
   { "bindtextdomain", do_bindtextdomain, 2 },
@@ -793,16 +838,19 @@ static const duk_function_list_entry ccsp_functions_funcs[] = {
   { "filesize", do_filesize, 1 },
   { "logger", do_logger, 1 },
   { "include", do_include, 1 },
+  { "phpPrelude", do_php_prelude, 0 },
   { "openssl_verify_with_cert", do_openssl_verify_with_cert, 4 },
   { "getSignKeys", do_getSignKeys, 2 },
   { "filemtime", do_filemtime, 1 },
   { "unlink", do_unlink, 1 },
+  { "timingBegin", do_timing_begin, 1 },
+  { "timingEnd", do_timing_end, 1 },
   { NULL, NULL, 0 }
 };
 
 duk_ret_t ccsp_functions_module_open(duk_context *ctx)
 {
   duk_push_object(ctx);
-  duk_put_function_list(ctx, -1, ccsp_functions_funcs);
+  put_function_list(ctx, -1, ccsp_functions_funcs);
   return 1;
 }
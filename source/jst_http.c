@@ -0,0 +1,1094 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/*
+  Stand alone HTTP/1.1 server (jst --serve ADDR --root DIR), for running and benchmarking
+  the web ui without a web server in front of jst.
+
+  Like the FastCGI responder the heap is created once and every request runs in it.
+  Each request is turned into the cgi environment a web server would set up (REQUEST_METHOD,
+  QUERY_STRING, SCRIPT_NAME, SCRIPT_FILENAME, CONTENT_*, HTTP_* ...) with the body as stdin,
+  so $_SERVER, $_GET, $_POST and $_FILES see exactly what they would see under lighttpd.
+  The cgi response the script prints is turned back into an HTTP response.
+
+  Connections are non-blocking and multiplexed with epoll so idle keep-alive connections
+  cost nothing, but requests run one at a time since there is only one heap.
+  A script which calls flush() has what it wrote so far sent right away, as the first chunks
+  of a chunked response (to an HTTP/1.1 client, an HTTP/1.0 one gets it all at the end).
+  Files other than .jst are served as is. Chunked request bodies are not supported.
+*/
+
+#define HTTP_MAX_CONNS            256
+#define HTTP_MAX_HEADER_LEN       16384
+#define HTTP_MAX_BODY_LEN         (16 * 1024 * 1024)
+#define HTTP_MAX_REQUEST_LEN      (HTTP_MAX_HEADER_LEN + HTTP_MAX_BODY_LEN)
+#ifndef HTTP_KEEPALIVE_TIMEOUT
+#define HTTP_KEEPALIVE_TIMEOUT    15
+#endif
+#define HTTP_READ_LEN             16384
+#define HTTP_READS_PER_EVENT      16
+#define HTTP_INDEX_FILE           "index.jst"
+
+typedef struct http_buffer
+{
+  char* data;
+  size_t len;
+  size_t alloc_len;
+}http_buffer;
+
+typedef struct http_conn
+{
+  int fd;
+  http_buffer in;
+  http_buffer out;
+  size_t out_off;
+  int close_after;
+  int sent_continue;
+  time_t last_active;
+  char remote_addr[NI_MAXHOST];
+  char remote_port[NI_MAXSERV];
+  char local_addr[NI_MAXHOST];
+  char local_port[NI_MAXSERV];
+  struct http_conn* next;
+}http_conn;
+
+typedef struct http_header
+{
+  char* name;
+  char* value;
+}http_header;
+
+#define HTTP_MAX_HEADERS 64
+
+typedef struct http_request
+{
+  char* method;
+  char* target;
+  char* version;
+  http_header headers[HTTP_MAX_HEADERS];
+  int header_count;
+  size_t header_len;
+  size_t content_len;
+  const char* content_type;
+  int keep_alive;
+  int expect_continue;
+}http_request;
+
+static volatile sig_atomic_t g_stop = 0;
+static char** g_base_environ = NULL;
+static char g_root[PATH_MAX];
+static http_conn* g_conns = NULL;
+static int g_conn_count = 0;
+
+static void http_sighandler(int sig)
+{
+  (void)sig;
+  g_stop = 1;
+}
+
+static int buffer_reserve(http_buffer* buf, size_t len)
+{
+  if(buf->len + len + 1 > buf->alloc_len)
+  {
+    size_t alloc_len = buf->alloc_len ? buf->alloc_len : 4096;
+    char* rdata;
+    while(alloc_len < buf->len + len + 1)
+      alloc_len *= 2;
+    rdata = (char*)realloc(buf->data, alloc_len);
+    if(!rdata)
+    {
+      CosaPhpExtLog("http failed to grow buffer\n");
+      return -1;
+    }
+    buf->data = rdata;
+    buf->alloc_len = alloc_len;
+  }
+  return 0;
+}
+
+static int buffer_append(http_buffer* buf, const char* data, size_t len)
+{
+  if(buffer_reserve(buf, len) != 0)
+    return -1;
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = 0;
+  return 0;
+}
+
+static int buffer_printf(http_buffer* buf, const char* format, ...)
+{
+  va_list vl;
+  int len;
+
+  va_start(vl, format);
+  len = vsnprintf(NULL, 0, format, vl);
+  va_end(vl);
+  if(len < 0 || buffer_reserve(buf, len) != 0)
+    return -1;
+  va_start(vl, format);
+  vsnprintf(buf->data + buf->len, len + 1, format, vl);
+  va_end(vl);
+  buf->len += len;
+  return 0;
+}
+
+/* drops the first len bytes, e.g. a request which has been handled */
+static void buffer_consume(http_buffer* buf, size_t len)
+{
+  if(len >= buf->len)
+  {
+    buf->len = 0;
+  }
+  else
+  {
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+  }
+  if(buf->data)
+    buf->data[buf->len] = 0;
+}
+
+static void buffer_free(http_buffer* buf)
+{
+  if(buf->data)
+    free(buf->data);
+  memset(buf, 0, sizeof(http_buffer));
+}
+
+static const char* status_text(int status)
+{
+  switch(status)
+  {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+  }
+}
+
+static const char* content_type_for(const char* path)
+{
+  static const struct { const char* ext; const char* type; } types[] = {
+    { ".html", "text/html" },
+    { ".htm", "text/html" },
+    { ".css", "text/css" },
+    { ".js", "application/javascript" },
+    { ".json", "application/json" },
+    { ".txt", "text/plain" },
+    { ".xml", "text/xml" },
+    { ".svg", "image/svg+xml" },
+    { ".png", "image/png" },
+    { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".gif", "image/gif" },
+    { ".ico", "image/x-icon" },
+    { ".woff", "font/woff" },
+    { ".woff2", "font/woff2" },
+    { ".ttf", "font/ttf" },
+    { NULL, NULL }
+  };
+  const char* ext = strrchr(path, '.');
+  int i;
+
+  if(ext && !strchr(ext, '/'))
+  {
+    for(i = 0; types[i].ext; ++i)
+    {
+      if(strcasecmp(ext, types[i].ext) == 0)
+        return types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+static const char* find_header(http_request* req, const char* name)
+{
+  int i;
+  for(i = 0; i < req->header_count; ++i)
+  {
+    if(strcasecmp(req->headers[i].name, name) == 0)
+      return req->headers[i].value;
+  }
+  return NULL;
+}
+
+static char* trim(char* s)
+{
+  char* end;
+  while(*s == ' ' || *s == '\t')
+    s++;
+  end = s + strlen(s);
+  while(end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+    *--end = 0;
+  return s;
+}
+
+/* parses the request line and headers once the whole header block has arrived.
+   the block is copied, the request strings point into the copy and stay valid until the next call.
+   returns 0 when more data is needed, -status for a malformed request and 1 when parsed */
+static int parse_request(http_conn* conn, http_request* req)
+{
+  static char block[HTTP_MAX_HEADER_LEN + 1];
+  char* end;
+  char* line;
+  char* next;
+  const char* value;
+
+  memset(req, 0, sizeof(http_request));
+
+  end = (char*)memmem(conn->in.data, conn->in.len, "\r\n\r\n", 4);
+  if(!end)
+    return conn->in.len > HTTP_MAX_HEADER_LEN ? -431 : 0;
+  req->header_len = end - conn->in.data + 4;
+  if(req->header_len > HTTP_MAX_HEADER_LEN)
+    return -431;
+  memcpy(block, conn->in.data, req->header_len - 4);
+  block[req->header_len - 4] = 0;
+
+  line = block;
+  next = strstr(line, "\r\n");
+  if(next)
+  {
+    *next = 0;
+    next += 2;
+  }
+
+  req->method = line;
+  req->target = strchr(line, ' ');
+  if(!req->target)
+    return -400;
+  *req->target++ = 0;
+  req->version = strchr(req->target, ' ');
+  if(!req->version)
+    return -400;
+  *req->version++ = 0;
+  if(strncmp(req->version, "HTTP/1.", 7) != 0)
+    return -505;
+
+  for(line = next; line && *line; line = next)
+  {
+    char* colon;
+
+    next = strstr(line, "\r\n");
+    if(next)
+    {
+      *next = 0;
+      next += 2;
+    }
+    colon = strchr(line, ':');
+    if(!colon || colon == line)
+      return -400;
+    if(req->header_count == HTTP_MAX_HEADERS)
+      return -431;
+    *colon = 0;
+    req->headers[req->header_count].name = line;
+    req->headers[req->header_count].value = trim(colon + 1);
+    req->header_count++;
+  }
+
+  if(find_header(req, "Transfer-Encoding"))
+    return -501;
+
+  value = find_header(req, "Content-Length");
+  if(value)
+  {
+    char* p;
+    unsigned long len = strtoul(value, &p, 10);
+    if(*p || p == value)
+      return -400;
+    if(len > HTTP_MAX_BODY_LEN)
+      return -413;
+    req->content_len = len;
+  }
+  req->content_type = find_header(req, "Content-Type");
+
+  /* HTTP/1.1 keeps the connection open unless asked not to, HTTP/1.0 only if asked to */
+  value = find_header(req, "Connection");
+  if(strcmp(req->version, "HTTP/1.0") == 0)
+    req->keep_alive = value && strcasecmp(value, "keep-alive") == 0;
+  else
+    req->keep_alive = !(value && strcasecmp(value, "close") == 0);
+
+  value = find_header(req, "Expect");
+  req->expect_continue = value && strcasecmp(value, "100-continue") == 0;
+  return 1;
+}
+
+static int hex_value(char c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* decodes the path of the request target into path, rejecting anything which could escape the root */
+static int decode_path(const char* target, char* path, size_t path_len)
+{
+  size_t len = 0;
+  const char* p;
+
+  if(target[0] != '/')
+    return -1;
+
+  for(p = target; *p && *p != '?' && *p != '#'; ++p)
+  {
+    char c = *p;
+    if(c == '%')
+    {
+      int hi = hex_value(p[1]);
+      int lo = hi < 0 ? -1 : hex_value(p[2]);
+      if(lo < 0)
+        return -1;
+      c = (char)((hi << 4) | lo);
+      p += 2;
+    }
+    if(c == 0 || len + 1 >= path_len)
+      return -1;
+    path[len++] = c;
+  }
+  path[len] = 0;
+
+  if(strstr(path, "/../") || (len >= 3 && strcmp(path + len - 3, "/..") == 0))
+    return -1;
+
+  if(path[len - 1] == '/')
+  {
+    if(len + strlen(HTTP_INDEX_FILE) >= path_len)
+      return -1;
+    strcpy(path + len, HTTP_INDEX_FILE);
+  }
+  return 0;
+}
+
+/* the cgi environment a web server would set up for the request */
+static void apply_request_env(http_conn* conn, http_request* req, const char* path, const char* filename)
+{
+  const char* query;
+  char** env;
+  char name[256];
+  int i;
+
+  clearenv();
+  for(env = g_base_environ; env && *env; ++env)
+    putenv(*env);
+
+  query = strchr(req->target, '?');
+
+  setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
+  setenv("SERVER_SOFTWARE", "jst", 1);
+  setenv("SERVER_PROTOCOL", req->version, 1);
+  setenv("SERVER_ADDR", conn->local_addr, 1);
+  setenv("SERVER_PORT", conn->local_port, 1);
+  setenv("REMOTE_ADDR", conn->remote_addr, 1);
+  setenv("REMOTE_PORT", conn->remote_port, 1);
+  setenv("REQUEST_METHOD", req->method, 1);
+  setenv("REQUEST_URI", req->target, 1);
+  setenv("QUERY_STRING", query ? query + 1 : "", 1);
+  setenv("DOCUMENT_ROOT", g_root, 1);
+  setenv("SCRIPT_NAME", path, 1);
+  setenv("SCRIPT_FILENAME", filename, 1);
+
+  if(req->content_len || find_header(req, "Content-Length"))
+  {
+    snprintf(name, sizeof(name), "%lu", (unsigned long)req->content_len);
+    setenv("CONTENT_LENGTH", name, 1);
+  }
+  if(req->content_type)
+    setenv("CONTENT_TYPE", req->content_type, 1);
+
+  for(i = 0; i < req->header_count; ++i)
+  {
+    const char* h = req->headers[i].name;
+    size_t len = 0;
+
+    if(strcasecmp(h, "Content-Length") == 0 || strcasecmp(h, "Content-Type") == 0)
+      continue;
+
+    len = snprintf(name, sizeof(name), "HTTP_");
+    for(; *h && len + 1 < sizeof(name); ++h)
+      name[len++] = *h == '-' ? '_' : toupper((unsigned char)*h);
+    name[len] = 0;
+    setenv(name, req->headers[i].value, 1);
+  }
+}
+
+static void start_response(http_conn* conn, int status, const char* status_line, int keep_alive)
+{
+  if(status_line)
+    buffer_printf(&conn->out, "HTTP/1.1 %s\r\n", status_line);
+  else
+    buffer_printf(&conn->out, "HTTP/1.1 %d %s\r\n", status, status_text(status));
+  buffer_printf(&conn->out, "Connection: %s\r\n", keep_alive ? "keep-alive" : "close");
+  conn->close_after = !keep_alive;
+}
+
+static void end_response(http_conn* conn, http_request* req, const char* body, size_t len)
+{
+  buffer_printf(&conn->out, "Content-Length: %lu\r\n\r\n", (unsigned long)len);
+  if(len && !(req && strcmp(req->method, "HEAD") == 0))
+    buffer_append(&conn->out, body, len);
+}
+
+static void error_response(http_conn* conn, http_request* req, int status)
+{
+  char body[128];
+  int len;
+
+  len = snprintf(body, sizeof(body), "%d %s\n", status, status_text(status));
+  start_response(conn, status, NULL, req && req->keep_alive && status < 500);
+  buffer_printf(&conn->out, "Content-Type: text/plain\r\n");
+  end_response(conn, req, body, len);
+}
+
+static void static_response(http_conn* conn, http_request* req, const char* filename)
+{
+  char* data;
+  size_t len;
+
+  if(!read_file(filename, &data, &len))
+  {
+    error_response(conn, req, 404);
+    return;
+  }
+  start_response(conn, 200, NULL, req->keep_alive);
+  buffer_printf(&conn->out, "Content-Type: %s\r\n", content_type_for(filename));
+  end_response(conn, req, data, len);
+  free(data);
+}
+
+/* turns the headers of the cgi response printed by the script into those of an HTTP response.
+   Status: and Location: are handled like a web server would, the length and connection headers
+   are ours. returns the start of the body, or NULL (having written nothing) if there is no valid
+   header block */
+static char* cgi_headers(http_conn* conn, http_request* req, char* out, size_t out_len, int* statusout)
+{
+  http_buffer headers;
+  char status_line[128];
+  char* line;
+  char* body = NULL;
+  int status = 200;
+  int have_status = 0;
+  int have_location = 0;
+
+  memset(&headers, 0, sizeof(headers));
+  status_line[0] = 0;
+
+  for(line = out; line < out + out_len; )
+  {
+    char* eol = memchr(line, '\n', out + out_len - line);
+    char* colon;
+    char* value;
+
+    if(!eol)
+      break;
+    *eol = 0;
+    if(eol > line && eol[-1] == '\r')
+      eol[-1] = 0;
+
+    if(line[0] == 0)
+    {
+      body = eol + 1;
+      break;
+    }
+
+    /* a status line among the headers, e.g. from header("Location: ...") */
+    if(strncmp(line, "HTTP/1.", 7) == 0 && strchr(line, ' '))
+    {
+      value = trim(strchr(line, ' '));
+      if(atoi(value) >= 100)
+      {
+        snprintf(status_line, sizeof(status_line), "%s", value);
+        status = atoi(value);
+        have_status = 1;
+      }
+      line = eol + 1;
+      continue;
+    }
+
+    colon = strchr(line, ':');
+    if(!colon || colon == line || memchr(line, ' ', colon - line))
+      break;
+    *colon = 0;
+    value = trim(colon + 1);
+
+    if(strcasecmp(line, "Status") == 0)
+    {
+      if(atoi(value) >= 100)
+      {
+        snprintf(status_line, sizeof(status_line), "%s", value);
+        status = atoi(value);
+        have_status = 1;
+      }
+    }
+    else if(strcasecmp(line, "Content-Length") != 0 &&
+            strcasecmp(line, "Connection") != 0 &&
+            strcasecmp(line, "Transfer-Encoding") != 0)
+    {
+      if(strcasecmp(line, "Location") == 0)
+        have_location = 1;
+      buffer_printf(&headers, "%s: %s\r\n", line, value);
+    }
+    line = eol + 1;
+  }
+
+  if(!body)
+  {
+    buffer_free(&headers);
+    return NULL;
+  }
+
+  if(!have_status && have_location)
+  {
+    status = 302;
+    have_status = 1;
+  }
+  start_response(conn, status, status_line[0] ? status_line : NULL, req->keep_alive);
+  if(headers.len)
+    buffer_append(&conn->out, headers.data, headers.len);
+  buffer_free(&headers);
+  *statusout = status;
+  return body;
+}
+
+/* turns the cgi response printed by the script into an HTTP response.
+   output without a valid header block is an error page */
+static void cgi_response(http_conn* conn, http_request* req, char* out, size_t out_len)
+{
+  char* body;
+  int status;
+
+  body = cgi_headers(conn, req, out, out_len, &status);
+  if(!body)
+  {
+    CosaPhpExtLog("http invalid cgi response from %s\n", getenv("SCRIPT_NAME"));
+    start_response(conn, 500, NULL, req->keep_alive);
+    buffer_printf(&conn->out, "Content-Type: text/html\r\n");
+    end_response(conn, req, out, out_len);
+    return;
+  }
+
+  /* a 304 has neither a body nor the length of one */
+  if(status == 304)
+    buffer_append(&conn->out, "\r\n", 2);
+  else
+    end_response(conn, req, body, out + out_len - body);
+}
+
+static int flush_conn(http_conn* conn);
+
+/* a response the script flush()'ed part of, which is sent chunked as it comes */
+typedef struct http_stream
+{
+  http_conn* conn;
+  http_request* req;
+  char** out;
+  size_t* out_len;
+  size_t sent;  /* of out, once the headers were */
+  int started;
+}http_stream;
+
+static void stream_chunk(http_stream* stream)
+{
+  size_t len = *stream->out_len - stream->sent;
+
+  if(len && strcmp(stream->req->method, "HEAD") != 0)
+  {
+    buffer_printf(&stream->conn->out, "%lx\r\n", (unsigned long)len);
+    buffer_append(&stream->conn->out, *stream->out + stream->sent, len);
+    buffer_append(&stream->conn->out, "\r\n", 2);
+  }
+  stream->sent += len;
+}
+
+/* flush hook, sends what the script wrote since the last flush() */
+static void stream_flush(void* arg)
+{
+  http_stream* stream = (http_stream*)arg;
+  char* body;
+  int status;
+
+  fflush(stdout);
+  if(!stream->started)
+  {
+    if(strcmp(stream->req->version, "HTTP/1.0") == 0)
+      return;
+    body = cgi_headers(stream->conn, stream->req, *stream->out, *stream->out_len, &status);
+    if(!body)
+      return;
+    buffer_printf(&stream->conn->out, "Transfer-Encoding: chunked\r\n\r\n");
+    stream->sent = body - *stream->out;
+    stream->started = 1;
+  }
+  stream_chunk(stream);
+
+  /* whatever the socket doesn't take now goes after the script is done */
+  if(flush_conn(stream->conn) < 0)
+    stream->conn->close_after = 1;
+}
+
+static void script_response(http_conn* conn, http_request* req, const char* body, duk_context *ctx, jst_request_handler handler)
+{
+  http_stream stream;
+  FILE* saved_stdin = stdin;
+  FILE* saved_stdout = stdout;
+  FILE* req_stdin;
+  FILE* req_stdout;
+  char* out = NULL;
+  size_t out_len = 0;
+
+  if(req->content_len)
+    req_stdin = fmemopen((void*)body, req->content_len, "r");
+  else
+    req_stdin = fopen("/dev/null", "r");
+
+  req_stdout = open_memstream(&out, &out_len);
+
+  if(!req_stdin || !req_stdout)
+  {
+    CosaPhpExtLog("http failed to open request streams\n");
+    if(req_stdin)
+      fclose(req_stdin);
+    if(req_stdout)
+      fclose(req_stdout);
+    free(out);
+    error_response(conn, req, 500);
+    return;
+  }
+
+  stdin = req_stdin;
+  stdout = req_stdout;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.conn = conn;
+  stream.req = req;
+  stream.out = &out;
+  stream.out_len = &out_len;
+  ccsp_output_set_flush_hook(stream_flush, &stream);
+
+  handler(ctx, getenv("SCRIPT_FILENAME"));
+
+  ccsp_output_set_flush_hook(NULL, NULL);
+  fflush(stdout);
+  stdin = saved_stdin;
+  stdout = saved_stdout;
+  fclose(req_stdin);
+  fclose(req_stdout);
+
+  if(stream.started)
+  {
+    stream_chunk(&stream);
+    if(strcmp(req->method, "HEAD") != 0)
+      buffer_printf(&conn->out, "0\r\n\r\n");
+  }
+  else
+    cgi_response(conn, req, out, out_len);
+  free(out);
+}
+
+static void handle_request(http_conn* conn, http_request* req, const char* body, duk_context *ctx, jst_request_handler handler)
+{
+  char path[PATH_MAX];
+  char filename[PATH_MAX];
+  struct stat st;
+  size_t len;
+
+  if(strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0 && strcmp(req->method, "POST") != 0)
+  {
+    error_response(conn, req, 405);
+    return;
+  }
+
+  if(decode_path(req->target, path, sizeof(path)) != 0 ||
+     snprintf(filename, sizeof(filename), "%s%s", g_root, path) >= (int)sizeof(filename))
+  {
+    error_response(conn, req, 400);
+    return;
+  }
+
+  if(stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    error_response(conn, req, 404);
+    return;
+  }
+
+  CosaPhpExtLog("http request %s %s\n", req->method, req->target);
+
+  len = strlen(path);
+  if(len > 4 && strcmp(path + len - 4, ".jst") == 0)
+  {
+    apply_request_env(conn, req, path, filename);
+    script_response(conn, req, body, ctx, handler);
+  }
+  else
+  {
+    static_response(conn, req, filename);
+  }
+}
+
+static void close_conn(int epfd, http_conn* conn)
+{
+  http_conn** pp;
+
+  for(pp = &g_conns; *pp; pp = &(*pp)->next)
+  {
+    if(*pp == conn)
+    {
+      *pp = conn->next;
+      break;
+    }
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  buffer_free(&conn->in);
+  buffer_free(&conn->out);
+  free(conn);
+  g_conn_count--;
+}
+
+static int watch_conn(int epfd, http_conn* conn, unsigned int events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = conn;
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* sends as much pending output as the socket takes.
+   returns 1 when everything has been sent, 0 if the socket is full and -1 on error */
+static int flush_conn(http_conn* conn)
+{
+  while(conn->out_off < conn->out.len)
+  {
+    ssize_t rc = send(conn->fd, conn->out.data + conn->out_off, conn->out.len - conn->out_off, MSG_NOSIGNAL);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if(rc <= 0)
+      return -1;
+    conn->out_off += rc;
+    conn->last_active = time(NULL);
+  }
+  conn->out.len = 0;
+  conn->out_off = 0;
+  return 1;
+}
+
+/* handles every complete request buffered on the connection (pipelining) until
+   output backs up, more input is needed or the connection is to be closed */
+static void process_conn(int epfd, http_conn* conn, duk_context *ctx, jst_request_handler handler)
+{
+  for(;;)
+  {
+    http_request req;
+    int rc;
+
+    if(conn->out.len)
+    {
+      rc = flush_conn(conn);
+      if(rc < 0)
+      {
+        close_conn(epfd, conn);
+        return;
+      }
+      if(rc == 0)
+      {
+        watch_conn(epfd, conn, EPOLLOUT);
+        return;
+      }
+    }
+
+    if(conn->close_after)
+    {
+      close_conn(epfd, conn);
+      return;
+    }
+
+    if(conn->in.len == 0)
+      break;
+
+    rc = parse_request(conn, &req);
+    if(rc == 0)
+      break;
+    if(rc < 0)
+    {
+      error_response(conn, NULL, -rc);
+      conn->in.len = 0;
+      continue;
+    }
+
+    if(conn->in.len - req.header_len < req.content_len)
+    {
+      if(req.expect_continue && !conn->sent_continue)
+      {
+        buffer_printf(&conn->out, "HTTP/1.1 100 Continue\r\n\r\n");
+        conn->sent_continue = 1;
+        continue;
+      }
+      break;
+    }
+
+    handle_request(conn, &req, conn->in.data + req.header_len, ctx, handler);
+    buffer_consume(&conn->in, req.header_len + req.content_len);
+    conn->sent_continue = 0;
+  }
+
+  watch_conn(epfd, conn, EPOLLIN);
+}
+
+/* reads what the connection has, up to HTTP_READS_PER_EVENT reads so one busy client can't keep
+   the others waiting (the rest is still there on the next epoll_wait), and never much more than
+   the largest request there can be, so process_conn gets to answer 431/413 for one too large */
+static void read_conn(int epfd, http_conn* conn, duk_context *ctx, jst_request_handler handler)
+{
+  int reads;
+
+  for(reads = 0; reads < HTTP_READS_PER_EVENT && conn->in.len <= HTTP_MAX_REQUEST_LEN; ++reads)
+  {
+    ssize_t rc;
+
+    if(buffer_reserve(&conn->in, HTTP_READ_LEN) != 0)
+    {
+      close_conn(epfd, conn);
+      return;
+    }
+    rc = recv(conn->fd, conn->in.data + conn->in.len, HTTP_READ_LEN, 0);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(rc <= 0)
+    {
+      close_conn(epfd, conn);
+      return;
+    }
+    conn->in.len += rc;
+    conn->in.data[conn->in.len] = 0;
+  }
+
+  conn->last_active = time(NULL);
+  process_conn(epfd, conn, ctx, handler);
+}
+
+static void accept_conns(int epfd, int listen_fd)
+{
+  for(;;)
+  {
+    struct sockaddr_storage remote;
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(remote);
+    struct epoll_event ev;
+    http_conn* conn;
+    int fd;
+
+    fd = accept4(listen_fd, (struct sockaddr*)&remote, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0)
+    {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "Error: http accept failed %s\n", strerror(errno));
+      return;
+    }
+
+    if(g_conn_count == HTTP_MAX_CONNS)
+    {
+      CosaPhpExtLog("http too many connections\n");
+      close(fd);
+      continue;
+    }
+
+    conn = (http_conn*)calloc(1, sizeof(http_conn));
+    if(!conn)
+    {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->last_active = time(NULL);
+    strcpy(conn->remote_addr, "127.0.0.1");
+    strcpy(conn->remote_port, "0");
+    strcpy(conn->local_addr, "127.0.0.1");
+    strcpy(conn->local_port, "0");
+    if(remote.ss_family != AF_UNIX)
+    {
+      getnameinfo((struct sockaddr*)&remote, len, conn->remote_addr, sizeof(conn->remote_addr),
+        conn->remote_port, sizeof(conn->remote_port), NI_NUMERICHOST | NI_NUMERICSERV);
+      len = sizeof(local);
+      if(getsockname(fd, (struct sockaddr*)&local, &len) == 0)
+        getnameinfo((struct sockaddr*)&local, len, conn->local_addr, sizeof(conn->local_addr),
+          conn->local_port, sizeof(conn->local_port), NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->next = g_conns;
+    g_conns = conn;
+    g_conn_count++;
+  }
+}
+
+/* closes keep-alive connections which have been idle for too long.
+   one with a response still going out isn't idle, however slow the client takes it */
+static void close_idle_conns(int epfd)
+{
+  time_t now = time(NULL);
+  http_conn* conn = g_conns;
+
+  while(conn)
+  {
+    http_conn* next = conn->next;
+    if(conn->out.len == 0 && now - conn->last_active > HTTP_KEEPALIVE_TIMEOUT)
+      close_conn(epfd, conn);
+    conn = next;
+  }
+}
+
+int jst_http_run(duk_context *ctx, const char *addr, const char *root, jst_request_handler handler)
+{
+  struct sigaction sa;
+  struct epoll_event ev;
+  int listen_fd;
+  int epfd;
+
+  if(!realpath(root, g_root))
+  {
+    fprintf(stderr, "Error: invalid document root %s: %s\n", root, strerror(errno));
+    return -1;
+  }
+  if(strcmp(g_root, "/") == 0)
+    g_root[0] = 0;
+
+  listen_fd = open_listen_socket(addr);
+  if(listen_fd < 0)
+    return -1;
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epfd < 0)
+  {
+    fprintf(stderr, "Error: epoll_create failed %s\n", strerror(errno));
+    close(listen_fd);
+    return -1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  g_base_environ = copy_environ();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = http_sighandler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  CosaPhpExtLog("http server %d ready, root %s\n", (int)getpid(), g_root);
+
+  while(!g_stop)
+  {
+    struct epoll_event events[64];
+    int count;
+    int i;
+
+    count = epoll_wait(epfd, events, 64, 1000);
+    if(count < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Error: epoll_wait failed %s\n", strerror(errno));
+      break;
+    }
+
+    for(i = 0; i < count; ++i)
+    {
+      http_conn* conn = (http_conn*)events[i].data.ptr;
+
+      if(!conn)
+        accept_conns(epfd, listen_fd);
+      else if(events[i].events & EPOLLIN)
+        read_conn(epfd, conn, ctx, handler);
+      else if(events[i].events & EPOLLOUT)
+        process_conn(epfd, conn, ctx, handler);
+      else
+        close_conn(epfd, conn);
+    }
+
+    close_idle_conns(epfd);
+  }
+
+  CosaPhpExtLog("http server %d exiting\n", (int)getpid());
+
+  while(g_conns)
+    close_conn(epfd, g_conns);
+  close(epfd);
+  close(listen_fd);
+
+  return g_stop ? 0 : -1;
+}
@@ -16,11 +16,18 @@
  See the License for the specific language governing permissions and
  limitations under the License.
 */
+#define _GNU_SOURCE
 #include "jst_internal.h"
 #include <stdio.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define COSA_PHP_EXT_LOG_FILE_NAME  "/var/log/cosa_php_ext.log"
 #define COSA_PHP_EXT_DEBUG_FILE "/tmp/cosa_php_debug"
@@ -209,3 +216,213 @@ int read_file(const char *filename, char** bufout, size_t* lenout)
   return *lenout;
 }
 
+/* maps filename read only. unlike read_file the data isn't NUL terminated, and it stays
+   in the page cache shared with other processes rather than being copied.
+   the caller munmaps it. an empty file fails like it does for read_file */
+int map_file(const char *filename, const char** bufout, size_t* lenout)
+{
+  struct stat st;
+  void* addr;
+  int fd;
+
+  CosaPhpExtLog( "map_file %s\n", filename );
+
+  errno = 0;
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if(fd < 0 || fstat(fd, &st) != 0)
+  {
+    char * serr = strerror(errno);
+    CosaPhpExtLog( "map_file cannot open file:%s error:%s\n", filename, serr );
+    fprintf(stderr, "Error: cannot open file:%s error:%s\n", filename, serr);
+    if(fd >= 0)
+      close(fd);
+    return 0;
+  }
+
+  if(st.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  /* the parser reads it all front to back so fault it all in at once */
+#ifdef MAP_POPULATE
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+  close(fd);
+  if(addr == MAP_FAILED)
+  {
+    fprintf(stderr, "Error: mmap failed %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+
+  *bufout = (const char*)addr;
+  *lenout = st.st_size;
+  return *lenout;
+}
+
+/* deflates len bytes of data onto the end of *buf (*buflen bytes used of *alloc, grown as
+   needed), ending with flush, e.g. Z_FULL_FLUSH to end on a byte boundary with nothing after
+   it referring back to what came before */
+int deflate_append(z_stream* z, const char* data, size_t len, int flush, char** buf, size_t* buflen, size_t* alloc)
+{
+  size_t room;
+
+  z->next_in = (Bytef*)data;
+  z->avail_in = (uInt)len;
+  do
+  {
+    if(*alloc - *buflen < 1024)
+    {
+      size_t n = *alloc ? *alloc * 2 : 16 * 1024;
+      char* p = (char*)realloc(*buf, n);
+      if(!p)
+        return 0;
+      *buf = p;
+      *alloc = n;
+    }
+    room = *alloc - *buflen;
+    z->next_out = (Bytef*)*buf + *buflen;
+    z->avail_out = (uInt)room;
+    if(deflate(z, flush) == Z_STREAM_ERROR)
+      return 0;
+    *buflen += room - z->avail_out;
+  } while(z->avail_out == 0);
+  return 1;
+}
+
+
+/* same as duk_put_function_list, except with JST_LIGHTFUNC_MODULES the functions are pushed as
+   lightfuncs which take no heap allocation (but have no properties of their own) */
+void put_function_list(duk_context *ctx, duk_idx_t obj_idx, const duk_function_list_entry *funcs)
+{
+#if defined(JST_LIGHTFUNC_MODULES)
+  const duk_function_list_entry* f;
+
+  obj_idx = duk_require_normalize_index(ctx, obj_idx);
+  for(f = funcs; f->key; ++f)
+  {
+    duk_push_c_lightfunc(ctx, f->value, f->nargs, f->nargs == DUK_VARARGS ? 0 : f->nargs, 0);
+    duk_put_prop_string(ctx, obj_idx, f->key);
+  }
+#else
+  duk_put_function_list(ctx, obj_idx, funcs);
+#endif
+}
+
+/* addr is either a unix socket path (anything containing a '/')
+   or host:port where an empty host means all interfaces */
+int open_listen_socket(const char* addr)
+{
+  int fd;
+  int on = 1;
+  const char* colon;
+
+  colon = strrchr(addr, ':');
+
+  if(strchr(addr, '/') || !colon)
+  {
+    struct sockaddr_un sun;
+
+    if(strlen(addr) >= sizeof(sun.sun_path))
+    {
+      fprintf(stderr, "Error: socket path too long %s\n", addr);
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, addr);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+      fprintf(stderr, "Error: socket failed %s\n", strerror(errno));
+      return -1;
+    }
+    unlink(addr);
+    if(bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0)
+    {
+      fprintf(stderr, "Error: cannot bind %s error:%s\n", addr, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  else
+  {
+    char host[256];
+    size_t host_len;
+    struct addrinfo hints;
+    struct addrinfo* res;
+    int rc;
+
+    host_len = colon - addr;
+    if(host_len >= sizeof(host))
+    {
+      fprintf(stderr, "Error: host name too long %s\n", addr);
+      return -1;
+    }
+    memcpy(host, addr, host_len);
+    host[host_len] = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    rc = getaddrinfo(host_len ? host : NULL, colon + 1, &hints, &res);
+    if(rc != 0)
+    {
+      fprintf(stderr, "Error: cannot resolve %s error:%s\n", addr, gai_strerror(rc));
+      return -1;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0)
+    {
+      fprintf(stderr, "Error: socket failed %s\n", strerror(errno));
+      freeaddrinfo(res);
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+      fprintf(stderr, "Error: cannot bind %s error:%s\n", addr, strerror(errno));
+      freeaddrinfo(res);
+      close(fd);
+      return -1;
+    }
+    freeaddrinfo(res);
+  }
+
+  if(listen(fd, SOMAXCONN) != 0)
+  {
+    fprintf(stderr, "Error: cannot listen on %s error:%s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  CosaPhpExtLog("listening on %s\n", addr);
+  return fd;
+}
+
+/* returns a copy of the current environment, e.g. to restore it between requests */
+char** copy_environ(void)
+{
+  extern char** environ;
+  char** copy;
+  size_t count = 0;
+  size_t i;
+
+  while(environ[count])
+    count++;
+
+  copy = (char**)calloc(count + 1, sizeof(char*));
+  if(!copy)
+    return NULL;
+
+  for(i = 0; i < count; ++i)
+    copy[i] = strdup(environ[i]);
+
+  return copy;
+}
@@ -19,6 +19,9 @@
 #ifndef CCSP_DUKTAPE_INTERNAL_H
 #define CCSP_DUKTAPE_INTERNAL_H
 
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include <duktape.h>
 
 #define RETURN_LSTRING(res, len) { duk_push_lstring(ctx, res, len); return 1; }
@@ -27,9 +30,93 @@
 #define RETURN_FALSE { duk_push_false(ctx); return 1; }
 #define RETURN_LONG(res) { duk_push_number(ctx, res); return 1; }
 
+/* the ROM built-ins build turns duktape's own functions into lightfuncs, do the same for ours */
+#if defined(DUK_USE_ROM_OBJECTS) && !defined(JST_LIGHTFUNC_MODULES)
+#define JST_LIGHTFUNC_MODULES
+#endif
+
 void init_logger();
 void CosaPhpExtLog(const char* format, ...);
 int parse_parameter(const char* func, duk_context *ctx, const char* types, ...);
 int read_file(const char *filename, char** bufout, size_t* lenout);
+int map_file(const char *filename, const char** bufout, size_t* lenout);
+int deflate_append(z_stream* z, const char* data, size_t len, int flush, char** buf, size_t* buflen, size_t* alloc);
+void put_function_list(duk_context *ctx, duk_idx_t obj_idx, const duk_function_list_entry *funcs);
+int open_listen_socket(const char* addr);
+char** copy_environ(void);
+
+/* files built into the binary by tools/jst_embed when JST_EMBEDDED_PRELUDE is defined */
+typedef struct jst_embedded_file
+{
+  const char* name;
+  const unsigned char* data;
+  size_t len;
+  int bytecode;
+}jst_embedded_file;
+extern const jst_embedded_file jst_embedded_files[];
+
+void* jst_arena_alloc(size_t size);
+void* jst_arena_grow(void* p, size_t old_size, size_t new_size);
+int jst_arena_map_file(const char* filename, const char** bufout, size_t* lenout);
+void jst_arena_release(void);
+
+typedef void (*cache_dep_fn)(const char* path, void* arg);
+int cache_load(const char* key, cache_dep_fn dep_fn, void* arg, char** bufout, size_t* lenout);
+/* a file cached data is built from, as it was when it was read. found is 0 if it didn't exist */
+typedef struct cache_file
+{
+  const char* path;
+  struct stat st;
+  int found;
+}cache_file;
+void cache_file_stat(cache_file* file, const char* path);
+int cache_store(const char* key, const cache_file* deps, int dep_count, const char* data, size_t data_len);
+int cache_store_ttl(const char* key, int ttl, const char* data, size_t data_len);
+int cache_load_ttl(const char* key, char** bufout, size_t* lenout);
+
+/* see flush() in jst_output.c */
+typedef void (*output_flush_fn)(void* arg);
+void ccsp_output_set_flush_hook(output_flush_fn fn, void* arg);
+
+/* site bundle of precompiled pages, see jst_bundle.c */
+typedef struct bundle_page
+{
+  const char* name;
+  const char* const* deps;
+  int dep_count;
+  const char* code;
+  size_t code_len;
+}bundle_page;
+int bundle_enabled(void);
+int bundle_find(const char* name, cache_dep_fn dep_fn, void* arg, const char** bufout, size_t* lenout);
+int bundle_write(const char* filename, const bundle_page* pages, int count);
+
+int template_loaded_files(const char* const** pathsout, const char** rootout);
+int template_php_prelude_code(const char** codeout, size_t* lenout);
+
+/* the static content blocks of the request, see template_write_static */
+int template_static_block(uint32_t n, const char** dataout, size_t* lenout);
+int template_static_deflated(uint32_t n, const char** dataout, size_t* lenout, uint32_t* crcout);
+int template_static_image(const char* code, size_t code_len, char** bufout, size_t* lenout);
+
+/* a top level template with no code, see jst_static_page */
+int template_content_only(const char *filename, struct stat* st, uint32_t* crc);
+
+/* hooks into the template parser for jst --analyze-includes, see jst_analyze.c.
+   begin and end are called around every load_template_file (js is NULL if nothing was loaded,
+   e.g. for a file already included once) and runtime_include for each include( which is left
+   to run at runtime, with the rest of the template from there */
+typedef struct template_observer
+{
+  void (*begin)(const char* filename, int top, void* arg);
+  void (*end)(const char* filename, const char* js, size_t js_len, void* arg);
+  void (*runtime_include)(const char* s, const char* end, void* arg);
+  void* arg;
+}template_observer;
+void template_set_observer(const template_observer* observer);
+
+/* the pages of a site, for jst --precompile and --analyze-includes, see jst_precompile.c */
+int site_open(const char* docroot, const char* const* preloads, int preload_count, char*** pagesout);
+void site_free_pages(char** pages, int count);
 
 #endif
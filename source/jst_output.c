@@ -0,0 +1,981 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/* Response of the page being run.
+
+   The body is a list of segments in the order the page produced them: text echo()'ed (copied
+   into one buffer, consecutive echoes make one segment) or a static content block of the page
+   (__jst_static(n), see template_write_static), which is only referred to by its number and is
+   never copied or turned into a js string. header() lines are kept apart, so _jst_finish can
+   write the headers, a Content-Length and the body to stdout with a single writev.
+
+   A segment refers to its text by offset and a block by number since the echo buffer and the
+   block table (which grows with runtime includes) can both move until the response is written.
+
+   A response of a compressible type and size is sent gzip'ed to a client which accepts that.
+   Blocks which were deflated ahead of time (when the page was cached or bundled, see
+   template_static_image) are sent as they are and only what is in between them is deflated here,
+   each run ending with a full flush so it can be followed by a block deflated on its own.
+
+   A GET or HEAD response which is not a redirect and has no Status:, ETag or no-store of the
+   page's own gets an ETag: the crc32 of its content type and body (and its length). The crc32
+   of a block deflated ahead of time is known, so the body is only read through once, for what
+   was echo()'ed and the blocks that weren't. A request whose If-None-Match has that tag is
+   answered with a 304 and the headers of the page, but no body.
+
+   What a fragment of the page echoes (static blocks included) can be kept in the on disk cache
+   for a while and echoed from there instead (see cache_fragment in jst_prefix.js).
+
+   flush() writes the headers and the body so far right away, and from then on every flush()
+   and _jst_finish write what was echoed since. Such a response has no Content-Length (the web
+   server, or jst --serve and --fastcgi through the flush hook, streams it to the client as it
+   comes), no ETag and isn't gzip'ed, and header() can't add to it any more. */
+
+#define OUTPUT_MIN_SIZE (64 * 1024)
+#define OUTPUT_TEXT ((uint32_t)-1)
+#define OUTPUT_DEFAULT_CONTENT_TYPE "Content-type: text/html\r\n"
+#define OUTPUT_REDIRECT_STATUS "HTTP/1.0 302 Ok\r\nStatus: 302 Moved\r\n"
+#define OUTPUT_GZIP_HEADERS "Content-Encoding: gzip\r\n"
+#define OUTPUT_VARY_HEADER "Vary: Accept-Encoding\r\n"
+#define OUTPUT_NOT_MODIFIED_STATUS "Status: 304 Not Modified\r\n"
+#define OUTPUT_FRAGMENT_KEY_PREFIX "fragment:"
+#define MAX_FRAGMENT_KEY_LEN 1024
+
+#ifndef JST_GZIP_MIN_SIZE
+#define JST_GZIP_MIN_SIZE 1024
+#endif
+#ifndef JST_GZIP_LEVEL
+#define JST_GZIP_LEVEL 6
+#endif
+
+typedef struct output_buffer
+{
+  char* data;
+  size_t len;
+  size_t alloc;
+}output_buffer;
+
+typedef struct output_segment
+{
+  uint32_t block;  /* static block number or OUTPUT_TEXT */
+  size_t offset;   /* of the text in g_text */
+  size_t len;
+}output_segment;
+
+/* part of a gzip'ed body, data is NULL for what was deflated into g_gzip */
+typedef struct output_piece
+{
+  const char* data;
+  size_t offset;
+  size_t len;
+}output_piece;
+
+/* content types worth compressing */
+static const char* const g_gzip_types[] = {
+  "text/",
+  "application/json",
+  "application/javascript",
+  "application/xml",
+  "image/svg+xml",
+  NULL
+};
+
+void ccsp_output_reset(void);
+
+static output_buffer g_text;
+static output_buffer g_headers;
+static output_segment* g_segments = NULL;
+static int g_segment_count = 0;
+static int g_segment_alloc = 0;
+static size_t g_body_len = 0;
+static int g_content_type_set = 0;
+static char g_content_type[64] = {0};
+static int g_encoding_set = 0;
+static int g_etag_allowed = 1;
+static int g_streaming = 0;
+static size_t g_flushed_len = 0;
+static output_flush_fn g_flush_hook = NULL;
+static void* g_flush_hook_arg = NULL;
+static output_buffer g_gzip;
+static z_stream g_deflate;
+static int g_deflate_ready = 0;
+
+static int buffer_append(output_buffer* buf, const char* data, size_t len)
+{
+  if(buf->alloc - buf->len < len)
+  {
+    size_t alloc = buf->alloc ? buf->alloc : OUTPUT_MIN_SIZE;
+    char* p;
+
+    while(alloc - buf->len < len)
+      alloc *= 2;
+    p = (char*)realloc(buf->data, alloc);
+    if(!p)
+    {
+      CosaPhpExtLog("output failed to alloc %zu bytes\n", alloc);
+      return 0;
+    }
+    buf->data = p;
+    buf->alloc = alloc;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 1;
+}
+
+/* keeps the memory for the next request unless a big response left it oversized */
+static void buffer_reset(output_buffer* buf)
+{
+  if(buf->alloc > OUTPUT_MIN_SIZE)
+  {
+    free(buf->data);
+    buf->data = NULL;
+    buf->alloc = 0;
+  }
+  buf->len = 0;
+}
+
+static output_segment* output_add_segment(void)
+{
+  if(g_segment_count == g_segment_alloc)
+  {
+    int alloc = g_segment_alloc ? g_segment_alloc * 2 : 256;
+    output_segment* segments = (output_segment*)realloc(g_segments, alloc * sizeof(output_segment));
+    if(!segments)
+    {
+      CosaPhpExtLog("output failed to alloc %d segments\n", alloc);
+      return NULL;
+    }
+    g_segments = segments;
+    g_segment_alloc = alloc;
+  }
+  return &g_segments[g_segment_count++];
+}
+
+static int output_text(const char* str, size_t len)
+{
+  output_segment* seg = g_segment_count ? &g_segments[g_segment_count - 1] : NULL;
+
+  if(!len)
+    return 1;
+
+  /* text right after more text is part of the same segment */
+  if(!seg || seg->block != OUTPUT_TEXT || seg->offset + seg->len != g_text.len)
+  {
+    seg = output_add_segment();
+    if(!seg)
+      return 0;
+    seg->block = OUTPUT_TEXT;
+    seg->offset = g_text.len;
+    seg->len = 0;
+  }
+  if(!buffer_append(&g_text, str, len))
+    return 0;
+  seg->len += len;
+  g_body_len += len;
+  return 1;
+}
+
+static int output_segment_data(const output_segment* seg, const char** data)
+{
+  size_t len;
+
+  if(seg->block == OUTPUT_TEXT)
+  {
+    *data = g_text.data + seg->offset;
+    return 1;
+  }
+  return template_static_block(seg->block, data, &len);
+}
+
+/* echo(str) with str coerced as _jst_echo_buffer += str used to */
+static duk_ret_t output_echo(duk_context *ctx)
+{
+  const char* str;
+  duk_size_t len;
+
+  duk_to_primitive(ctx, 0, DUK_HINT_NONE);
+  str = duk_to_lstring(ctx, 0, &len);
+  if(!output_text(str, len))
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+/* __jst_static(n), n as numbered by the parser */
+static duk_ret_t output_static(duk_context *ctx)
+{
+  uint32_t n = (uint32_t)duk_require_uint(ctx, 0);
+  output_segment* seg;
+  const char* data;
+  size_t len;
+
+  if(!template_static_block(n, &data, &len))
+  {
+    CosaPhpExtLog("no static block %u\n", (unsigned)n);
+    RETURN_FALSE;
+  }
+  seg = output_add_segment();
+  if(!seg)
+    RETURN_FALSE;
+  seg->block = n;
+  seg->offset = 0;
+  seg->len = len;
+  g_body_len += len;
+  RETURN_TRUE;
+}
+
+/* header(str). a Location: header turns the response into a redirect */
+static duk_ret_t output_header(duk_context *ctx)
+{
+  const char* str;
+  duk_size_t len;
+
+  str = duk_to_lstring(ctx, 0, &len);
+
+  if(g_streaming)
+  {
+    CosaPhpExtLog("output header %s dropped, headers were flushed already\n", str);
+    RETURN_FALSE;
+  }
+
+  if(strncasecmp(str, "location:", 9) == 0)
+  {
+    g_etag_allowed = 0;
+    g_headers.len = 0;
+    buffer_append(&g_headers, OUTPUT_REDIRECT_STATUS, sizeof(OUTPUT_REDIRECT_STATUS) - 1);
+  }
+  else if(strncasecmp(str, "content-type:", 13) == 0)
+  {
+    g_content_type_set = 1;
+    snprintf(g_content_type, sizeof(g_content_type), "%s", str + 13 + strspn(str + 13, " \t"));
+    if(strcasestr(str, "application/json"))
+      buffer_append(&g_headers, "Content-Type: text/html\r\n", 25);
+  }
+  else if(strncasecmp(str, "content-encoding:", 17) == 0)
+  {
+    g_encoding_set = 1;
+  }
+  else if(strncasecmp(str, "status:", 7) == 0 || strncasecmp(str, "http/", 5) == 0 ||
+          strncasecmp(str, "etag:", 5) == 0 ||
+          (strncasecmp(str, "cache-control:", 14) == 0 && strcasestr(str, "no-store")))
+  {
+    g_etag_allowed = 0;
+  }
+
+  if(!buffer_append(&g_headers, str, len) || !buffer_append(&g_headers, "\r\n", 2))
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+static int output_fragment_key(duk_context *ctx, char* key, size_t size)
+{
+  const char* name = duk_to_string(ctx, 0);
+
+  return snprintf(key, size, "%s%s", OUTPUT_FRAGMENT_KEY_PREFIX, name) < (int)size;
+}
+
+/* loadFragment(key). echoes the fragment cached for key, if there is one */
+static duk_ret_t output_load_fragment(duk_context *ctx)
+{
+  char key[MAX_FRAGMENT_KEY_LEN];
+  char* buf;
+  size_t len;
+  int ok;
+
+  if(!output_fragment_key(ctx, key, sizeof(key)) || !cache_load_ttl(key, &buf, &len))
+    RETURN_FALSE;
+  ok = output_text(buf, len);
+  free(buf);
+  if(!ok)
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+/* bodyLength(). where a fragment starts, for storeFragment */
+static duk_ret_t output_body_length(duk_context *ctx)
+{
+  duk_push_number(ctx, (duk_double_t)(g_flushed_len + g_body_len));
+  return 1;
+}
+
+/* storeFragment(key, ttl, start). caches what was echoed since the body was start long */
+static duk_ret_t output_store_fragment(duk_context *ctx)
+{
+  char key[MAX_FRAGMENT_KEY_LEN];
+  int ttl = duk_to_int(ctx, 1);
+  size_t start = (size_t)duk_to_number(ctx, 2);
+  size_t offset = 0;
+  size_t len = 0;
+  char* buf;
+  int ok;
+  int i;
+
+  /* part of the fragment may have been flushed */
+  if(ttl <= 0 || start < g_flushed_len || start - g_flushed_len > g_body_len ||
+     !output_fragment_key(ctx, key, sizeof(key)))
+    RETURN_FALSE;
+  start -= g_flushed_len;
+
+  buf = (char*)malloc(g_body_len - start + 1);
+  if(!buf)
+    RETURN_FALSE;
+  for(i = 0; i < g_segment_count; ++i)
+  {
+    const output_segment* seg = &g_segments[i];
+    const char* data;
+    size_t skip;
+
+    offset += seg->len;
+    if(offset <= start || !output_segment_data(seg, &data))
+      continue;
+    skip = offset - seg->len < start ? start - (offset - seg->len) : 0;
+    memcpy(buf + len, data + skip, seg->len - skip);
+    len += seg->len - skip;
+  }
+
+  ok = cache_store_ttl(key, ttl, buf, len);
+  free(buf);
+  if(!ok)
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+static int output_writev(int fd, struct iovec* iov, int count)
+{
+  ssize_t rc;
+
+  while(count > 0)
+  {
+    rc = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return 0;
+    while(count > 0 && (size_t)rc >= iov->iov_len)
+    {
+      rc -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if(count > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 1;
+}
+
+/* writes the headers and body to stdout. in server modes stdout is a memory stream, which has
+   no descriptor to writev to */
+static int output_send(struct iovec* iov, int count)
+{
+  int fd;
+  int i;
+
+  fflush(stdout);
+  fd = fileno(stdout);
+  if(fd >= 0)
+    return output_writev(fd, iov, count);
+
+  for(i = 0; i < count; ++i)
+    if(fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout) != iov[i].iov_len)
+      return 0;
+  return 1;
+}
+
+/* whether the response is of a type and size worth compressing */
+static int output_compressible(void)
+{
+  const char* type = g_content_type_set ? g_content_type : "text/html";
+  int i;
+
+  if(g_encoding_set || g_body_len < JST_GZIP_MIN_SIZE)
+    return 0;
+  for(i = 0; g_gzip_types[i]; ++i)
+    if(strncasecmp(type, g_gzip_types[i], strlen(g_gzip_types[i])) == 0)
+      return 1;
+  return 0;
+}
+
+/* whether Accept-Encoding lists gzip (or x-gzip) other than with q=0 */
+static int output_gzip_accepted(void)
+{
+  const char* p = getenv("HTTP_ACCEPT_ENCODING");
+  const char* end;
+  const char* s;
+  size_t n;
+
+  while(p && *p)
+  {
+    p += strspn(p, " \t,");
+    n = strcspn(p, " \t;,");
+    end = p + strcspn(p, ",");
+    if((n == 4 && strncasecmp(p, "gzip", 4) == 0) || (n == 6 && strncasecmp(p, "x-gzip", 6) == 0))
+    {
+      for(s = p + n; s < end; s += strcspn(s, ";,"))
+      {
+        s += strspn(s, " \t;");
+        if(strncasecmp(s, "q=", 2) == 0)
+          return strtod(s + 2, NULL) > 0;
+      }
+      return 1;
+    }
+    p = end;
+  }
+  return 0;
+}
+
+/* crc32 of the body, with that of the blocks deflated ahead of time as it was stored */
+static uint32_t output_crc(void)
+{
+  uLong crc = crc32(0, NULL, 0);
+  int i;
+
+  for(i = 0; i < g_segment_count; ++i)
+  {
+    const output_segment* seg = &g_segments[i];
+    const char* data;
+    size_t len;
+    uint32_t block_crc;
+
+    if(seg->block != OUTPUT_TEXT && template_static_deflated(seg->block, &data, &len, &block_crc))
+      crc = crc32_combine(crc, block_crc, seg->len);
+    else if(output_segment_data(seg, &data))
+      crc = crc32(crc, (const Bytef*)data, seg->len);
+  }
+  return (uint32_t)crc;
+}
+
+/* whether the response gets an ETag at all */
+static int output_etag_allowed(void)
+{
+  const char* method = getenv("REQUEST_METHOD");
+
+  return g_etag_allowed && method && (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0);
+}
+
+/* the ETag header of the body of len bytes with crc32 crc, as sent with encoding gzip'ed or not */
+static int output_etag(char* etag, size_t size, uint32_t crc, size_t len, int gzipped)
+{
+  const char* type = g_content_type_set ? g_content_type : "text/html";
+  uLong tag = crc32(0, (const Bytef*)type, strlen(type));
+
+  tag = crc32_combine(tag, crc, len);
+  return snprintf(etag, size, "ETag: \"%08lx%zx%s\"\r\n", (unsigned long)tag, len, gzipped ? "-gz" : "");
+}
+
+/* whether If-None-Match has the tag of etag (the header, so the tag is from the first "),
+   compared weakly, or is * */
+static int output_not_modified(const char* etag)
+{
+  const char* p = getenv("HTTP_IF_NONE_MATCH");
+  const char* tag = strchr(etag, '"');
+  size_t tag_len = strchr(tag + 1, '"') + 1 - tag;
+  size_t n;
+
+  while(p && *p)
+  {
+    p += strspn(p, " \t,");
+    if(*p == '*')
+      return 1;
+    if(strncmp(p, "W/", 2) == 0)
+      p += 2;
+    n = *p == '"' && strchr(p + 1, '"') ? (size_t)(strchr(p + 1, '"') + 1 - p) : strcspn(p, ",");
+    if(n == tag_len && memcmp(p, tag, n) == 0)
+      return 1;
+    p += n;
+    p += strcspn(p, ",");
+  }
+  return 0;
+}
+
+/* deflates what is left of the current run of g_gzip (pieces[count - 1]) up to flush */
+static int output_deflate_run(output_piece* piece, const char* data, size_t len, int flush)
+{
+  if(!deflate_append(&g_deflate, data, len, flush, &g_gzip.data, &g_gzip.len, &g_gzip.alloc))
+    return 0;
+  piece->len = g_gzip.len - piece->offset;
+  return 1;
+}
+
+/* deflates the body into the pieces of one raw deflate stream.
+   returns the number of pieces or -1 */
+static int output_deflate(output_piece* pieces)
+{
+  int count = 0;
+  int run = 0;
+  int i;
+
+  if(!g_deflate_ready)
+  {
+    memset(&g_deflate, 0, sizeof(g_deflate));
+    if(deflateInit2(&g_deflate, JST_GZIP_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return -1;
+    g_deflate_ready = 1;
+  }
+  else
+    deflateReset(&g_deflate);
+  g_gzip.len = 0;
+
+  for(i = 0; i < g_segment_count; ++i)
+  {
+    const output_segment* seg = &g_segments[i];
+    const char* data;
+    size_t len;
+    uint32_t block_crc;
+
+    if(seg->block != OUTPUT_TEXT && template_static_deflated(seg->block, &data, &len, &block_crc))
+    {
+      if(run && !output_deflate_run(&pieces[count - 1], NULL, 0, Z_FULL_FLUSH))
+        return -1;
+      run = 0;
+      pieces[count].data = data;
+      pieces[count].offset = 0;
+      pieces[count++].len = len;
+      continue;
+    }
+
+    if(!output_segment_data(seg, &data))
+      continue;
+    if(!run)
+    {
+      pieces[count].data = NULL;
+      pieces[count].offset = g_gzip.len;
+      pieces[count++].len = 0;
+      run = 1;
+    }
+    if(!output_deflate_run(&pieces[count - 1], data, seg->len, Z_NO_FLUSH))
+      return -1;
+  }
+
+  /* the stream ends with the last run, or an empty final block */
+  if(!run)
+  {
+    pieces[count].data = NULL;
+    pieces[count].offset = g_gzip.len;
+    pieces[count++].len = 0;
+  }
+  if(!output_deflate_run(&pieces[count - 1], NULL, 0, Z_FINISH))
+    return -1;
+  return count;
+}
+
+static void put_le32(unsigned char* p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/* adds the body to iov, returns its length */
+static size_t output_body_iov(struct iovec* iov, int* count)
+{
+  size_t len = 0;
+  int i;
+
+  for(i = 0; i < g_segment_count; ++i)
+  {
+    const char* data;
+
+    if(!output_segment_data(&g_segments[i], &data))
+      continue;
+    iov[*count].iov_base = (void*)data;
+    iov[(*count)++].iov_len = g_segments[i].len;
+    len += g_segments[i].len;
+  }
+  return len;
+}
+
+/* writes the headers, the first time, and what was echoed since the last time */
+static int output_stream(void)
+{
+  struct iovec* iov;
+  size_t len;
+  int count = 0;
+  int ok;
+
+  iov = (struct iovec*)malloc((g_segment_count + 3) * sizeof(struct iovec));
+  if(!iov)
+  {
+    CosaPhpExtLog("output failed to alloc %d iovecs\n", g_segment_count + 3);
+    return 0;
+  }
+
+  if(!g_streaming)
+  {
+    if(!g_content_type_set)
+    {
+      iov[count].iov_base = (void*)OUTPUT_DEFAULT_CONTENT_TYPE;
+      iov[count++].iov_len = sizeof(OUTPUT_DEFAULT_CONTENT_TYPE) - 1;
+    }
+    if(g_headers.len)
+    {
+      iov[count].iov_base = g_headers.data;
+      iov[count++].iov_len = g_headers.len;
+    }
+    iov[count].iov_base = (void*)"\r\n";
+    iov[count++].iov_len = 2;
+    g_streaming = 1;
+  }
+  len = output_body_iov(iov, &count);
+
+  ok = output_send(iov, count);
+  if(!ok)
+    CosaPhpExtLog("output failed to write %zu bytes error:%s\n", len, strerror(errno));
+  free(iov);
+
+  g_flushed_len += g_body_len;
+  g_segment_count = 0;
+  g_text.len = 0;
+  g_body_len = 0;
+
+  if(ok && g_flush_hook)
+    g_flush_hook(g_flush_hook_arg);
+  return ok;
+}
+
+/* flush(). writes what there is of the response so far */
+static duk_ret_t output_flush(duk_context *ctx)
+{
+  if(!output_stream())
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+/* writes the response and starts over.
+   the body has always ended with the line feed print() added after it, which is kept */
+static duk_ret_t output_finish(duk_context *ctx)
+{
+  static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  unsigned char gzip_trailer[8];
+  char length[64];
+  char etag[64];
+  output_piece* pieces = NULL;
+  struct iovec* iov = NULL;
+  size_t body_len;
+  uint32_t crc = 0;
+  int compressible;
+  int gzipped;
+  int tagged;
+  int not_modified = 0;
+  int piece_count = -1;
+  int count = 0;
+  int ok = 0;
+  int i;
+  int n;
+
+  if(!output_text("\n", 1))
+    goto done;
+
+  /* the rest of a response which was flushed before */
+  if(g_streaming)
+  {
+    ok = output_stream();
+    goto done;
+  }
+
+  iov = (struct iovec*)malloc((g_segment_count + 9) * sizeof(struct iovec));
+  if(!iov)
+  {
+    CosaPhpExtLog("output failed to alloc %d iovecs\n", g_segment_count + 9);
+    goto done;
+  }
+
+  compressible = output_compressible();
+  gzipped = compressible && output_gzip_accepted();
+  tagged = output_etag_allowed();
+  if(tagged || gzipped)
+    crc = output_crc();
+  if(tagged)
+  {
+    output_etag(etag, sizeof(etag), crc, g_body_len, gzipped);
+    not_modified = output_not_modified(etag);
+  }
+
+  /* no need to deflate what the client has already */
+  if(gzipped && !not_modified)
+  {
+    pieces = (output_piece*)malloc((g_segment_count + 1) * sizeof(output_piece));
+    if(pieces)
+      piece_count = output_deflate(pieces);
+    if(piece_count < 0)
+    {
+      CosaPhpExtLog("output failed to deflate %zu bytes, sent as is\n", g_body_len);
+      if(tagged)
+        output_etag(etag, sizeof(etag), crc, g_body_len, 0);
+    }
+  }
+
+  if(not_modified)
+  {
+    iov[count].iov_base = (void*)OUTPUT_NOT_MODIFIED_STATUS;
+    iov[count++].iov_len = sizeof(OUTPUT_NOT_MODIFIED_STATUS) - 1;
+  }
+  else if(!g_content_type_set)
+  {
+    iov[count].iov_base = (void*)OUTPUT_DEFAULT_CONTENT_TYPE;
+    iov[count++].iov_len = sizeof(OUTPUT_DEFAULT_CONTENT_TYPE) - 1;
+  }
+  if(g_headers.len)
+  {
+    iov[count].iov_base = g_headers.data;
+    iov[count++].iov_len = g_headers.len;
+  }
+  if(compressible)
+  {
+    iov[count].iov_base = (void*)OUTPUT_VARY_HEADER;
+    iov[count++].iov_len = sizeof(OUTPUT_VARY_HEADER) - 1;
+  }
+  if(tagged)
+  {
+    iov[count].iov_base = etag;
+    iov[count++].iov_len = strlen(etag);
+  }
+  if(not_modified)
+  {
+    iov[count].iov_base = (void*)"\r\n";
+    iov[count++].iov_len = 2;
+    body_len = 0;
+    goto send;
+  }
+  if(piece_count >= 0)
+  {
+    iov[count].iov_base = (void*)OUTPUT_GZIP_HEADERS;
+    iov[count++].iov_len = sizeof(OUTPUT_GZIP_HEADERS) - 1;
+  }
+  i = count++;  /* Content-Length */
+
+  if(piece_count >= 0)
+  {
+    iov[count].iov_base = (void*)gzip_header;
+    iov[count++].iov_len = sizeof(gzip_header);
+    body_len = sizeof(gzip_header) + sizeof(gzip_trailer);
+    for(n = 0; n < piece_count; ++n)
+    {
+      iov[count].iov_base = (void*)(pieces[n].data ? pieces[n].data : g_gzip.data + pieces[n].offset);
+      iov[count++].iov_len = pieces[n].len;
+      body_len += pieces[n].len;
+    }
+    put_le32(gzip_trailer, crc);
+    put_le32(gzip_trailer + 4, (uint32_t)g_body_len);
+    iov[count].iov_base = gzip_trailer;
+    iov[count++].iov_len = sizeof(gzip_trailer);
+  }
+  else
+    body_len = output_body_iov(iov, &count);
+
+  iov[i].iov_base = length;
+  iov[i].iov_len = snprintf(length, sizeof(length), "Content-Length: %zu\r\n\r\n", body_len);
+
+send:
+  ok = output_send(iov, count);
+  if(!ok)
+    CosaPhpExtLog("output failed to write %zu bytes error:%s\n", body_len, strerror(errno));
+
+done:
+  free(pieces);
+  free(iov);
+  ccsp_output_reset();
+  if(!ok)
+    RETURN_FALSE;
+  RETURN_TRUE;
+}
+
+static const duk_function_list_entry ccsp_output_funcs[] = {
+  { "echo", output_echo, 1 },
+  { "header", output_header, 1 },
+  { "finish", output_finish, 0 },
+  { "flush", output_flush, 0 },
+  { "loadFragment", output_load_fragment, 1 },
+  { "bodyLength", output_body_length, 0 },
+  { "storeFragment", output_store_fragment, 3 },
+  { NULL, NULL, 0 }
+};
+
+static const duk_function_list_entry ccsp_output_globals[] = {
+  { "__jst_static", output_static, 1 },
+  { NULL, NULL, 0 }
+};
+
+/* also defines the global __jst_static which the code of templates calls */
+duk_ret_t ccsp_output_module_open(duk_context *ctx)
+{
+  duk_push_global_object(ctx);
+  put_function_list(ctx, -1, ccsp_output_globals);
+  duk_pop(ctx);
+
+  duk_push_object(ctx);
+  put_function_list(ctx, -1, ccsp_output_funcs);
+  return 1;
+}
+
+/* drops whatever a previous request left unwritten */
+void ccsp_output_reset(void)
+{
+  buffer_reset(&g_text);
+  buffer_reset(&g_headers);
+  if(g_segment_alloc > OUTPUT_MIN_SIZE / (int)sizeof(output_segment))
+  {
+    free(g_segments);
+    g_segments = NULL;
+    g_segment_alloc = 0;
+  }
+  g_segment_count = 0;
+  g_body_len = 0;
+  g_content_type_set = 0;
+  g_content_type[0] = 0;
+  g_encoding_set = 0;
+  g_etag_allowed = 1;
+  g_streaming = 0;
+  g_flushed_len = 0;
+  buffer_reset(&g_gzip);
+}
+
+/* fn is called after each flush() (and the end of a response which was flushed), once what
+   there was has been written to stdout */
+void ccsp_output_set_flush_hook(output_flush_fn fn, void* arg)
+{
+  g_flush_hook = fn;
+  g_flush_hook_arg = arg;
+}
+
+/* copies the rest of fd from off to out where sendfile can't */
+static int output_copy_file(int out, int fd, off_t off, off_t size)
+{
+  char buf[16 * 1024];
+  struct iovec iov;
+  ssize_t rc;
+
+  while(off < size)
+  {
+    rc = pread(fd, buf, sizeof(buf), off);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return 0;
+    iov.iov_base = buf;
+    iov.iov_len = rc;
+    if(!output_writev(out, &iov, 1))
+      return 0;
+    off += rc;
+  }
+  return 1;
+}
+
+/* sends the template filename as the response running it would give, if it has no code:
+   the default content type, the content and the newline finish() ends with. the content goes
+   from the file to stdout in the kernel and no heap is created at all.
+   the ETag is the one running the page would give, so a client keeps its copy whichever way
+   the page was sent. a page which would be gzip'ed is left to be run, which also uses its
+   blocks deflated ahead of time, as is every page when there is a site bundle */
+int jst_static_page(const char* filename)
+{
+  char headers[256];
+  char etag[64];
+  struct iovec iov;
+  struct stat st;
+  off_t off = 0;
+  ssize_t rc;
+  uint32_t crc;
+  int compressible;
+  int tagged;
+  int not_modified = 0;
+  int ok = 1;
+  int out;
+  int fd;
+
+  /* pages are run from the site bundle without looking at the document root */
+  if(bundle_enabled())
+    return 0;
+
+  tagged = output_etag_allowed();
+  fd = template_content_only(filename, &st, tagged ? &crc : NULL);
+  if(fd < 0)
+    return 0;
+  compressible = st.st_size + 1 >= JST_GZIP_MIN_SIZE;
+  if(compressible && output_gzip_accepted())
+  {
+    close(fd);
+    return 0;
+  }
+
+  jst_timing_begin("static_page", filename);
+  etag[0] = 0;
+  if(tagged)
+  {
+    /* the body is the content and the newline finish() adds */
+    crc = (uint32_t)crc32(crc, (const Bytef*)"\n", 1);
+    output_etag(etag, sizeof(etag), crc, st.st_size + 1, 0);
+    not_modified = output_not_modified(etag);
+  }
+
+  if(not_modified)
+    iov.iov_len = snprintf(headers, sizeof(headers), "%s%s%s\r\n", OUTPUT_NOT_MODIFIED_STATUS,
+                           compressible ? OUTPUT_VARY_HEADER : "", etag);
+  else
+    iov.iov_len = snprintf(headers, sizeof(headers), "%s%s%sContent-Length: %jd\r\n\r\n",
+                           OUTPUT_DEFAULT_CONTENT_TYPE, compressible ? OUTPUT_VARY_HEADER : "", etag,
+                           (intmax_t)st.st_size + 1);
+  iov.iov_base = headers;
+  if(!output_send(&iov, 1))
+    ok = 0;
+
+  out = fileno(stdout);
+  while(ok && !not_modified && off < st.st_size)
+  {
+    rc = sendfile(out, fd, &off, st.st_size - off);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc < 0 && (errno == EINVAL || errno == ENOSYS))
+    {
+      ok = output_copy_file(out, fd, off, st.st_size);
+      break;
+    }
+    if(rc <= 0)
+      ok = 0;
+  }
+  if(ok && !not_modified)
+  {
+    iov.iov_base = (void*)"\n";
+    iov.iov_len = 1;
+    ok = output_writev(out, &iov, 1);
+  }
+  if(!ok)
+    CosaPhpExtLog("output failed to send %s error:%s\n", filename, strerror(errno));
+
+  close(fd);
+  jst_timing_end("static_page");
+  return 1;
+}
@@ -16,13 +16,27 @@
  See the License for the specific language governing permissions and
  limitations under the License.
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <memory.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "jst.h"
 #include "jst_internal.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #define JST_OPEN_TAG "<?%"
 #define JST_OPEN_LEN 3
@@ -30,6 +44,21 @@
 #define JST_CLOSE_LEN 2
 
 #define TMPL_MAX_INC_SZ 256
+#ifndef TEMPL_PATH
+#define TEMPL_PATH "/usr/video_analytics/"
+#endif
+#define TEMPL_PREFIX_FILE TEMPL_PATH "jst_prefix.js"
+#define TEMPL_SUFFIX_FILE TEMPL_PATH "jst_suffix.js"
+#define TEMPL_PHP_FILE TEMPL_PATH "php.jst"
+
+/* jst_prefix.js carries this marker from when the page content went through ccsp_output, so
+   __jst_static(n) blocks are only written with a prefix which sends them */
+#define JST_PRELUDE_MARKER "JST_PRELUDE_VERSION 2"
+
+/* the include path pages use for php.jst, skipped when php.jst is already loaded as part of the prelude */
+#ifndef JST_PHP_INCLUDE
+#define JST_PHP_INCLUDE "includes/php.jst"
+#endif
 #if CHAR_BIT != 8
   #pragma message "This code asssumes 8 bit chars"
 #endif
@@ -40,853 +69,1577 @@
   CosaPhpExtLog(__VA_ARGS__);\
 }
 
-typedef enum template_block_type
-{
-  template_block_code,
-  template_block_string,
-  template_block_content
-}template_block_type;
-
-typedef struct template_block
+typedef enum template_lex_state
 {
-  char* start;
-  size_t len;
-  template_block_type type;
-  int need_free;
-}template_block;
+  template_lex_content,
+  template_lex_code,
+  template_lex_string,
+  template_lex_regexp,
+  template_lex_line_comment,
+  template_lex_block_comment
+}template_lex_state;
 
 typedef struct growing_buffer
 {
   char* data;
   size_t write_len;
   size_t alloc_len;
+  int on_heap;
 }growing_buffer;
 
-#define GB_BLOCK_SIZE 100000
-
-void buffer_init(growing_buffer* buf)
+typedef struct template_lexer
+{
+  growing_buffer* out;
+  template_lex_state state;
+  char quote;           /* quote which ends the current string */
+  int in_class;         /* inside a [...] of the current regexp */
+  char last;            /* last non space code char, tells a regexp from a division */
+  int string_tag;       /* the current tag is a <?%= */
+  size_t tag_mark;      /* write_len of out where the current tag started */
+  int tag_nonspace;     /* the current tag wrote something other than whitespace */
+  const char* code;     /* start of the code of the current tag not yet written */
+  int after_include;    /* 'code' starts right after a static include */
+}template_lexer;
+
+/* growing buffers double as they fill up. they come from the arena (see jst_arena.c) unless
+   on_heap, which is used for the buffer handed back to the caller of load_template_file */
+void buffer_init(growing_buffer* buf, size_t size, int on_heap)
 {
   memset(buf, 0, sizeof(growing_buffer));
-  buf->data = (char*)calloc(GB_BLOCK_SIZE, 1);
+  buf->on_heap = on_heap;
+  buf->data = (char*)(on_heap ? malloc(size + 1) : jst_arena_alloc(size + 1));
   if(!buf->data)
   {
     log_debug_message("failed to alloc buffer data\n");
+    return;
   }
-  buf->alloc_len = GB_BLOCK_SIZE;
-  buf->write_len = 0;
+  buf->data[0] = 0;
+  buf->alloc_len = size + 1;
 }
 
 void buffer_push(growing_buffer* buf, const char* s, size_t len)
 {
   if(buf->alloc_len < buf->write_len + len + 1) /*+ 1 is space for null terminator*/
   {
+    size_t alloc_len = buf->alloc_len * 2;
+    char* rbuf;
+
     if(!buf->data)
       return;
 
-    while(buf->alloc_len < buf->write_len + len + 1)
-    {
-      buf->alloc_len += GB_BLOCK_SIZE;
-    }
+    if(alloc_len < buf->write_len + len + 1)
+      alloc_len = buf->write_len + len + 1;
 
-    char* rbuf = (char*)realloc(buf->data, buf->alloc_len);
-    if(rbuf)
-    {
-      buf->data = rbuf;
-      memset(buf->data + buf->write_len, 0, buf->alloc_len - buf->write_len);
-    }
+    if(buf->on_heap)
+      rbuf = (char*)realloc(buf->data, alloc_len);
     else
+      rbuf = (char*)jst_arena_grow(buf->data, buf->write_len + 1, alloc_len);
+    if(!rbuf)
     {
-      free(buf->data);
+      if(buf->on_heap)
+        free(buf->data);
       memset(buf, 0, sizeof(growing_buffer));/*all future calls to buffer_push will return after the if(!buf->data) check above*/
-      log_debug_message("failed to realloc growing buffer\n");
+      log_debug_message("failed to grow buffer\n");
       return;
     }
+    buf->data = rbuf;
+    buf->alloc_len = alloc_len;
   }
-  strncpy(buf->data + buf->write_len, s, len);
+  memcpy(buf->data + buf->write_len, s, len);
   buf->write_len += len;
+  buf->data[buf->write_len] = 0;
 }
 
-void buffer_free(growing_buffer* buf)
-{
-  if(buf->data)
-    free(buf->data);
-}
-
-
 #define MAX_PATH_LEN 256
-#define MAX_INCLUDE_FILE 16
-static int g_is_cgi = 1;
-static char g_document_root_path[MAX_PATH_LEN] = {0};
-static char g_include_paths[MAX_INCLUDE_FILE][MAX_PATH_LEN] = {{0}};
-static int g_include_paths_count = 0;
-
-static void template_write_block(growing_buffer* bufout, template_block* block);
-static int template_make_include(char** bufcur, size_t* buflen, template_block* block, char* bufstart);
-static int template_make_block(char** bufcur, size_t* buflen, template_block* block);
-static void process_includes(char* buf, size_t buflen, growing_buffer* bufout);
-static void process_jst(char* buf, size_t buflen, growing_buffer* bufout);
-static int template_process(char** buf, size_t* buflen, int top);
 
-static void log_syntax_error(char* err, char* s1, char* cur, char* end)
+typedef struct include_key
 {
-  char ch;
+  dev_t dev;
+  ino_t ino;
+  int used;
+}include_key;
 
+/* the static content blocks of a request, see template_write_static */
+typedef struct static_table
+{
+  const char* data;     /* every block back to back */
+  size_t len;
+  const uint32_t* ends; /* end of each block in data */
+  uint32_t count;
+  char* own_data;       /* data and ends are these unless borrowed from a cache entry or the bundle */
+  size_t own_alloc;
+  uint32_t* own_ends;
+  uint32_t own_ends_alloc;
+  const char* deflated; /* the first deflated_count blocks deflated ahead of time, if borrowed */
+  const uint32_t* deflated_ends;
+  const uint32_t* crcs;
+  uint32_t deflated_count;
+  char* image;          /* cache entry borrowed from, freed with the blocks */
+}static_table;
+
+/* what the page being run has loaded so far, started over by template_begin */
+typedef struct template_request
+{
+  int is_cgi;
+  char document_root[MAX_PATH_LEN];
+  char** paths;         /* every file loaded in load order, the page first */
+  cache_file* files;    /* the state of each of paths just before it was read */
+  int path_count;
+  int path_alloc;
+  include_key* set;     /* open addressing hash set of the files in paths, by device and inode */
+  size_t set_size;      /* a power of 2 */
+  size_t set_count;
+  static_table blocks;
+  int php_prelude_called; /* the include of php.jst has been replaced by ccsp.phpPrelude() */
+}template_request;
+
+#define INCLUDE_SET_MIN_SIZE 32
+
+static template_request g_request;
+#define MAX_PRELOAD_FILE 16
+static char g_preload_paths[MAX_PRELOAD_FILE][MAX_PATH_LEN] = {{0}};
+static int g_preload_paths_count = 0;
+static int g_template_depth = 0;
+static const char* g_prefix = NULL;
+static size_t g_prefix_len = 0;
+static const char* g_suffix = NULL;
+static size_t g_suffix_len = 0;
+static int g_php_prelude = 0;
+static int g_php_prelude_lazy = 0;
+static cache_file g_prelude_files[3]; /* jst_prefix.js, jst_suffix.js and the binary as they were loaded */
+static int g_static_blocks = 0;
+static int g_prelude_outdated = 0;
+static const template_observer* g_observer = NULL;
+
+static int template_read(const char* filepath, int is_jst, char** buf, size_t* buflen, int top);
+
+static void log_syntax_error(const char* err, const char* s1, const char* cur, const char* end)
+{
   while(cur != end && *cur != '\n' && *cur != '\r')
     cur++;
 
-  ch = *cur;
-  *cur = 0;
-  log_debug_message("syntax error. malformed include: %s. line: %s src:%s\n", err, s1, cur);
-  *cur = ch;
+  log_debug_message("syntax error. malformed include: %s. line: %.*s\n", err, (int)(cur - s1), s1);
+}
+
+static void buffer_truncate(growing_buffer* buf, size_t len)
+{
+  if(!buf->data || len >= buf->write_len)
+    return;
+  buf->write_len = len;
+  buf->data[len] = 0;
 }
 
-static void template_write_block(growing_buffer* bufout, template_block* block)
+static int is_whitespace(const char* s, size_t len)
 {
   size_t i;
 
-  /*
-  char tmp = *(block->start + block->len);
-  *(block->start + block->len) = 0;
-  printf("\n------------------------------\ngot block type=%d len=%d content=\n%s\n------------------------------\n", block->type, block->len, block->start);
-  *(block->start + block->len) = tmp;
-  */
+  for(i = 0; i < len; ++i)
+    if(!isspace((unsigned char)s[i]))
+      return 0;
+  return 1;
+}
+
+/* finds the first of the chars a, b, c or d from s, returns end if there is none.
+   compares 32 (AVX2) or 16 (SSE2, NEON) bytes at a time where the cpu has vector instructions
+   and a word at a time otherwise, the tail is done a byte at a time */
+static const char* scan_chars(const char* s, const char* end, char a, char b, char c, char d)
+{
+#if defined(__AVX2__)
+  const __m256i va32 = _mm256_set1_epi8(a);
+  const __m256i vb32 = _mm256_set1_epi8(b);
+  const __m256i vc32 = _mm256_set1_epi8(c);
+  const __m256i vd32 = _mm256_set1_epi8(d);
 
-  /* ignore whitespace only blocks */
-  if(block->len == 0)
+  while(end - s >= 32)
   {
-    //printf("skipping 0 len block\n");
-    return;
+    __m256i v = _mm256_loadu_si256((const __m256i*)s);
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va32), _mm256_cmpeq_epi8(v, vb32)),
+                                _mm256_or_si256(_mm256_cmpeq_epi8(v, vc32), _mm256_cmpeq_epi8(v, vd32)));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if(mask)
+      return s + __builtin_ctz(mask);
+    s += 32;
   }
-  for(i = 0; i < block->len; ++i)
-    if(!isspace(block->start[i]))
-      break;
-  if(i == block->len)
+#endif
+#if defined(__SSE2__)
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+  const __m128i vd = _mm_set1_epi8(d);
+
+  while(end - s >= 16)
   {
-    //printf("skipping block which is all whitespace\n");
-    return;
+    __m128i v = _mm_loadu_si128((const __m128i*)s);
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+    if(mask)
+      return s + __builtin_ctz(mask);
+    s += 16;
   }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  const uint8x16_t va = vdupq_n_u8((uint8_t)a);
+  const uint8x16_t vb = vdupq_n_u8((uint8_t)b);
+  const uint8x16_t vc = vdupq_n_u8((uint8_t)c);
+  const uint8x16_t vd = vdupq_n_u8((uint8_t)d);
 
-  if(block->type == template_block_content)
+  while(end - s >= 16)
   {
-    buffer_push(bufout, "echo('", 6);
+    uint8x16_t v = vld1q_u8((const uint8_t*)s);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)),
+                            vorrq_u8(vceqq_u8(v, vc), vceqq_u8(v, vd)));
+    /* narrow each byte of the compare to a nibble so the mask fits in 64 bits */
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    if(mask)
+      return s + (__builtin_ctzll(mask) >> 2);
+    s += 16;
   }
-  else if(block->type == template_block_string)
+#else
+  const size_t ones = (size_t)-1 / 0xff;
+  const size_t highs = ones << 7;
+  size_t w;
+
+  /* a word has a zero byte iff (w - 0x01..01) & ~w & 0x80..80, the byte loop below finds where */
+#define WORD_HAS_ZERO(x) (((x) - ones) & ~(x) & highs)
+  while((size_t)(end - s) >= sizeof(size_t))
   {
-    buffer_push(bufout, "echo(", 5);
+    memcpy(&w, s, sizeof(w));
+    if(WORD_HAS_ZERO(w ^ (ones * (unsigned char)a)) || WORD_HAS_ZERO(w ^ (ones * (unsigned char)b)) ||
+       WORD_HAS_ZERO(w ^ (ones * (unsigned char)c)) || WORD_HAS_ZERO(w ^ (ones * (unsigned char)d)))
+      break;
+    s += sizeof(size_t);
   }
+#undef WORD_HAS_ZERO
+#endif
+
+  for(; s < end; ++s)
+    if(*s == a || *s == b || *s == c || *s == d)
+      return s;
+  return end;
+}
+
+static int is_open_tag(const char* s, const char* end)
+{
+  return end - s >= JST_OPEN_LEN && !memcmp(s, JST_OPEN_TAG, JST_OPEN_LEN);
+}
+
+/* static content blocks.
+   with template_set_static_blocks on, content isn't written as an echo('...') string but kept
+   as is in a table for the request, with a __jst_static(n) in its place which writes block n
+   to the output from C (see jst_output.c), so duktape never lexes, interns or concatenates
+   the html. blocks are numbered across the page, its includes and any runtime include, which
+   is why the table is stored along with the bytecode of a page in the cache and the bundle */
+
+#define STATIC_TABLE_MIN_SIZE (16 * 1024)
+#define STATIC_IMAGE_ALIGN 8
+#define STATIC_DEFLATE_LEVEL Z_BEST_COMPRESSION
+#define STATIC_DEFLATE_MIN_SIZE 512
+
+static void static_table_reset(void)
+{
+  static_table* t = &g_request.blocks;
+
+  t->data = t->own_data;
+  t->ends = t->own_ends;
+  t->len = 0;
+  t->count = 0;
+  t->deflated_count = 0;
+  free(t->image);
+  t->image = NULL;
+}
+
+/* makes room for len bytes and count blocks, taking a copy of borrowed blocks */
+static int static_table_reserve(size_t len, uint32_t count)
+{
+  static_table* t = &g_request.blocks;
+  int borrowed = t->data != t->own_data;
 
-  if(block->type == template_block_content)
+  if(len > t->own_alloc)
   {
-    for(i = 0; i < block->len; ++i)
-    {
-      /*line feeds: 
-        in order to build a string that is broken by line feeds,
-        and in order to preserve the line feed in the string
-        so that the client gets back the exact content we have in our file,
-        we need to embed an escaped line feed into the string,
-        and we need to end the line with an escaped backslash.
-          example:
-            input : '...foo\n...'
-            output: '...foo\\n\\\n ...'
-      */
-      if(block->start[i] == '\n')
-      {
-        buffer_push(bufout, "\\n\\", 3);
-      }
-      /* single quotes must be escaped because we are putting 
-         content in a single quoted string */
-      else if(block->start[i] == '\'')
-      {
-        buffer_push(bufout, "\\", 1);
-      }
-      /* backslash must be escaped because a single backslash 
-          inside a string is an escape character prefix.
-         This happens if content javascript is escaping something
-        and the jst javascript we send to duk needs to print
-          the content javascript exactly */
-      else if(block->start[i] == '\\')
-      {
-        buffer_push(bufout, "\\", 1);
-      }
-      buffer_push(bufout, &block->start[i], 1);
-    }
+    size_t alloc = t->own_alloc ? t->own_alloc : STATIC_TABLE_MIN_SIZE;
+    char* data;
+
+    while(alloc < len)
+      alloc *= 2;
+    data = (char*)realloc(t->own_data, alloc);
+    if(!data)
+      return 0;
+    t->own_data = data;
+    t->own_alloc = alloc;
   }
-  else
+
+  if(count > t->own_ends_alloc)
   {
-    buffer_push(bufout, block->start, block->len);
+    uint32_t alloc = t->own_ends_alloc ? t->own_ends_alloc : 256;
+    uint32_t* ends;
+
+    while(alloc < count)
+      alloc *= 2;
+    ends = (uint32_t*)realloc(t->own_ends, alloc * sizeof(uint32_t));
+    if(!ends)
+      return 0;
+    t->own_ends = ends;
+    t->own_ends_alloc = alloc;
   }
 
-  if(block->type == template_block_content)
+  if(borrowed)
   {
-    buffer_push(bufout, "');", 3);
+    memcpy(t->own_data, t->data, t->len);
+    memcpy(t->own_ends, t->ends, t->count * sizeof(uint32_t));
   }
-  else if(block->type == template_block_string)
+  t->data = t->own_data;
+  t->ends = t->own_ends;
+  return 1;
+}
+
+/* adds a block and returns its number, or -1 */
+static int static_table_add(const char* s, size_t len)
+{
+  static_table* t = &g_request.blocks;
+
+  if(t->count >= INT32_MAX || len > UINT32_MAX - t->len || !static_table_reserve(t->len + len, t->count + 1))
+    return -1;
+  memcpy(t->own_data + t->len, s, len);
+  t->len += len;
+  t->own_ends[t->count] = t->len;
+  return (int)t->count++;
+}
+
+/* as stored ahead of the bytecode:
+     count | data length | deflated length | 0 | ends | deflated ends | crcs | data | deflated | padding
+   each block is deflated on its own, as raw deflate ending on a byte boundary, so the deflated
+   blocks can be put together with other deflated data into one stream (see jst_output.c).
+   blocks too short to be worth a flush of their own are left out (deflated as empty) */
+#define STATIC_IMAGE_HEADER (4 * sizeof(uint32_t))
+
+static size_t static_image_size(uint32_t count, size_t len, size_t deflated_len)
+{
+  size_t size = STATIC_IMAGE_HEADER + 3 * (size_t)count * sizeof(uint32_t) + len + deflated_len;
+  return (size + STATIC_IMAGE_ALIGN - 1) & ~(size_t)(STATIC_IMAGE_ALIGN - 1);
+}
+
+/* borrows the blocks stored at buf and returns the size they take up, or 0 if buf doesn't
+   start with valid blocks. buf must stay put for the whole request */
+static size_t static_table_restore(const char* buf, size_t len)
+{
+  static_table* t = &g_request.blocks;
+  const uint32_t* ends;
+  const uint32_t* deflated_ends;
+  uint32_t hdr[4];
+  uint32_t i;
+
+  static_table_reset();
+
+  if(len < STATIC_IMAGE_HEADER)
+    return 0;
+  memcpy(hdr, buf, sizeof(hdr));
+  if(hdr[0] > len / (3 * sizeof(uint32_t)) || hdr[1] > len || hdr[2] > len ||
+     static_image_size(hdr[0], hdr[1], hdr[2]) > len)
+    return 0;
+
+  ends = (const uint32_t*)(buf + STATIC_IMAGE_HEADER);
+  deflated_ends = ends + hdr[0];
+  for(i = 0; i < hdr[0]; ++i)
   {
-    buffer_push(bufout, ");", 2);
+    if(ends[i] > hdr[1] || (i && ends[i] < ends[i - 1]) ||
+       deflated_ends[i] > hdr[2] || (i && deflated_ends[i] < deflated_ends[i - 1]))
+      return 0;
   }
+
+  t->ends = ends;
+  t->count = hdr[0];
+  t->data = (const char*)(ends + 3 * hdr[0]);
+  t->len = hdr[1];
+  t->deflated_ends = deflated_ends;
+  t->crcs = deflated_ends + hdr[0];
+  t->deflated = t->data + t->len;
+  t->deflated_count = hdr[0];
+  return static_image_size(hdr[0], hdr[1], hdr[2]);
 }
 
-static int template_make_include(char** bufcur, size_t* buflen, template_block* block, char* bufstart)
+/* the blocks of the request, deflated as well, followed by code (compiled from the page) in
+   one malloc'ed buffer */
+int template_static_image(const char* code, size_t code_len, char** bufout, size_t* lenout)
 {
-  char* buff;
-  char* s1;
-  char* cur;
-  char* end;
-  int valid;
-  int quotes;
-  int i;
-  char include_path[TMPL_MAX_INC_SZ];
-  size_t ilen;
+  static_table* t = &g_request.blocks;
+  z_stream z;
+  uint32_t* info = NULL;
+  char* deflated = NULL;
+  size_t deflated_len = 0;
+  size_t deflated_alloc = 0;
+  size_t size;
+  uint32_t hdr[4];
+  uint32_t i;
+  char* buf = NULL;
+  char* p;
 
-  buff = *bufcur;
-  end = buff + *buflen;
-
-  s1 = buff;
+  *bufout = NULL;
+  *lenout = 0;
 
-  block->need_free = 0;
+  memset(&z, 0, sizeof(z));
+  if(deflateInit2(&z, STATIC_DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
 
-  for(;;)
+  info = (uint32_t*)malloc((t->count ? t->count : 1) * 2 * sizeof(uint32_t));
+  if(!info)
+    goto done;
+  for(i = 0; i < t->count; ++i)
   {
-    valid = 0;
-    
-    if(s1 >= end || 
-      (s1 = strstr(s1, "include")) == NULL)
+    const char* data;
+    size_t len;
+
+    template_static_block(i, &data, &len);
+    if(len >= STATIC_DEFLATE_MIN_SIZE)
     {
-      block->type = template_block_code;
-      block->start = buff;
-      block->len = *buflen;
-      *bufcur += *buflen;
-      *buflen = 0;
-      return block->len;
+      deflateReset(&z);
+      if(!deflate_append(&z, data, len, Z_FULL_FLUSH, &deflated, &deflated_len, &deflated_alloc) ||
+         deflated_len > UINT32_MAX)
+        goto done;
     }
+    info[i] = (uint32_t)deflated_len;
+    info[t->count + i] = (uint32_t)crc32(0, (const Bytef*)data, len);
+  }
 
-    /*determine if this include is in a js tag 
-      by searching backwards and looking for the open tag*/
+  size = static_image_size(t->count, t->len, deflated_len);
+  buf = (char*)calloc(1, size + code_len);
+  if(!buf)
+    goto done;
+
+  hdr[0] = t->count;
+  hdr[1] = (uint32_t)t->len;
+  hdr[2] = (uint32_t)deflated_len;
+  hdr[3] = 0;
+  p = buf;
+  memcpy(p, hdr, sizeof(hdr));
+  p += sizeof(hdr);
+  memcpy(p, t->ends, t->count * sizeof(uint32_t));
+  p += t->count * sizeof(uint32_t);
+  memcpy(p, info, t->count * 2 * sizeof(uint32_t));
+  p += t->count * 2 * sizeof(uint32_t);
+  memcpy(p, t->data, t->len);
+  p += t->len;
+  if(deflated_len)
+    memcpy(p, deflated, deflated_len);
+  if(code_len)
+    memcpy(buf + size, code, code_len);
 
-    if(s1 - bufstart < JST_OPEN_LEN)
-    {
-      /*too close to start of file to have an open tag
-        but its possible this is some kind of html so continue*/
-      break;
-    }
-    else
-    {
-      cur = s1 - JST_OPEN_LEN;
+  *bufout = buf;
+  *lenout = size + code_len;
 
-      for(;;)
-      {
-        if(!strncmp(cur, JST_OPEN_TAG, JST_OPEN_LEN))
-        {
-          /*we found the open tag which mean we are inside a tag*/
-          valid = 1;
-          break;
-        }
-        else if(!strncmp(cur, JST_CLOSE_TAG, JST_CLOSE_LEN))
-        {
-          /*we found a close tag which means we aren't in a tag */
-          break;
-        }
-        if(cur == bufstart)
-        {
-          /*if we hit the start of the file thus we aren't in a tag*/
-          break;
-        } 
-        cur--;
-      }
-    }
+done:
+  deflateEnd(&z);
+  free(deflated);
+  free(info);
+  return *bufout != NULL;
+}
 
-    ilen = strlen("include");
+int template_static_block(uint32_t n, const char** dataout, size_t* lenout)
+{
+  static_table* t = &g_request.blocks;
+  uint32_t start;
 
-    if(!valid)
-    {
-      /* this include wasn't inside a js tag, so skip and search for next*/
-      s1 += ilen;
-      continue; 
-    }
+  if(n >= t->count)
+    return 0;
+  start = n ? t->ends[n - 1] : 0;
+  *dataout = t->data + start;
+  *lenout = t->ends[n] - start;
+  return 1;
+}
+
+/* block n as deflated ahead of time and the crc32 of the block, if it was */
+int template_static_deflated(uint32_t n, const char** dataout, size_t* lenout, uint32_t* crcout)
+{
+  static_table* t = &g_request.blocks;
+  uint32_t start;
+
+  if(n >= t->deflated_count)
+    return 0;
+  start = n ? t->deflated_ends[n - 1] : 0;
+  if(t->deflated_ends[n] == start)
+    return 0;
+  *dataout = t->deflated + start;
+  *lenout = t->deflated_ends[n] - start;
+  *crcout = t->crcs[n];
+  return 1;
+}
+
+void template_set_static_blocks(int on)
+{
+  g_static_blocks = on;
+}
+
+/* writes the content from s to p (the next tag) as a __jst_static(n); followed by the line feeds
+   of the content, so the line numbers of the code still match the template.
+   returns 0 if the block could not be added */
+static int template_write_static(growing_buffer* out, const char* s, const char* p)
+{
+  char call[32];
+  int n;
+
+  n = static_table_add(s, p - s);
+  if(n < 0)
+    return 0;
+
+  buffer_push(out, call, snprintf(call, sizeof(call), "__jst_static(%d);", n));
+  while((s = (const char*)memchr(s, '\n', p - s)) != NULL)
+  {
+    buffer_push(out, "\n", 1);
+    s++;
+  }
+  return 1;
+}
+
+#if defined(JST_MINIFY_HTML)
+/* html minification of content, built with JST_MINIFY_HTML.
+   runs of spaces and tabs become one space, or nothing next to a line feed, and comments are
+   dropped, all but line feeds, which are kept so the code of a template keeps its line numbers.
+   conditional comments, quoted attribute values and the content of pre, textarea, script and
+   style are left as they are. content is minified a block at a time and an element or a tag can
+   go on past a block (e.g. <a href="<?%= url ?>">), so where the last block ended is kept */
 
-    /*we have an include that's inside a js tag
-      now check that its not commented out 
-      by searching backwards for comment tags*/
+typedef struct minify_state
+{
+  const char* raw;  /* name of the pre, textarea, script or style element we're in */
+  int in_tag;
+  char quote;       /* of the attribute value we're in */
+}minify_state;
+
+static const char* const g_minify_raw_elements[] = { "pre", "textarea", "script", "style", NULL };
+static minify_state g_minify;
+
+static int minify_is_name(const char* s, const char* end, const char* name)
+{
+  size_t len = strlen(name);
 
+  if((size_t)(end - s) <= len || strncasecmp(s, name, len) != 0)
+    return 0;
+  return isspace((unsigned char)s[len]) || s[len] == '>' || s[len] == '/';
+}
+
+/* minifies s to end into out (which is as long), returns the length written */
+static size_t template_minify(const char* s, const char* end, char* out)
+{
+  char* o = out;
+  const char* p;
+  int i;
 
-    /* check if this include is in a single line comment */
-    cur = s1-2;
-    for(;;)
+  while(s < end)
+  {
+    /* raw up to and including the end tag */
+    if(g_minify.raw)
     {
-      if(cur[0] == '/' && cur[1] == '/')
-      {
-        /* found the // on the same line so its commented out*/
-        valid = 0;
-        break;
-      }
-      else if(cur[0] == '\n' || cur[1] == '\n')
-      {
-        /* we are on the previous line now so we are good */
-        break;
-      }
-      else if(cur == bufstart)
+      for(p = s; p < end; ++p)
+        if(*p == '<' && p + 1 < end && p[1] == '/' && minify_is_name(p + 2, end, g_minify.raw))
+          break;
+      if(p == end)
       {
-        /* we have reach the start of the file so we are good */
+        memcpy(o, s, end - s);
+        o += end - s;
         break;
       }
-      cur--;
+      memcpy(o, s, p - s);
+      o += p - s;
+      s = p;
+      g_minify.raw = NULL;
     }
 
-    if(!valid)
+    if(g_minify.quote)
     {
-      /* this include was commented out so search for the next */
-      s1 += ilen;
+      p = (const char*)memchr(s, g_minify.quote, end - s);
+      p = p ? p + 1 : end;
+      memcpy(o, s, p - s);
+      o += p - s;
+      s = p;
+      if(p[-1] == g_minify.quote)
+        g_minify.quote = 0;
       continue;
     }
 
-    /* check if this include is in a block comment */
-    cur = s1-2;
-    for(;;)
+    if(*s == '<' && !g_minify.in_tag)
     {
-      if(cur[0] == '/' && cur[1] == '*')
-      {
-        /*we found the start of a comment thus we are in a comment*/
-        valid = 0;
-        break;
-      }
-      else if(cur[0] == '*' && cur[1] == '/')
+      /* a comment, unless conditional or <!--> */
+      if(end - s > 5 && memcmp(s, "<!--", 4) == 0 && s[4] != '[' && s[4] != '>' && memcmp(s + 4, "->", 2) != 0)
       {
-        /*we found the end of a comment thus we are not in a comment*/
-        break;
+        p = (const char*)memmem(s + 4, end - s - 4, "-->", 3);
+        if(p)
+        {
+          for(; s < p; ++s)
+            if(*s == '\n')
+              *o++ = '\n';
+          s = p + 3;
+          continue;
+        }
       }
-      else if(cur == bufstart)
+      if(s + 1 < end && (isalpha((unsigned char)s[1]) || s[1] == '/'))
       {
-        break;
+        g_minify.in_tag = 1;
+        for(i = 0; s[1] != '/' && g_minify_raw_elements[i]; ++i)
+          if(minify_is_name(s + 1, end, g_minify_raw_elements[i]))
+            g_minify.raw = g_minify_raw_elements[i];
       }
-      cur--;
+      *o++ = *s++;
+      continue;
     }
 
-    if(!valid)
+    if(g_minify.in_tag && (*s == '"' || *s == '\''))
     {
-      /* this include was commented out so search for the next */
-      s1 += ilen;
+      g_minify.quote = *s;
+      *o++ = *s++;
       continue;
     }
+    if(g_minify.in_tag && *s == '>')
+      g_minify.in_tag = 0;
 
-    /* The only valid chars in front should be whitespace or semicolon */  
-    /* FIXME - i'm not sure this captures every possible syntax correctly */
-    cur = s1;
-    cur--;
-    if(*cur != ' ' && *cur != '\t' && *cur != ';' && *cur != '\n')
+    if(*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n' || *s == '\f')
     {
-      /* this could be a variable or another function */
-      s1 += ilen;
+      int lf = 0;
+
+      for(p = s; p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == '\f'); ++p)
+        if(*p == '\n')
+          *o++ = '\n', lf = 1;
+      if(!lf && (o == out || (o[-1] != ' ' && o[-1] != '\n')))
+        *o++ = ' ';
+      s = p;
       continue;
     }
+    *o++ = *s++;
+  }
+  return o - out;
+}
+#endif
 
-    /*search ahead for ( */
-    cur = s1+7;
-    for(;;)
-    {
-      if(cur >= end)
-      {
-        /*reached end of file*/
-        valid = 0;
-        break;
-      }
-      if(*cur == '(')
-      {
-        break;
-      }
-      if(*cur != ' ')/*only a space is allowed*/
-      {
-        /*this could be a function which starts with include, like includeFoo()*/
-        valid = 0;
-        break;
-      }
-      cur++;
-    }
+/* writes the content from s up to the next tag as an echo('...'); and returns where it ended */
+static const char* template_write_content(growing_buffer* out, const char* s, const char* end)
+{
+  const char* p;
+  const char* tag;
+#if defined(JST_MINIFY_HTML)
+  char* minified;
+#endif
 
-    if(!valid)
-    {
-      s1 += ilen;
-      continue;
-    }
-    cur++;
+  /* ignore whitespace only blocks */
+  for(p = s; p < end && isspace((unsigned char)*p); ++p)
+    ;
+  if(p == end || is_open_tag(p, end))
+    return p;
+
+  tag = (const char*)memmem(p, end - p, JST_OPEN_TAG, JST_OPEN_LEN);
+  if(!tag)
+    tag = end;
+  end = tag;
+
+#if defined(JST_MINIFY_HTML)
+  minified = (char*)jst_arena_alloc(tag - s + 1);
+  if(minified)
+  {
+    end = minified + template_minify(s, tag, minified);
+    s = minified;
+  }
+#endif
 
-    /* at this point we know its ' include(' */
+  if(g_static_blocks && !g_prelude_outdated)
+  {
+    if(template_write_static(out, s, end))
+      return tag;
+    log_debug_message("failed to add static block\n");
+  }
 
-    /*if there is stuff before the include that hasn't been written
-      send it back to get written */
-    if(s1 != buff)
+  buffer_push(out, "echo('", 6);
+  for(;;)
+  {
+    /* the % of a <?% is rarer in html than the < */
+    p = scan_chars(s, end, '\n', '\'', '\\', '%');
+    if(p == end)
     {
-      block->type = template_block_code;
-      block->start = buff;
-      block->len = s1 - buff;
-      *bufcur = s1;
-      *buflen -= block->len;
-      return block->len;
+      buffer_push(out, s, p - s);
+      break;
     }
-
-    /* now look for syntax errors that should kill the load 
-       for anything not valid, log a syntax error and return 0 */
-
-    /* search ahead for single or double quote */
-    for(;;)
+    if(*p == '%')
     {
-      if(cur >= end)
+      if(p - s >= 2 && p[-2] == '<' && p[-1] == '?')
       {
-        /*reached end of file*/
-        valid = 0;
+        p -= 2;
+        buffer_push(out, s, p - s);
         break;
       }
-      if(*cur == '\'')
-      {
-        quotes = 1;
-        break;
-      }
-      else if(*cur == '\"')
-      {
-        quotes = 2;
-        break;
-      }
-
-      /*if anything other then a space exist before the quote, then it could be a variable,
-        in which case we let the 'include' function (in jst_functions.c) to process it at runtime*/
-      if(*cur != ' ')
-      {
-        log_debug_message("runtime include statement found\n");
-        valid = 0;
-        break;
-      }
-
-      cur++;
-    }
-
-    if(!valid)
-    {
-      s1 += ilen;
+      p++;
+      buffer_push(out, s, p - s);
+      s = p;
       continue;
     }
+    buffer_push(out, s, p - s);
+
+    /*line feeds: 
+      in order to build a string that is broken by line feeds,
+      and in order to preserve the line feed in the string
+      so that the client gets back the exact content we have in our file,
+      we need to embed an escaped line feed into the string,
+      and we need to end the line with an escaped backslash.
+        example:
+          input : '...foo\n...'
+          output: '...foo\\n\\\n ...'
+    */
+    if(*p == '\n')
+      buffer_push(out, "\\n\\\n", 4);
+    /* single quotes must be escaped because we are putting 
+       content in a single quoted string */
+    else if(*p == '\'')
+      buffer_push(out, "\\'", 2);
+    /* backslash must be escaped because a single backslash 
+        inside a string is an escape character prefix.
+       This happens if content javascript is escaping something
+      and the jst javascript we send to duk needs to print
+        the content javascript exactly */
+    else
+      buffer_push(out, "\\\\", 2);
+    s = p + 1;
+  }
+  buffer_push(out, "');", 3);
+  return tag;
+}
 
-    cur++;
-
-    /* now copy the include path characters while searching for the end quote */
-    i = 0; 
-    for(;;)
-    {
-      if(cur >= end)
-      {
-        log_syntax_error("include path at eof", s1, cur, end);
-        valid = 0;
-        break;
-      }
-
-      if((quotes == 1 && *cur == '\'') || 
-         (quotes == 2 && *cur == '\"'))
-      {
-        break;
-      }
+static void template_write_code(template_lexer* lex, const char* s, size_t len)
+{
+  if(!lex->tag_nonspace && !is_whitespace(s, len))
+    lex->tag_nonspace = 1;
+  buffer_push(lex->out, s, len);
+}
 
-      if(i == TMPL_MAX_INC_SZ)
-      {
-        log_syntax_error("include path too long", s1, cur, end);
-        valid = 0;
-        break;
-      }
+/* p is just past the <?% */
+static const char* template_open_tag(template_lexer* lex, const char* p, const char* end)
+{
+  lex->string_tag = p < end && *p == '=';
+  if(lex->string_tag)
+    p++;
+
+  lex->state = template_lex_code;
+  lex->tag_mark = lex->out->write_len;
+  lex->tag_nonspace = 0;
+  lex->last = 0;
+  lex->code = p;
+  lex->after_include = 0;
+
+  if(lex->string_tag)
+    buffer_push(lex->out, "echo(", 5);
+  return p;
+}
 
-      if((quotes == 1 && *cur == '\"') || 
-         (quotes == 2 && *cur == '\''))
-      {
-        log_syntax_error("include quotes missmatch", s1, cur, end);
-        valid = 0;
-        break;
-      }
+/* p is at the ?> */
+static void template_close_tag(template_lexer* lex, const char* p)
+{
+  template_write_code(lex, lex->code, p - lex->code);
 
-      include_path[i++] = *(cur++);
-    }
+  /* a tag with nothing but whitespace in it writes nothing */
+  if(!lex->tag_nonspace)
+    buffer_truncate(lex->out, lex->tag_mark);
+  else if(lex->string_tag)
+    buffer_push(lex->out, ");", 2);
 
-    if(!valid)
-    {
-      s1 += ilen;
-      continue;
-    }
+  lex->state = template_lex_content;
+}
 
-    cur++;
+/* checks for a static include at s (the 'include' of an include("path"); in a tag) and parses it.
+   returns 1 with the path in path and pnext just past the statement (or at the ?> ending it).
+   returns -1 for an include( which isn't static, e.g. with a variable as its argument, which is
+   left to the include function (in jst_functions.c) to process at runtime, and 0 for anything
+   which isn't an include( at all */
+static int template_parse_include(const char* s, const char* end, char* path, const char** pnext)
+{
+  const char* cur;
+  char quote;
+  int i;
 
-    /* nul terminate the path */
-    include_path[i] = 0;
+  /* The only valid chars in front should be whitespace or semicolon */  
+  if(s[-1] != ' ' && s[-1] != '\t' && s[-1] != ';' && s[-1] != '\n')
+    return 0;
 
-    /* check for closing ) */
-    for(;;)
-    {
-      if(cur >= end)
-      {
-        log_syntax_error("include path at eof", s1, cur, end);
-        valid = 0;
-        break;
-      }
+  if(end - s < 7 || strncmp(s, "include", 7))
+    return 0;
 
-      if(*cur == ')')
-      {
-        break;
-      }
+  /*search ahead for (, only a space is allowed before it
+    so this isn't a function which starts with include, like includeFoo()*/
+  for(cur = s + 7; cur < end && *cur == ' '; ++cur)
+    ;
+  if(cur >= end || *cur != '(')
+    return 0;
 
-      if(*cur != ' ')
-      {
-        log_syntax_error("invalid character in include", s1, cur, end);
-        valid = 0;
-        break;
-      }
-      cur++;
-    }
+  /* search ahead for single or double quote */
+  for(++cur; cur < end && *cur == ' '; ++cur)
+    ;
+  if(cur >= end)
+    return -1;
+  if(*cur != '\'' && *cur != '\"')
+  {
+    log_debug_message("runtime include statement found\n");
+    return -1;
+  }
+  quote = *cur++;
 
-    if(!valid)
+  /* now copy the include path characters while searching for the end quote */
+  for(i = 0; ; ++i, ++cur)
+  {
+    if(cur >= end)
     {
-      s1 += ilen;
-      continue;
+      log_syntax_error("include path at eof", s, cur, end);
+      return -1;
     }
-
-    cur++;
-
-
-    /* check for the ending ; or ?>*/
-    for(;;)
+    if(*cur == quote)
+      break;
+    if(i == TMPL_MAX_INC_SZ)
     {
-      if(cur >= end)
-      {
-        log_syntax_error("include path at eof", s1, cur, end);
-        valid = 0;
-        break;
-      }
-
-      if(*cur == ';')
-      {
-        break;
-      }
-
-      if(strncmp(cur, "?>", 2) == 0)
-      {
-        cur--;/*back out so that template tag stays*/
-        break;
-      }
-
-      if(*cur != ' ')
-      {
-        log_syntax_error("invalid character in include", s1, cur, end);
-        valid = 0;
-        break;
-      }
-      cur++;
+      log_syntax_error("include path too long", s, cur, end);
+      return -1;
     }
-
-    if(!valid)
+    if(*cur == '\'' || *cur == '\"')
     {
-      s1 += ilen;
-      continue;
+      log_syntax_error("include quotes missmatch", s, cur, end);
+      return -1;
     }
+    path[i] = *cur;
+  }
+  path[i] = 0;
 
-    cur++;
+  /* check for closing ) */
+  for(++cur; cur < end && *cur == ' '; ++cur)
+    ;
+  if(cur >= end)
+  {
+    log_syntax_error("include path at eof", s, cur, end);
+    return -1;
+  }
+  if(*cur != ')')
+  {
+    log_syntax_error("invalid character in include", s, cur, end);
+    return -1;
+  }
 
-    /* the include was parsed successfully
-       now load the file path recursively */
-    if(load_template_file(include_path, &block->start, &block->len, 0))
-    {
-//TODO - does the data alloced for block->start ever get freed ????
-      //printf("=============================\ninclude file contents:\n%s\n=============================\n", block->start);
-      block->type = template_block_code;
-      block->need_free = 1;
-      *bufcur = cur;
-      *buflen -= cur - buff;
-      return block->len;
-    }
-    else
-    {
-      /*if include had previously been included once*/
-      block->type = template_block_code;
-      *bufcur = cur;
-      *buflen -= cur - buff;
-      return 1;
-    }
+  /* check for the ending ; or ?>*/
+  for(++cur; cur < end && *cur == ' '; ++cur)
+    ;
+  if(cur >= end)
+  {
+    log_syntax_error("include path at eof", s, cur, end);
+    return -1;
+  }
+  if(*cur == ';')
+  {
+    cur++;
+  }
+  else if(cur + 1 >= end || strncmp(cur, JST_CLOSE_TAG, JST_CLOSE_LEN))
+  {
+    log_syntax_error("invalid character in include", s, cur, end);
+    return -1;
   }
 
-  return 0;
+  *pnext = cur;
+  return 1;
 }
 
-static int template_make_block(char** bufcur, size_t* buflen, template_block* block)
+/* whitespace between a static include and the next include( is dropped */
+static void template_drop_include_space(template_lexer* lex, const char* s)
 {
-  char* buff;
-  char* s1;
-  char* s2;
-  template_block_type type;
+  if(lex->after_include && is_whitespace(lex->code, s - lex->code))
+    lex->code = s;
+  lex->after_include = 0;
+}
 
-  buff = *bufcur;
+/* replaces the include statement from s to next with the code of the included file */
+static void template_include(template_lexer* lex, const char* s, const char* next, const char* path)
+{
+  char* inc = NULL;
+  size_t inclen = 0;
 
-  s1 = strstr(buff, JST_OPEN_TAG);
+  template_drop_include_space(lex, s);
+  template_write_code(lex, lex->code, s - lex->code);
 
-  if(s1)
+  /* load the file recursively, nothing is written if it had previously been included once */
+  if(load_template_file(path, &inc, &inclen, 0))
   {
-    if(s1 != buff)
+    if(!is_whitespace(inc, inclen))
+      template_write_code(lex, inc, inclen);
+  }
+
+  lex->code = next;
+  lex->after_include = 1;
+  lex->last = ';';
+}
+
+/* a regexp literal rather than a division can follow these */
+#define REGEXP_PRECEDERS "(,=:[!&|?{};+-*%<>~^"
+
+/* one forward pass over the template writing the final js code to out:
+   content is echoed, tag code is copied as is and static includes are replaced by the
+   (already processed) code of the included file.
+   tags are found textually, i.e. a ?> ends a tag even within a js string or comment,
+   the string, regexp and comment states of the code only decide whether an include is code */
+static void template_lex(const char* buf, size_t buflen, growing_buffer* out)
+{
+  template_lexer lex;
+  char path[TMPL_MAX_INC_SZ + 1];
+  const char* p = buf;
+  const char* end = buf + buflen;
+  const char* next;
+  int rc;
+
+  memset(&lex, 0, sizeof(lex));
+  lex.out = out;
+  lex.state = template_lex_content;
+
+  while(p < end)
+  {
+    if(lex.state == template_lex_content)
     {
-      block->type = template_block_content;
-      block->start = buff;
-      block->len = s1 - buff;
-      *bufcur = s1;
-      *buflen -= block->len;
-      return block->len;
+      p = template_write_content(out, p, end);
+      if(p < end)
+        p = template_open_tag(&lex, p + JST_OPEN_LEN, end);
+      continue;
     }
-    else
+
+    /* skip to the next char which can end a string or comment */
+    if(lex.state == template_lex_string)
+      p = scan_chars(p, end, lex.quote, '\\', '\n', '?');
+    else if(lex.state == template_lex_line_comment)
+      p = scan_chars(p, end, '\n', '?', '\n', '?');
+    else if(lex.state == template_lex_block_comment)
+      p = scan_chars(p, end, '*', '?', '*', '?');
+    if(p == end)
+      break;
+
+    if(*p == '?' && p + 1 < end && p[1] == '>')
     {
-      if(s1[JST_OPEN_LEN] == '=')
+      template_close_tag(&lex, p);
+      p += JST_CLOSE_LEN;
+      continue;
+    }
+
+    switch(lex.state)
+    {
+    case template_lex_code:
+      if(*p == '\'' || *p == '\"' || *p == '`')
       {
-        s1 += JST_OPEN_LEN+1;
-        type = template_block_string;
+        lex.state = template_lex_string;
+        lex.quote = *p;
       }
-      else
+      else if(*p == '/' && p + 1 < end && p[1] == '/')
       {
-        s1 += JST_OPEN_LEN;
-        type = template_block_code;
+        lex.state = template_lex_line_comment;
+        p++;
       }
+      else if(*p == '/' && p + 1 < end && p[1] == '*')
+      {
+        lex.state = template_lex_block_comment;
+        p++;
+      }
+      else if(*p == '/' && (!lex.last || strchr(REGEXP_PRECEDERS, lex.last)))
+      {
+        lex.state = template_lex_regexp;
+        lex.in_class = 0;
+      }
+#ifndef NO_PROCESS_INCLUDES
+      else if(*p == 'i' && (rc = template_parse_include(p, end, path, &next)) != 0)
+      {
+        if(rc > 0)
+        {
+          template_include(&lex, p, next, path);
+          p = next;
+          continue;
+        }
+        if(g_observer)
+          g_observer->runtime_include(p, end, g_observer->arg);
+        template_drop_include_space(&lex, p);
+        p += 7;
+        lex.last = 'e';
+        continue;
+      }
+#endif
+      else if(!isspace((unsigned char)*p))
+      {
+        lex.last = *p;
+      }
+      break;
 
-      s2 = strstr(s1, JST_CLOSE_TAG);
-
-      if(s2)
+    case template_lex_string:
+    case template_lex_regexp:
+      if(*p == '\\' && p + 1 < end && p[1] != '?')
       {
-        block->type = type;
-        block->start = s1;
-        block->len = s2-s1;
-        *bufcur = s2+JST_CLOSE_LEN;
-        *buflen -= *bufcur - buff;
-        return block->len;
+        p++;
       }
-      else
+      else if(*p == '\n' && (lex.state == template_lex_regexp || lex.quote != '`'))
       {
-        //error no closing ?> found
-        return 0;
+        /* unterminated */
+        lex.state = template_lex_code;
       }
+      else if(lex.state == template_lex_string)
+      {
+        if(*p == lex.quote)
+        {
+          lex.state = template_lex_code;
+          lex.last = *p;
+        }
+      }
+      else if(*p == '[')
+      {
+        lex.in_class = 1;
+      }
+      else if(*p == ']')
+      {
+        lex.in_class = 0;
+      }
+      else if(*p == '/' && !lex.in_class)
+      {
+        lex.state = template_lex_code;
+        lex.last = *p;
+      }
+      break;
+
+    case template_lex_line_comment:
+      if(*p == '\n')
+        lex.state = template_lex_code;
+      break;
+
+    case template_lex_block_comment:
+      if(*p == '*' && p + 1 < end && p[1] == '/')
+      {
+        lex.state = template_lex_code;
+        p++;
+      }
+      break;
+
+    default:
+      break;
     }
+    p++;
   }
-  else
+
+  if(lex.state != template_lex_content)
   {
-    block->type = template_block_content;
-    block->start = buff;
-    block->len = *buflen;
-    *bufcur += *buflen;
-    *buflen = 0;
-    return block->len;
+    /* no closing ?>, the tag is dropped */
+    log_debug_message("unterminated tag\n");
+    buffer_truncate(out, lex.tag_mark);
   }
-  return 0;
 }
 
-static void process_jst(char* buf, size_t buflen, growing_buffer* tbuf)
+static int template_process(const char* src, size_t srclen, char** bufout, size_t* lenout, int top)
 {
-  char* bufcur;
-  size_t bufcurlen;
-  template_block block;
+  growing_buffer out;
+  size_t size;
 
-  bufcur = buf;
-  bufcurlen = buflen;
+  *bufout = NULL;
+  *lenout = 0;
 
-  for(;;)
+  if(top && !load_template_prelude())
+    return 0;
+
+  /* room for the template plus some escaping, so the buffer seldom has to grow */
+  size = srclen + srclen / 8 + 64;
+  if(top)
+    size += g_prefix_len + g_suffix_len;
+  buffer_init(&out, size, g_template_depth == 1);
+
+  if(top)
+    buffer_push(&out, g_prefix, g_prefix_len);
+
+  /* as when the source was read into a string, it ends at the first NUL */
+  template_lex(src, strnlen(src, srclen), &out);
+
+  if(top)
+    buffer_push(&out, g_suffix, g_suffix_len);
+
+  if(!out.write_len)
   {
-    if(template_make_block(&bufcur, &bufcurlen, &block))
-    {
-      template_write_block(tbuf, &block);
-    }
-    else
-    {
-      break;
-    }
+    if(out.on_heap)
+      free(out.data);
+    return 0;
   }
+
+  *bufout = out.data;
+  *lenout = out.write_len;
+  return *lenout;
 }
 
-static void process_includes(char* buf, size_t buflen, growing_buffer* tbuf)
+#ifdef JST_EMBEDDED_PRELUDE
+static const jst_embedded_file* find_embedded_file(const char* name)
 {
-  char* bufcur;
-  size_t bufcurlen;
-  template_block block;
+  const jst_embedded_file* f;
 
-  bufcur = buf;
-  bufcurlen = buflen;
+  for(f = jst_embedded_files; f->name; ++f)
+    if(strcmp(f->name, name) == 0)
+      return f;
+  return NULL;
+}
+#endif
 
-  for(;;)
+/* a prelude file on disk in TEMPL_PATH always wins over the copy embedded in the binary.
+   what was there is recorded in file for the bytecode cache */
+static int load_prelude_file(const char* filepath, const char* name, cache_file* file, const char** bufout, size_t* lenout)
+{
+#ifdef JST_EMBEDDED_PRELUDE
+  const jst_embedded_file* f;
+#endif
+
+  cache_file_stat(file, filepath);
+#ifdef JST_EMBEDDED_PRELUDE
+  if(!file->found && (f = find_embedded_file(name)) != NULL)
   {
-    if(template_make_include(&bufcur, &bufcurlen, &block, buf))
-    {
-      template_write_block(tbuf, &block);
-      if(block.need_free)
-        free(block.start);
-    }
-    else
-    {
-      break;
-    }
+    *bufout = (const char*)f->data;
+    *lenout = f->len;
+    return 1;
+  }
+#else
+  (void)name;
+#endif
+
+  /* mapped for the life of the process */
+  if(!map_file(filepath, bufout, lenout))
+  {
+    log_debug_message("failed to open %s\n", filepath);
+    return 0;
   }
+  return 1;
 }
 
-static int template_process(char** buf, size_t* buflen, int top)
+/* jst_prefix.js/jst_suffix.js are loaded once per process and kept for every top level template */
+int load_template_prelude(void)
 {
-  /*make 2 passes 
-    1) process include statements into intermediary jst
-    2) process intermediary jst into final js code
-  */
-  char* prefix;
-  size_t prefix_len;
-  char* suffix;
-  size_t suffix_len;
-  char filepath[MAX_PATH_LEN];
-  growing_buffer tbuf1;
-  growing_buffer tbuf2;
-  char TEMPL_PATH[MAX_PATH_LEN] = "/usr/video_analytics/";
-  buffer_init(&tbuf1);
-  buffer_init(&tbuf2);
-
-#ifdef NO_PROCESS_INCLUDES
-  buffer_push(&tbuf1, *buf, *buflen);
-#else
-  process_includes(*buf, *buflen, &tbuf1);
-#endif
+  if(g_prefix && g_suffix)
+    return 1;
 
-#if 0
-  printf("----------- after processing includes -----------\n");
-  printf("%s\n", tbuf1.data);
-  printf("-------------------------------------------------\n");
-#endif
+  cache_file_stat(&g_prelude_files[2], "/proc/self/exe");
 
-  if(top)
+  if(!g_prefix)
   {
-    snprintf(filepath, MAX_PATH_LEN, "%sjst_prefix.js", TEMPL_PATH);
-    if(!read_file(filepath, &prefix, &prefix_len))
-    {
-      log_debug_message("failed to open %s\n", filepath);
-      buffer_free(&tbuf1);
-      free(*buf);
-      *buf = 0;
-      *buflen = 0;
+    if(!load_prelude_file(TEMPL_PREFIX_FILE, "jst_prefix.js", &g_prelude_files[0], &g_prefix, &g_prefix_len))
       return 0;
-    }
 
-    snprintf(filepath, MAX_PATH_LEN, "%sjst_suffix.js", TEMPL_PATH);
-    if(!read_file(filepath, &suffix, &suffix_len))
+    /* an older prefix only sends what echo() wrote, so the content is written that way */
+    g_prelude_outdated = !memmem(g_prefix, g_prefix_len, JST_PRELUDE_MARKER, sizeof(JST_PRELUDE_MARKER) - 1);
+    if(g_prelude_outdated)
     {
-      log_debug_message("failed to open %s\n", filepath);
-      buffer_free(&tbuf1);
-      free(prefix);
-      free(*buf);
-      *buf = 0;
-      *buflen = 0;
-      return 0;
+      CosaPhpExtLog("%s is older than this jst, page content is written with echo()\n", TEMPL_PREFIX_FILE);
+      fprintf(stderr, "Warning: %s has no %s, page content is written with echo()\n", TEMPL_PREFIX_FILE, JST_PRELUDE_MARKER);
     }
-    
-    buffer_push(&tbuf2, prefix, prefix_len);
   }
-  process_jst(tbuf1.data, tbuf1.write_len, &tbuf2);
 
-  if(top)
-  {
-    buffer_push(&tbuf2, suffix, suffix_len);
-    //buffer_push(&tbuf2, "\0", 1); /*not needed as growing_buffer memsets its buffer to 0*/
+  if(!load_prelude_file(TEMPL_SUFFIX_FILE, "jst_suffix.js", &g_prelude_files[1], &g_suffix, &g_suffix_len))
+    return 0;
 
-    free(prefix);
-    free(suffix);
-  }
+  return 1;
+}
 
-  free(*buf);
-  *buf = tbuf2.data;
-  *buflen = tbuf2.write_len;
+static int template_is_preloaded(const char* filepath)
+{
+  char* path;
+  int i;
+  int found = 0;
 
-  buffer_free(&tbuf1);
+  path = realpath(filepath, NULL);
+  if(!path)
+    return 0;
 
-  /*we pass tbuf2 data back so don't call buffer_free on it*/
-  return *buflen;
+  for(i = 0; i < g_preload_paths_count; ++i)
+  {
+    if(strcmp(g_preload_paths[i], path) == 0)
+    {
+      found = 1;
+      break;
+    }
+  }
+
+  free(path);
+  return found;
 }
 
-int load_template_file(const char *filename, char** bufout, size_t* lenout, int top)
+/* loads a file which will be evaluated once, ahead of any request, into the global object.
+   after this any include of the same file is skipped as if it had already been included */
+int load_template_preload(const char *filename, char** bufout, size_t* lenout)
 {
+  char* path;
   char* buf;
   size_t buflen;
   size_t rc;
   int i;
-  char filepath[MAX_PATH_LEN];
-  const char* pscriptname = filename;
-  log_debug_message("load_template_file filename=%s top=%d\n", filename, top);
 
   *bufout = NULL;
   *lenout = 0;
 
-  if(top)
+  if(g_preload_paths_count == MAX_PRELOAD_FILE)
   {
-    char* pgi;
-
-    /*cleanup any previous passes through here*/
-    g_document_root_path[0] = 0;
-    for(i = 0; i < g_include_paths_count; ++i)
-      g_include_paths[i][0] = 0;
-    g_include_paths_count = 0;
-    
-    /*are we running as cgi or stand-alone*/
-    pgi = getenv("GATEWAY_INTERFACE");
-    if(pgi && strncmp(pgi, "CGI/", 4) == 0)
-      g_is_cgi = 1;
-    else
-      g_is_cgi = 0;
+    log_debug_message("max number preloads %d has been reached\n", MAX_PRELOAD_FILE);
+    return 0;
+  }
+
+  path = realpath(filename, NULL);
+  if(!path || strlen(path) >= MAX_PATH_LEN)
+  {
+    log_debug_message("cannot resolve preload path %s\n", filename);
+    free(path);
+    return 0;
+  }
 
-    /*determine document root
-    this is where the jst_prefix.js/jst_suffix.js files should live 
-    and any include path is treated as relative to this */
+  log_debug_message("load_template_preload:%s filepath=%s\n", filename, path);
+  rc = strlen(path);
+  g_template_depth++;
+  i = template_read(path, rc > 4 && !strcmp(path + rc - 4, ".jst"), &buf, &buflen, 0);
+  g_template_depth--;
+  if(g_template_depth == 0)
+    jst_arena_release();
+  if(!i)
+  {
+    free(path);
+    return 0;
+  }
+
+  strcpy(g_preload_paths[g_preload_paths_count++], path);
+  free(path);
+
+  *bufout = buf;
+  *lenout = buflen;
+  return buflen;
+}
+
+/* include once tracking.
+   files are told apart by device and inode, so the different paths a page might use for one
+   file (./a.jst, dir/../a.jst, a symlink) all count as the same include */
+static size_t include_hash(dev_t dev, ino_t ino)
+{
+  uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(h ^ (h >> 29));
+}
+
+/* returns the slot of dev/ino in the set, or the empty slot it would go in */
+static include_key* include_slot(include_key* set, size_t size, dev_t dev, ino_t ino)
+{
+  size_t i = include_hash(dev, ino) & (size - 1);
+
+  while(set[i].used && (set[i].dev != dev || set[i].ino != ino))
+    i = (i + 1) & (size - 1);
+  return &set[i];
+}
+
+static int include_set_grow(void)
+{
+  size_t size = g_request.set_size ? g_request.set_size * 2 : INCLUDE_SET_MIN_SIZE;
+  include_key* set;
+  size_t i;
 
-    if(g_is_cgi)
+  set = (include_key*)calloc(size, sizeof(include_key));
+  if(!set)
+    return 0;
+  for(i = 0; i < g_request.set_size; ++i)
+    if(g_request.set[i].used)
+      *include_slot(set, size, g_request.set[i].dev, g_request.set[i].ino) = g_request.set[i];
+  free(g_request.set);
+  g_request.set = set;
+  g_request.set_size = size;
+  return 1;
+}
+
+static void request_reset_includes(void)
+{
+  int i;
+
+  for(i = 0; i < g_request.path_count; ++i)
+    free(g_request.paths[i]);
+  g_request.path_count = 0;
+  if(g_request.set)
+    memset(g_request.set, 0, g_request.set_size * sizeof(include_key));
+  g_request.set_count = 0;
+}
+
+/* records filepath as loaded by the request.
+   returns 1 if it is new, 0 if it was already loaded and -1 on error.
+   a file which cannot be stat'ed is recorded (it is still a dependency of the page) and
+   reported as new so the load fails as it would have.
+   the stat is taken before the file is read and kept for the bytecode cache, so an edit after
+   this point makes the cached entry stale rather than recording the new state with old code */
+static int request_add_include(const char* filepath)
+{
+  struct stat st;
+  include_key* slot = NULL;
+
+  if(stat(filepath, &st) == 0)
+  {
+    if(g_request.set_count * 2 >= g_request.set_size && !include_set_grow())
+      return -1;
+    slot = include_slot(g_request.set, g_request.set_size, st.st_dev, st.st_ino);
+    if(slot->used)
+      return 0;
+  }
+
+  if(g_request.path_count == g_request.path_alloc)
+  {
+    int alloc = g_request.path_alloc ? g_request.path_alloc * 2 : INCLUDE_SET_MIN_SIZE;
+    char** paths = (char**)realloc(g_request.paths, alloc * sizeof(char*));
+    cache_file* files;
+    if(!paths)
+      return -1;
+    g_request.paths = paths;
+    files = (cache_file*)realloc(g_request.files, alloc * sizeof(cache_file));
+    if(!files)
+      return -1;
+    g_request.files = files;
+    g_request.path_alloc = alloc;
+  }
+  if(!(g_request.paths[g_request.path_count] = strdup(filepath)))
+    return -1;
+  g_request.files[g_request.path_count].path = g_request.paths[g_request.path_count];
+  g_request.files[g_request.path_count].found = slot != NULL;
+  if(slot)
+    g_request.files[g_request.path_count].st = st;
+  g_request.path_count++;
+
+  if(slot)
+  {
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->used = 1;
+    g_request.set_count++;
+  }
+  return 1;
+}
+
+/* resets per template state and determines the document root for a top level template.
+   for cgi pscriptname is set to the template path relative to the root */
+static int template_begin(const char** pscriptname)
+{
+  char* pgi;
+
+  /*cleanup any previous passes through here*/
+  g_request.document_root[0] = 0;
+  g_request.php_prelude_called = 0;
+  request_reset_includes();
+  static_table_reset();
+#if defined(JST_MINIFY_HTML)
+  memset(&g_minify, 0, sizeof(g_minify));
+#endif
+  
+  /*are we running as cgi or stand-alone*/
+  pgi = getenv("GATEWAY_INTERFACE");
+  if(pgi && strncmp(pgi, "CGI/", 4) == 0)
+    g_request.is_cgi = 1;
+  else
+    g_request.is_cgi = 0;
+
+  /*determine document root
+  this is where the jst_prefix.js/jst_suffix.js files should live 
+  and any include path is treated as relative to this */
+
+  if(g_request.is_cgi)
+  {
+    /*for cgi we can use cgi env vars to figure it out*/
+    char* pscriptfile = getenv("SCRIPT_FILENAME");  /* eg: /tmp/www/actionHandler/ajaxSet_index_userbar.jst */
+    *pscriptname = getenv("SCRIPT_NAME");           /* eg: /actionHandler/ajaxSet_index_userbar.jst */
+    if(*pscriptname && pscriptfile)
     {
-      /*for cgi we can use cgi env vars to figure it out*/
-      char* pscriptfile = getenv("SCRIPT_FILENAME");  /* eg: /tmp/www/actionHandler/ajaxSet_index_userbar.jst */
-      pscriptname = getenv("SCRIPT_NAME");            /* eg: /actionHandler/ajaxSet_index_userbar.jst */
-      if(pscriptname && pscriptfile)
-      {
-        char* p1;
+      char* p1;
 
-        if(pscriptname[0] == '/')
-          pscriptname++;
+      if((*pscriptname)[0] == '/')
+        (*pscriptname)++;
 
-        if(strlen(pscriptfile) > MAX_PATH_LEN)
-        {
-          log_debug_message("SCRIPT_FILENAME exceeds our max supported path len\n");
-          return 0;
-        }
+      if(strlen(pscriptfile) > MAX_PATH_LEN)
+      {
+        log_debug_message("SCRIPT_FILENAME exceeds our max supported path len\n");
+        return 0;
+      }
 
-        p1 = strstr(pscriptfile, pscriptname);
-        if(p1)
-        {
-          size_t rootlen = p1 - pscriptfile;
-          if(rootlen < MAX_PATH_LEN)
-          {
-            strncpy(g_document_root_path, pscriptfile, rootlen);
-          }
-        }
-        else
+      p1 = strstr(pscriptfile, *pscriptname);
+      if(p1)
+      {
+        size_t rootlen = p1 - pscriptfile;
+        if(rootlen < MAX_PATH_LEN)
         {
-          log_debug_message("SCRIPT_NAME not found in SCRIPT_FILENAME\n");
-          return 0;
+          strncpy(g_request.document_root, pscriptfile, rootlen);
         }
       }
       else
       {
-        log_debug_message("SCRIPT_NAME/FILENAME env var missing\n");
+        log_debug_message("SCRIPT_NAME not found in SCRIPT_FILENAME\n");
         return 0;
       }
-
-      log_debug_message("cgi root directory is %s\n", g_document_root_path);
     }
     else
     {
-      /*for stand alone use the current work directory*/
-      if(!getcwd(g_document_root_path, MAX_PATH_LEN-1))
-      {
-        log_debug_message("failed to get current working directory\n");
-        return 0;
-      }
-      strcat(g_document_root_path, "/");
+      log_debug_message("SCRIPT_NAME/FILENAME env var missing\n");
+      return 0;
+    }
 
-      log_debug_message("non-cgi root directory is %s\n", g_document_root_path);
+    log_debug_message("cgi root directory is %s\n", g_request.document_root);
+  }
+  else
+  {
+    /*for stand alone use the current work directory*/
+    if(!getcwd(g_request.document_root, MAX_PATH_LEN-1))
+    {
+      log_debug_message("failed to get current working directory\n");
+      return 0;
     }
+    strcat(g_request.document_root, "/");
+
+    log_debug_message("non-cgi root directory is %s\n", g_request.document_root);
+  }
+
+  return 1;
+}
+
+#ifdef JST_EMBEDDED_PRELUDE
+/* php.jst is evaluated ahead of any page like a preload, from TEMPL_PATH if it exists there
+   or else as the bytecode embedded in the binary. includes of JST_PHP_INCLUDE are skipped after this */
+int load_template_php_prelude(char** bufout, size_t* lenout)
+{
+  const jst_embedded_file* f;
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(access(TEMPL_PHP_FILE, F_OK) == 0)
+  {
+    if(!load_template_preload(TEMPL_PHP_FILE, bufout, lenout))
+      return 0;
+    g_php_prelude = 1;
+    return *lenout;
+  }
+
+  f = find_embedded_file("php.jst");
+  if(!f || g_preload_paths_count == MAX_PRELOAD_FILE)
+    return 0;
+
+  *bufout = (char*)malloc(f->len);
+  if(!*bufout)
+    return 0;
+  memcpy(*bufout, f->data, f->len);
+  *lenout = f->len;
+
+  /*recorded so the bytecode cache keeps pages compiled with and without it apart*/
+  strcpy(g_preload_paths[g_preload_paths_count++], "embedded:php.jst");
+  g_php_prelude = 1;
+  return *lenout;
+}
+
+/* php.jst loaded with load_template_php_prelude failed to evaluate, pages include it again */
+void template_php_prelude_failed(void)
+{
+  if(g_php_prelude && g_preload_paths_count)
+    g_preload_paths_count--;
+  g_php_prelude = 0;
+}
+#endif
+
+/* for a process which runs a single page: rather than php.jst being evaluated ahead of the page,
+   an include of JST_PHP_INCLUDE evaluates the bytecode embedded in the binary where it is reached,
+   see template_php_include. php.jst in TEMPL_PATH is included from there as source instead */
+void template_set_lazy_php_prelude(int on)
+{
+#ifdef JST_EMBEDDED_PRELUDE
+  g_php_prelude_lazy = on;
+#else
+  (void)on;
+#endif
+}
+
+/* ccsp.phpPrelude(). hands back the embedded php.jst bytecode to evaluate, unless it already was */
+int template_php_prelude_code(const char** codeout, size_t* lenout)
+{
+#ifdef JST_EMBEDDED_PRELUDE
+  const jst_embedded_file* f;
+
+  if(g_php_prelude || (f = find_embedded_file("php.jst")) == NULL)
+    return 0;
+  *codeout = (const char*)f->data;
+  *lenout = f->len;
+  g_php_prelude = 1;
+  return 1;
+#else
+  (void)codeout;
+  (void)lenout;
+  return 0;
+#endif
+}
+
+/* whether filepath is the document root's JST_PHP_INCLUDE */
+static int template_is_php_include(const char* filepath)
+{
+  size_t len = strlen(g_request.document_root);
+
+  return strncmp(filepath, g_request.document_root, len) == 0 && strcmp(filepath + len, JST_PHP_INCLUDE) == 0;
+}
+
+/* the code an include of php.jst is replaced with when it is evaluated lazily.
+   returns -1 to include filepath, which is switched to the copy in TEMPL_PATH if there is one */
+static int template_php_include(char* filepath, char** bufout, size_t* lenout)
+{
+#ifdef JST_EMBEDDED_PRELUDE
+  static const char call[] = "ccsp.phpPrelude();";
+
+  if(access(TEMPL_PHP_FILE, F_OK) == 0)
+  {
+    snprintf(filepath, MAX_PATH_LEN, "%s", TEMPL_PHP_FILE);
+    return -1;
   }
+  if(!find_embedded_file("php.jst"))
+    return -1;
+  if(g_request.php_prelude_called)
+    return 0;
 
-  log_debug_message("root=%s  path=%s\n", g_document_root_path, pscriptname);
-  i = snprintf(filepath, MAX_PATH_LEN, "%s%s", g_document_root_path, pscriptname);
+  /* from the heap or the arena like any other include, see template_process */
+  *bufout = g_template_depth == 1 ? (char*)malloc(sizeof(call)) : (char*)jst_arena_alloc(sizeof(call));
+  if(!*bufout)
+    return 0;
+  memcpy(*bufout, call, sizeof(call));
+  *lenout = sizeof(call) - 1;
+  g_request.php_prelude_called = 1;
+  return 1;
+#else
+  (void)filepath;
+  (void)bufout;
+  (void)lenout;
+  return -1;
+#endif
+}
+
+/* reads filepath and processes it into js if it is a template.
+   templates and the files they include are mapped rather than read, the mappings stay in
+   place until the outer load_template_file is done */
+static int template_read(const char* filepath, int is_jst, char** buf, size_t* buflen, int top)
+{
+  const char* src;
+  size_t srclen;
+
+  /* anything other than a template is handed back as is, from the heap unless it is included */
+  if(!is_jst && g_template_depth == 1)
+    return read_file(filepath, buf, buflen) != 0;
+
+  if(!jst_arena_map_file(filepath, &src, &srclen))
+    return 0;
+
+  if(!is_jst)
+  {
+    /* only read by template_include, which copies it into the including template */
+    *buf = (char*)src;
+    *buflen = srclen;
+    return 1;
+  }
+
+  return template_process(src, srclen, buf, buflen, top) != 0;
+}
+
+static int template_load(const char *filename, char** bufout, size_t* lenout, int top)
+{
+  char* buf;
+  size_t buflen;
+  size_t rc;
+  int i;
+  char filepath[MAX_PATH_LEN];
+  const char* pscriptname = filename;
+  log_debug_message("load_template_file filename=%s top=%d\n", filename, top);
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(top && !template_begin(&pscriptname))
+    return 0;
+
+  log_debug_message("root=%s  path=%s\n", g_request.document_root, pscriptname);
+  i = snprintf(filepath, MAX_PATH_LEN, "%s%s", g_request.document_root, pscriptname);
 
   if(i < 0 || i >= MAX_PATH_LEN)
   {
@@ -894,40 +1647,289 @@ int load_template_file(const char *filename, char** bufout, size_t* lenout, int
     return 0;
   }
 
-  /*determine if file has already been included and include only once*/
   if(!top)
   {
-    log_debug_message("checking if %s has already been included\n", filepath);
-    for(i = 0; i < g_include_paths_count; ++i)
+    if(g_preload_paths_count && template_is_preloaded(filepath))
     {
-      if(strcmp(g_include_paths[i], filepath) == 0)
-      {
-        log_debug_message("skipping %s, already included once\n", filename);
-        return 0;
-      }
+      log_debug_message("skipping %s, already preloaded\n", filename);
+      return 0;
     }
-  }
 
-  if(g_include_paths_count == MAX_INCLUDE_FILE-2)
-  {
-    log_debug_message("max number includes %d has been reached\n", MAX_INCLUDE_FILE);
-    return 0;
-  }
+    if(g_php_prelude && template_is_php_include(filepath))
+    {
+      log_debug_message("skipping %s, part of the prelude\n", filename);
+      return 0;
+    }
 
-  strcpy(g_include_paths[g_include_paths_count++], filepath);
+    if(g_php_prelude_lazy && template_is_php_include(filepath))
+    {
+      i = template_php_include(filepath, bufout, lenout);
+      if(i >= 0)
+        return i ? *lenout : 0;
+    }
+  }
 
-  log_debug_message("load_template_file:%s filepath=%s root:%s top:%d\n", filename, filepath, g_document_root_path, top);
-  if(!read_file(filepath, &buf, &buflen))
+  /*determine if file has already been included and include only once*/
+  i = request_add_include(filepath);
+  if(i <= 0)
   {
+    if(i == 0)
+      log_debug_message("skipping %s, already included once\n", filename);
     return 0;
   }
+
+  log_debug_message("load_template_file:%s filepath=%s root:%s top:%d\n", filename, filepath, g_request.document_root, top);
   rc = strlen(filename);
-  if(rc > 4 && !strcmp(filename + rc - 4, ".jst"))
-    if(!template_process(&buf, &buflen, top))
-      return 0;
+  if(!template_read(filepath, rc > 4 && !strcmp(filename + rc - 4, ".jst"), &buf, &buflen, top))
+    return 0;
 
   *bufout = buf;
   *lenout = buflen;
   return buflen;
 }
 
+/* loads filename, processing it into js if it is a template.
+   the result is malloc'ed and belongs to the caller, everything the parser needs along the
+   way comes from the arena which is released once the outermost call returns */
+int load_template_file(const char *filename, char** bufout, size_t* lenout, int top)
+{
+  int rc;
+
+  jst_timing_begin("template", filename);
+  if(g_observer)
+    g_observer->begin(filename, top, g_observer->arg);
+  g_template_depth++;
+  rc = template_load(filename, bufout, lenout, top);
+  g_template_depth--;
+  if(g_observer)
+    g_observer->end(filename, rc ? *bufout : NULL, rc ? *lenout : 0, g_observer->arg);
+
+  /* the sources and included code are all copied into the result by now */
+  if(g_template_depth == 0)
+    jst_arena_release();
+  jst_timing_end("template");
+  return rc;
+}
+
+/* bytecode cache of top level templates.
+   an entry is keyed by the template path (and any preloads, which change what gets compiled)
+   and depends on the template, every file it statically included, the prefix/suffix
+   (including their absence when the embedded copies are used) and the jst binary itself */
+static int template_cache_key(const char* filepath, char* key, size_t keylen)
+{
+  int i;
+  size_t len;
+
+  len = snprintf(key, keylen, "%s", filepath);
+  for(i = 0; i < g_preload_paths_count && len < keylen; ++i)
+    len += snprintf(key + len, keylen - len, "|%s", g_preload_paths[i]);
+  return len < keylen;
+}
+
+static void template_cache_restore_include(const char* path, void* arg)
+{
+  (void)arg;
+
+  if(path[0] != '/' || strncmp(path, "/proc/", 6) == 0 ||
+     !strcmp(path, TEMPL_PREFIX_FILE) || !strcmp(path, TEMPL_SUFFIX_FILE))
+    return;
+  request_add_include(path);
+}
+
+/* loads the cached bytecode of a top level template in place of load_template_file.
+   on a hit the include once list is restored as if the template had been parsed,
+   so runtime includes of already included files are still skipped */
+int load_template_cached(const char *filename, char** bufout, size_t* lenout)
+{
+  char filepath[MAX_PATH_LEN];
+  char key[MAX_PATH_LEN * (MAX_PRELOAD_FILE + 1)];
+  const char* pscriptname = filename;
+  char* entry;
+  size_t len;
+  int i;
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(!template_begin(&pscriptname))
+    return 0;
+
+  i = snprintf(filepath, MAX_PATH_LEN, "%s%s", g_request.document_root, pscriptname);
+  if(i < 0 || i >= MAX_PATH_LEN || !template_cache_key(filepath, key, sizeof(key)))
+    return 0;
+
+  jst_timing_begin("template_cached", filepath);
+  i = cache_load(key, template_cache_restore_include, NULL, bufout, lenout);
+  jst_timing_end("template_cached");
+  if(!i)
+    return 0;
+
+  /* the static blocks are used in place for the rest of the request, the bytecode is copied out */
+  entry = *bufout;
+  len = static_table_restore(entry, *lenout);
+  *bufout = len ? (char*)malloc(*lenout - len) : NULL;
+  if(!*bufout)
+  {
+    static_table_reset();
+    free(entry);
+    *lenout = 0;
+    return 0;
+  }
+  g_request.blocks.image = entry;
+  *lenout -= len;
+  memcpy(*bufout, entry + len, *lenout);
+
+  log_debug_message("load_template_cached:%s filepath=%s\n", filename, filepath);
+  return 1;
+}
+
+/* stores the bytecode compiled from the last top level template loaded with load_template_file,
+   along with its static blocks */
+int store_template_cached(const char* bytecode, size_t len)
+{
+  char key[MAX_PATH_LEN * (MAX_PRELOAD_FILE + 1)];
+  cache_file* deps;
+  char* data;
+  size_t data_len;
+  int count = 0;
+  int rc;
+  int i;
+
+  if(g_request.path_count == 0 || !template_cache_key(g_request.paths[0], key, sizeof(key)))
+    return 0;
+
+  if(!template_static_image(bytecode, len, &data, &data_len))
+    return 0;
+
+  deps = (cache_file*)malloc((g_request.path_count + 3) * sizeof(cache_file));
+  if(!deps)
+  {
+    free(data);
+    return 0;
+  }
+  for(i = 0; i < g_request.path_count; ++i)
+    deps[count++] = g_request.files[i];
+  for(i = 0; i < 3; ++i)
+    deps[count++] = g_prelude_files[i];
+
+  rc = cache_store(key, deps, count, data, data_len);
+  free(deps);
+  free(data);
+  return rc;
+}
+
+static void template_bundle_restore_include(const char* path, void* arg)
+{
+  char filepath[MAX_PATH_LEN];
+  int i;
+
+  (void)arg;
+
+  i = snprintf(filepath, MAX_PATH_LEN, "%s%s", g_request.document_root, path);
+  if(i > 0 && i < MAX_PATH_LEN)
+    request_add_include(filepath);
+}
+
+/* loads the bytecode of a top level template from the site bundle in place of load_template_file.
+   the bytecode and the static blocks point into the bundle, which stays mapped. as with the
+   cache the include once list is restored, which is the only time the document root is looked at */
+int load_template_bundled(const char *filename, const char** bufout, size_t* lenout)
+{
+  const char* pscriptname = filename;
+  size_t len = strlen(filename);
+
+  *bufout = NULL;
+  *lenout = 0;
+
+  if(len <= 4 || strcmp(filename + len - 4, ".jst") != 0 || !bundle_enabled())
+    return 0;
+
+  if(!template_begin(&pscriptname))
+    return 0;
+
+  if(!bundle_find(pscriptname, template_bundle_restore_include, NULL, bufout, lenout))
+    return 0;
+
+  /* the static blocks are used in place too */
+  len = static_table_restore(*bufout, *lenout);
+  if(!len)
+  {
+    *bufout = NULL;
+    *lenout = 0;
+    return 0;
+  }
+  *bufout += len;
+  *lenout -= len;
+
+  log_debug_message("load_template_bundled:%s name=%s\n", filename, pscriptname);
+  return 1;
+}
+
+/* opens the file of a top level template which has no code at all, so it is its content as is
+   and can be sent without running it. returns the descriptor (with st filled in, and crc with the
+   crc32 of the content unless it is NULL) or -1 for anything else, without complaining, as the
+   template is then loaded the usual way */
+int template_content_only(const char *filename, struct stat* st, uint32_t* crc)
+{
+  char filepath[MAX_PATH_LEN];
+  const char* pscriptname = filename;
+  size_t len = strlen(filename);
+  void* addr;
+  int fd;
+  int i;
+
+#if defined(JST_MINIFY_HTML)
+  /* the content would be minified */
+  return -1;
+#endif
+
+  if(len <= 4 || strcmp(filename + len - 4, ".jst") != 0 || !template_begin(&pscriptname))
+    return -1;
+
+  i = snprintf(filepath, MAX_PATH_LEN, "%s%s", g_request.document_root, pscriptname);
+  if(i < 0 || i >= MAX_PATH_LEN)
+    return -1;
+
+  fd = open(filepath, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return -1;
+  if(fstat(fd, st) != 0 || !S_ISREG(st->st_mode) || st->st_size == 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  /* no code also means no includes. all whitespace is left to the parser, which drops it */
+  addr = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+  i = !memmem(addr, st->st_size, JST_OPEN_TAG, JST_OPEN_LEN) && !is_whitespace((const char*)addr, st->st_size);
+  if(i && crc)
+    *crc = (uint32_t)crc32(0, (const Bytef*)addr, st->st_size);
+  munmap(addr, st->st_size);
+  if(!i)
+  {
+    close(fd);
+    return -1;
+  }
+
+  log_debug_message("template_content_only:%s filepath=%s\n", filename, filepath);
+  return fd;
+}
+
+/* the files loaded by the last top level template in load order (the page first) and the
+   document root they were loaded from, for building a bundle */
+int template_loaded_files(const char* const** pathsout, const char** rootout)
+{
+  *pathsout = (const char* const*)g_request.paths;
+  *rootout = g_request.document_root;
+  return g_request.path_count;
+}
+
+void template_set_observer(const template_observer* observer)
+{
+  g_observer = observer;
+}
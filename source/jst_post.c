@@ -27,6 +27,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include "jst_internal.h"
+#include "jst.h"
 
 #define POST_DATA_DIR         "/tmp"      /* directory where post data is saved to disk */
 #define POST_FILE_PREFIX      "jst_post_" /* prefix for each post data file saved to disk */
@@ -908,7 +909,8 @@ void save_debug_post_data(const char* content_data, int content_len)
 }      
 #endif
 
-duk_ret_t ccsp_post_module_open(duk_context *ctx)
+/* reads CONTENT_LENGTH bytes of post data from stdin into post_data/files_data */
+static void post_data_read(void)
 {
   const char* env_content_len= 0;
   char* content_data = 0;
@@ -918,9 +920,6 @@ duk_ret_t ccsp_post_module_open(duk_context *ctx)
   int boundary_len = 0;
   int content_type = 0;
 
-  duk_push_object(ctx);
-  duk_put_function_list(ctx, -1, ccsp_post_funcs);
-
   env_content_len = getenv("CONTENT_LENGTH");
   if(env_content_len)
   {
@@ -929,7 +928,7 @@ duk_ret_t ccsp_post_module_open(duk_context *ctx)
     if(content_len > POST_MAX_SIZE)
     {
       CosaPhpExtLog("post size %d exceeds limit %d\n", content_len, POST_MAX_SIZE);
-      return 1;
+      return;
     }
   
     if(content_len > 0)
@@ -938,14 +937,20 @@ duk_ret_t ccsp_post_module_open(duk_context *ctx)
       if(!content_data)
       {
         CosaPhpExtLog("failed to allocate content data\n");
-        return 1;
+        return;
       }
 #if DEBUG_POST_LOAD
       if(jst_debug_file_name && access("/tmp/jst_enable_dbg_load", F_OK) == 0)
         read_len = load_debug_post_data(content_data, content_len);
       else
 #endif
-      read_len = fread(content_data, 1, content_len, stdin);
+      {
+        jst_timing_begin("post_read", NULL);
+        read_len = fread(content_data, 1, content_len, stdin);
+        jst_timing_end("post_read");
+        if(read_len > 0)
+          jst_capture_body(content_data, read_len);
+      }
       content_data[content_len] = 0;
       if(read_len != content_len)
       {
@@ -962,7 +967,9 @@ duk_ret_t ccsp_post_module_open(duk_context *ctx)
         {
           process_multipart_form_data(content_data, content_len, boundary, boundary_len);
           free(boundary);
-          free(content_data);
+          /*post_data takes ownership of content_data if there were no form fields*/
+          if(post_data != content_data)
+            free(content_data);
         }
         else
         {
@@ -979,8 +986,31 @@ duk_ret_t ccsp_post_module_open(duk_context *ctx)
       }
     }
   }
+}
+
+duk_ret_t ccsp_post_module_open(duk_context *ctx)
+{
+  duk_push_object(ctx);
+  put_function_list(ctx, -1, ccsp_post_funcs);
+
+  post_data_read();
 
   return 1;
 }
 
+/* called at the start of each request when the heap is reused across requests
+   so that data from the previous request is dropped and the new post data is read */
+void ccsp_post_reset(void)
+{
+  if(post_data)
+    free(post_data);
+  post_data = NULL;
+  if(files_data)
+    free(files_data);
+  files_data = NULL;
+  file_count = 0;
+
+  post_data_read();
+}
+
 
@@ -0,0 +1,451 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+/* jst --precompile: builds the site bundle (see jst_bundle.c) of every .jst page under a
+   document root.
+
+   Each page is run through the template parser exactly as a request for it would be, with the
+   document root as the root, the prefix/suffix and the php prelude the same as at runtime and
+   any --preload files preloaded. The parser keeps its state in globals so the pages are parsed
+   one after the other, which is cheap; compiling the resulting js is what costs and is done on
+   a pool of threads, each with its own duktape heap. Pages are stored in name order so the same
+   site always gives the same bundle. */
+
+#define MAX_PRECOMPILE_THREADS 16
+#define MAX_PRECOMPILE_PATH_LEN 256
+
+typedef struct precompile_job
+{
+  char* name;
+  char** deps;
+  int dep_count;
+  char* src;
+  size_t src_len;
+  char* blocks;
+  size_t blocks_len;
+  char* code;
+  size_t code_len;
+  int parsed;
+  char* error;
+}precompile_job;
+
+typedef struct precompile_pool
+{
+  precompile_job* jobs;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+}precompile_pool;
+
+static int site_add_page(char*** pages, int* count, int* alloc, const char* name)
+{
+  char** p;
+
+  if(*count == *alloc)
+  {
+    int n = *alloc ? *alloc * 2 : 64;
+    p = (char**)realloc(*pages, n * sizeof(char*));
+    if(!p)
+    {
+      fprintf(stderr, "Error: malloc oom\n");
+      return 0;
+    }
+    *pages = p;
+    *alloc = n;
+  }
+
+  (*pages)[*count] = strdup(name);
+  if(!(*pages)[*count])
+  {
+    fprintf(stderr, "Error: malloc oom\n");
+    return 0;
+  }
+  (*count)++;
+  return 1;
+}
+
+/* finds every .jst file under dir (relative to the document root, which is the cwd) */
+static int site_find_pages(const char* dir, char*** pages, int* count, int* alloc)
+{
+  char path[MAX_PRECOMPILE_PATH_LEN];
+  struct dirent* ent;
+  struct stat st;
+  DIR* d;
+  size_t len;
+  int ok = 1;
+
+  d = opendir(dir[0] ? dir : ".");
+  if(!d)
+  {
+    fprintf(stderr, "Error: cannot open directory %s error:%s\n", dir[0] ? dir : ".", strerror(errno));
+    return 0;
+  }
+
+  while(ok && (ent = readdir(d)) != NULL)
+  {
+    if(ent->d_name[0] == '.')
+      continue;
+
+    if(snprintf(path, sizeof(path), "%s%s", dir, ent->d_name) >= (int)sizeof(path))
+    {
+      fprintf(stderr, "Error: path too long %s%s\n", dir, ent->d_name);
+      ok = 0;
+      break;
+    }
+
+    if(stat(path, &st) != 0)
+      continue;
+
+    if(S_ISDIR(st.st_mode))
+    {
+      len = strlen(path);
+      if(len + 1 >= sizeof(path))
+      {
+        fprintf(stderr, "Error: path too long %s/\n", path);
+        ok = 0;
+      }
+      else
+      {
+        strcpy(path + len, "/");
+        ok = site_find_pages(path, pages, count, alloc);
+      }
+    }
+    else if(S_ISREG(st.st_mode))
+    {
+      len = strlen(path);
+      if(len > 4 && strcmp(path + len - 4, ".jst") == 0)
+        ok = site_add_page(pages, count, alloc, path);
+    }
+  }
+
+  closedir(d);
+  return ok;
+}
+
+static int site_compare(const void* a, const void* b)
+{
+  return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+void site_free_pages(char** pages, int count)
+{
+  int i;
+
+  for(i = 0; i < count; ++i)
+    free(pages[i]);
+  free(pages);
+}
+
+/* sets up to parse the pages under docroot as requests for them would be parsed, i.e. with
+   the preloads loaded, and lists the pages relative to docroot in name order.
+   docroot becomes the cwd. returns the number of pages or -1 */
+int site_open(const char* docroot, const char* const* preloads, int preload_count, char*** pagesout)
+{
+  char** pages = NULL;
+  char* buf;
+  size_t buflen;
+  int count = 0;
+  int alloc = 0;
+  int i;
+
+  *pagesout = NULL;
+
+  /* includes of php.jst evaluate it, so a page runs with php.jst evaluated ahead (in the server
+     modes, where that then does nothing) or not (a single page) */
+  template_set_lazy_php_prelude(1);
+
+  for(i = 0; i < preload_count; ++i)
+  {
+    if(!load_template_preload(preloads[i], &buf, &buflen))
+    {
+      fprintf(stderr, "Error: failed to preload %s\n", preloads[i]);
+      return -1;
+    }
+    free(buf);
+  }
+
+  /* the root of a page is then the cwd, as for any page run outside of cgi */
+  unsetenv("GATEWAY_INTERFACE");
+  if(chdir(docroot) != 0)
+  {
+    fprintf(stderr, "Error: cannot change to %s error:%s\n", docroot, strerror(errno));
+    return -1;
+  }
+
+  if(!site_find_pages("", &pages, &count, &alloc))
+  {
+    site_free_pages(pages, count);
+    return -1;
+  }
+  if(count)
+    qsort(pages, count, sizeof(char*), site_compare);
+
+  *pagesout = pages;
+  return count;
+}
+
+/* a page which failed, what went wrong is listed along with the compile errors at the end */
+static int precompile_fail(precompile_job* job, const char* reason)
+{
+  job->error = strdup(reason);
+  return 0;
+}
+
+/* parses the page and records the files it included and its static blocks */
+static int precompile_parse(precompile_job* job)
+{
+  const char* const* paths;
+  const char* root;
+  size_t root_len;
+  int count;
+  int i;
+
+  if(!load_template_file(job->name, &job->src, &job->src_len, 1))
+    return precompile_fail(job, "failed to parse");
+
+  if(!template_static_image(NULL, 0, &job->blocks, &job->blocks_len))
+    return precompile_fail(job, "failed to store its static blocks");
+
+  count = template_loaded_files(&paths, &root);
+  root_len = strlen(root);
+  job->deps = (char**)calloc(count ? count : 1, sizeof(char*));
+  if(!job->deps)
+    return precompile_fail(job, "out of memory listing its includes");
+  for(i = 0; i < count; ++i)
+  {
+    /* everything is included relative to the root, anything else can't be restored at runtime */
+    if(strncmp(paths[i], root, root_len) != 0)
+      continue;
+    job->deps[job->dep_count] = strdup(paths[i] + root_len);
+    if(!job->deps[job->dep_count])
+      return precompile_fail(job, "out of memory listing its includes");
+    job->dep_count++;
+  }
+  job->parsed = 1;
+  return 1;
+}
+
+static void precompile_compile(duk_context* ctx, precompile_job* job)
+{
+  void* bc;
+  duk_size_t bclen;
+
+  /* compiled the way wrapped_compile_execute compiles a page */
+  duk_push_string(ctx, job->name);
+  if(duk_pcompile_lstring_filename(ctx, DUK_COMPILE_SHEBANG, job->src, job->src_len) != 0)
+  {
+    job->error = strdup(duk_safe_to_string(ctx, -1));
+    duk_pop(ctx);
+    return;
+  }
+
+  /* stored as the static blocks followed by the bytecode, see template_static_image */
+  duk_dump_function(ctx);
+  bc = duk_get_buffer(ctx, -1, &bclen);
+  job->code = (char*)malloc(job->blocks_len + bclen);
+  if(job->code)
+  {
+    memcpy(job->code, job->blocks, job->blocks_len);
+    memcpy(job->code + job->blocks_len, bc, bclen);
+    job->code_len = job->blocks_len + bclen;
+  }
+  else
+    job->error = strdup("out of memory");
+  duk_pop(ctx);
+}
+
+static void* precompile_worker(void* arg)
+{
+  precompile_pool* pool = (precompile_pool*)arg;
+  duk_context* ctx;
+  int i;
+
+  ctx = duk_create_heap_default();
+
+  for(;;)
+  {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if(i >= pool->count)
+      break;
+
+    /* pages which failed to parse have nothing to compile */
+    if(!pool->jobs[i].parsed)
+      continue;
+    if(ctx)
+      precompile_compile(ctx, &pool->jobs[i]);
+    else
+      pool->jobs[i].error = strdup("failed to create heap");
+  }
+
+  if(ctx)
+    duk_destroy_heap(ctx);
+  return NULL;
+}
+
+static int precompile_run_pool(precompile_job* jobs, int count)
+{
+  pthread_t threads[MAX_PRECOMPILE_THREADS];
+  precompile_pool pool;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads;
+  int started = 0;
+  int i;
+
+  nthreads = ncpu < 1 ? 1 : (ncpu > MAX_PRECOMPILE_THREADS ? MAX_PRECOMPILE_THREADS : (int)ncpu);
+  if(nthreads > count)
+    nthreads = count;
+
+  pool.jobs = jobs;
+  pool.count = count;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  for(i = 0; i < nthreads; ++i)
+  {
+    if(pthread_create(&threads[i], NULL, precompile_worker, &pool) != 0)
+      break;
+    started++;
+  }
+
+  /* no threads at all, do the work here */
+  if(!started)
+    precompile_worker(&pool);
+
+  for(i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&pool.lock);
+  return started ? started : 1;
+}
+
+static void precompile_free(precompile_job* jobs, int count)
+{
+  int i;
+  int j;
+
+  for(i = 0; i < count; ++i)
+  {
+    for(j = 0; j < jobs[i].dep_count; ++j)
+      free(jobs[i].deps[j]);
+    free(jobs[i].deps);
+    free(jobs[i].name);
+    free(jobs[i].src);
+    free(jobs[i].blocks);
+    free(jobs[i].code);
+    free(jobs[i].error);
+  }
+  free(jobs);
+}
+
+int jst_precompile(const char* docroot, const char* output, const char* const* preloads, int preload_count)
+{
+  char outpath[MAX_PRECOMPILE_PATH_LEN * 2];
+  precompile_job* jobs = NULL;
+  bundle_page* pages = NULL;
+  char** names;
+  int count;
+  int errors = 0;
+  int threads;
+  int rc = 1;
+  int i;
+
+  /* the output is relative to where we were started */
+  if(output[0] == '/')
+    snprintf(outpath, sizeof(outpath), "%s", output);
+  else if(!getcwd(outpath, MAX_PRECOMPILE_PATH_LEN) ||
+          snprintf(outpath + strlen(outpath), sizeof(outpath) - strlen(outpath), "/%s", output) >= (int)(sizeof(outpath) - strlen(outpath)))
+  {
+    fprintf(stderr, "Error: cannot resolve %s\n", output);
+    return 1;
+  }
+
+  count = site_open(docroot, preloads, preload_count, &names);
+  if(count < 0)
+    return 1;
+
+  /* as pages are parsed at runtime, see main */
+  template_set_static_blocks(1);
+
+  jobs = (precompile_job*)calloc(count ? count : 1, sizeof(precompile_job));
+  if(!jobs)
+  {
+    fprintf(stderr, "Error: malloc oom\n");
+    site_free_pages(names, count);
+    return 1;
+  }
+  for(i = 0; i < count; ++i)
+    jobs[i].name = names[i];
+  free(names);
+
+  /* every page is parsed and compiled, so one run lists all that are broken */
+  for(i = 0; i < count; ++i)
+    precompile_parse(&jobs[i]);
+
+  threads = count ? precompile_run_pool(jobs, count) : 0;
+
+  pages = (bundle_page*)calloc(count ? count : 1, sizeof(bundle_page));
+  if(!pages)
+  {
+    fprintf(stderr, "Error: malloc oom\n");
+    goto done;
+  }
+  for(i = 0; i < count; ++i)
+  {
+    if(jobs[i].error || !jobs[i].code)
+    {
+      fprintf(stderr, "Error: %s: %s\n", jobs[i].name, jobs[i].error ? jobs[i].error : "out of memory");
+      errors++;
+      continue;
+    }
+    pages[i].name = jobs[i].name;
+    pages[i].deps = (const char* const*)jobs[i].deps;
+    pages[i].dep_count = jobs[i].dep_count;
+    pages[i].code = jobs[i].code;
+    pages[i].code_len = jobs[i].code_len;
+  }
+  if(errors)
+  {
+    fprintf(stderr, "Error: %d of %d pages failed to parse or compile, %s not written\n", errors, count, output);
+    goto done;
+  }
+
+  if(!bundle_write(outpath, pages, count))
+    goto done;
+
+  fprintf(stdout, "precompiled %d pages from %s into %s (%d compile threads)\n", count, docroot, output, threads);
+  rc = 0;
+
+done:
+  free(pages);
+  precompile_free(jobs, count);
+  return rc;
+}
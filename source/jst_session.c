@@ -64,7 +64,9 @@
   Any session data will be loaded into a global variable named $_SESSION.
   The javascript will call start to begin a session.
   The javascript will call getData to read any session data from disk into $_SESSION.
-  The javascript will call setData any time any value on $_SESSION changed and the whole object will be saved to disk.
+  The javascript will call setData once at the end of the request (or on session_write_close) if any value on
+    $_SESSION changed and the whole object will be saved to disk, to a temp file renamed over the old one
+    so a concurrent request reads either the old or the new data.
   The javascript can get the session id with getId, can determine if the session was started with getStatus, 
     and can end the session with destroy.
 */
@@ -325,6 +327,9 @@ static duk_ret_t session_set_data(duk_context *ctx)
 {
   FILE* pfile;
   char filename[SESSION_FILE_MAX_PATH];
+  char tmpname[SESSION_FILE_MAX_PATH + 8];
+  int fd;
+  int ok;
   
   if(session_identifier == NULL)
   {
@@ -342,12 +347,19 @@ static duk_ret_t session_set_data(duk_context *ctx)
 
   CosaPhpExtLog( "session_set_data filename=%s\n", filename );
 
-  pfile = fopen(filename, "w");
+  snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+  fd = mkstemp(tmpname);
+  pfile = fd >= 0 ? fdopen(fd, "w") : NULL;
 
   if(!pfile)
   {
-    CosaPhpExtLog( "session_set_data failed to open filename=%s\n", filename );
-    fprintf(stderr, "%s: failed to open file %s", __PRETTY_FUNCTION__, filename);
+    CosaPhpExtLog( "session_set_data failed to open filename=%s\n", tmpname );
+    fprintf(stderr, "%s: failed to open file %s", __PRETTY_FUNCTION__, tmpname);
+    if(fd >= 0)
+    {
+      close(fd);
+      unlink(tmpname);
+    }
     RETURN_FALSE;
   }
 
@@ -384,7 +396,16 @@ static duk_ret_t session_set_data(duk_context *ctx)
 
   duk_pop(ctx);
 
-  fclose(pfile);
+  ok = !ferror(pfile);
+  if(fclose(pfile) != 0)
+    ok = 0;
+  if(!ok || rename(tmpname, filename) != 0)
+  {
+    CosaPhpExtLog( "session_set_data failed to write filename=%s error:%s\n", filename, strerror(errno) );
+    fprintf(stderr, "%s: failed to write file %s", __PRETTY_FUNCTION__, filename);
+    unlink(tmpname);
+    RETURN_FALSE;
+  }
 
   CosaPhpExtLog( "session_set_data file written %s\n", filename );
 
@@ -438,6 +459,15 @@ static duk_ret_t session_destroy(duk_context *ctx)
   }
 }
 
+/* called at the start of each request when the heap is reused across requests
+   so that a session started by the previous request isn't carried over */
+void ccsp_session_reset(void)
+{
+  if(session_identifier)
+    free(session_identifier);
+  session_identifier = NULL;
+}
+
 static const duk_function_list_entry ccsp_session_funcs[] = {
   { "start", session_start, 0 },
   { "create", session_create, 0 },
@@ -452,6 +482,6 @@ static const duk_function_list_entry ccsp_session_funcs[] = {
 duk_ret_t ccsp_session_module_open(duk_context *ctx)
 {
   duk_push_object(ctx);
-  duk_put_function_list(ctx, -1, ccsp_session_funcs);
+  put_function_list(ctx, -1, ccsp_session_funcs);
   return 1;
 }
@@ -0,0 +1,208 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "jst.h"
+
+/* Per request phase timing.
+
+   Off unless the JST_TIMING environment variable is set or JST_TIMING_FLAG_FILE exists when
+   the process starts. When on, each phase of a request is recorded as a span (monotonic start
+   and end time) and jst_timing_report writes all of them to stderr as one JSON line, e.g.
+
+     jst_timing {"pid":42,"script":"index.jst","total_us":5310,"phases":[
+       {"phase":"heap","start_us":85,"us":410},
+       {"phase":"template","detail":"/www/index.jst","start_us":1702,"us":980}, ...]}
+
+   (shown wrapped here). start_us is relative to the start of the request, which for a cgi
+   request is entry to main so the time before that (exec, dynamic loading) is not included.
+   Spans nest, e.g. the template span of an include lies within the execute span of the page.
+   A span which is still open when the report is written (e.g. because the script threw)
+   ends at the time of the report. */
+
+#define JST_TIMING_FLAG_FILE "/tmp/jst_enable_timing"
+#define MAX_TIMING_SPANS 64
+#define MAX_TIMING_PHASE_LEN 32
+#define MAX_TIMING_DETAIL_LEN 128
+#define MAX_TIMING_LINE_LEN 16384
+
+typedef struct timing_span
+{
+  char phase[MAX_TIMING_PHASE_LEN];
+  char detail[MAX_TIMING_DETAIL_LEN];
+  uint64_t start;
+  uint64_t end;
+}timing_span;
+
+static int g_timing_enabled = 0;
+static uint64_t g_timing_origin = 0;
+static timing_span g_timing_spans[MAX_TIMING_SPANS];
+static int g_timing_count = 0;
+static int g_timing_dropped = 0;
+
+static uint64_t timing_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called on entry to main, starts the first request */
+void jst_timing_init(void)
+{
+  g_timing_enabled = getenv("JST_TIMING") != NULL || access(JST_TIMING_FLAG_FILE, F_OK) == 0;
+  jst_timing_start();
+}
+
+/* starts a new request, dropping any spans not yet reported */
+void jst_timing_start(void)
+{
+  if(!g_timing_enabled)
+    return;
+  g_timing_origin = timing_now();
+  g_timing_count = 0;
+  g_timing_dropped = 0;
+}
+
+void jst_timing_begin(const char* phase, const char* detail)
+{
+  timing_span* span;
+
+  if(!g_timing_enabled)
+    return;
+
+  if(g_timing_count == MAX_TIMING_SPANS)
+  {
+    g_timing_dropped++;
+    return;
+  }
+
+  span = &g_timing_spans[g_timing_count++];
+  snprintf(span->phase, sizeof(span->phase), "%s", phase);
+  snprintf(span->detail, sizeof(span->detail), "%s", detail ? detail : "");
+  span->end = 0;
+  span->start = timing_now();
+}
+
+/* ends the most recently begun span of phase which is still open */
+void jst_timing_end(const char* phase)
+{
+  uint64_t now;
+  int i;
+
+  if(!g_timing_enabled)
+    return;
+
+  now = timing_now();
+  for(i = g_timing_count - 1; i >= 0; --i)
+  {
+    if(g_timing_spans[i].end == 0 && strcmp(g_timing_spans[i].phase, phase) == 0)
+    {
+      g_timing_spans[i].end = now;
+      return;
+    }
+  }
+}
+
+/* appends to line, anything which does not fit is dropped */
+static void timing_append(char* line, size_t* len, const char* format, ...)
+{
+  va_list vl;
+  int rc;
+
+  if(*len >= MAX_TIMING_LINE_LEN - 1)
+    return;
+  va_start(vl, format);
+  rc = vsnprintf(line + *len, MAX_TIMING_LINE_LEN - *len, format, vl);
+  va_end(vl);
+  if(rc > 0)
+    *len += rc;
+  if(*len > MAX_TIMING_LINE_LEN - 1)
+    *len = MAX_TIMING_LINE_LEN - 1;
+}
+
+static void timing_append_string(char* line, size_t* len, const char* s)
+{
+  timing_append(line, len, "\"");
+  for(; *s; ++s)
+  {
+    if(*s == '"' || *s == '\\')
+      timing_append(line, len, "\\%c", *s);
+    else if((unsigned char)*s < 0x20)
+      timing_append(line, len, "\\u%04x", *s);
+    else
+      timing_append(line, len, "%c", *s);
+  }
+  timing_append(line, len, "\"");
+}
+
+/* writes the spans of the current request as a single line to stderr and starts a new request */
+void jst_timing_report(const char* script)
+{
+  char line[MAX_TIMING_LINE_LEN + 1];
+  size_t len = 0;
+  uint64_t now;
+  uint64_t end;
+  int i;
+
+  if(!g_timing_enabled)
+    return;
+
+  now = timing_now();
+
+  timing_append(line, &len, "jst_timing {\"pid\":%d,\"script\":", (int)getpid());
+  timing_append_string(line, &len, script ? script : "");
+  timing_append(line, &len, ",\"total_us\":%llu", (unsigned long long)((now - g_timing_origin) / 1000));
+  if(g_timing_dropped)
+    timing_append(line, &len, ",\"dropped\":%d", g_timing_dropped);
+  timing_append(line, &len, ",\"phases\":[");
+  for(i = 0; i < g_timing_count; ++i)
+  {
+    timing_span* span = &g_timing_spans[i];
+
+    end = span->end ? span->end : now;
+    timing_append(line, &len, "%s{\"phase\":", i ? "," : "");
+    timing_append_string(line, &len, span->phase);
+    if(span->detail[0])
+    {
+      timing_append(line, &len, ",\"detail\":");
+      timing_append_string(line, &len, span->detail);
+    }
+    timing_append(line, &len, ",\"start_us\":%llu,\"us\":%llu}",
+      (unsigned long long)((span->start - g_timing_origin) / 1000),
+      (unsigned long long)((end - span->start) / 1000));
+  }
+  timing_append(line, &len, "]}");
+
+  /* a line which did not fit was cut short, it still ends with a newline */
+  line[len++] = '\n';
+
+  /* one write so lines from concurrent processes sharing stderr don't interleave */
+  if(write(STDERR_FILENO, line, len) < 0)
+    fprintf(stderr, "jst_timing: failed to write report\n");
+
+  jst_timing_start();
+}
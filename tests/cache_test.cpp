@@ -0,0 +1,186 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "gtest/gtest.h"
+#include <string>
+#include <fstream>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "jst.h"
+
+using namespace std;
+
+/* built with JST_CACHE_DIR "./cache" and TEMPL_PATH "./", so the cache, the prefix/suffix and the
+   pages are all in a temp dir the tests run in. the cache dir is looked at once per process,
+   so it is made before any test runs */
+
+static void write_file(const string& path, const string& content)
+{
+  std::ofstream f(path.c_str());
+  f << content;
+}
+
+/* a distinct mtime each time, a change within the timestamp granularity would go unnoticed */
+static void set_mtime(const string& path)
+{
+  static time_t next = 1000000000;
+  struct timespec times[2];
+
+  times[0].tv_sec = times[1].tv_sec = next++;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+}
+
+class CacheDir : public ::testing::Environment
+{
+public:
+  virtual void SetUp()
+  {
+    char dir[] = "/tmp/jst_cacheXXXXXX";
+
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    ASSERT_EQ(chdir(dir), 0);
+    ASSERT_EQ(mkdir("cache", 0700), 0);
+    ASSERT_EQ(mkdir("include", 0700), 0);
+    write_file("jst_prefix.js", "/* JST_PRELUDE_VERSION 2: cache test prefix */\ntry\n{\n");
+    write_file("jst_suffix.js", "}\ncatch(err)\n{\n}\n");
+  }
+
+  virtual void TearDown()
+  {
+    string cmd = "rm -rf " + dir_;
+    if(system(cmd.c_str()) != 0)
+      fprintf(stderr, "failed to remove %s\n", dir_.c_str());
+  }
+
+  string dir_;
+};
+
+static ::testing::Environment* const g_cache_dir = ::testing::AddGlobalTestEnvironment(new CacheDir);
+
+/* the entry file of a page, as jst_cache.c names it after the 64 bit FNV-1a of its key */
+static string entry_path(const string& name)
+{
+  char cwd[PATH_MAX];
+  char path[64];
+  uint64_t h = 0xcbf29ce484222325ULL;
+  string key;
+  size_t i;
+
+  if(!getcwd(cwd, sizeof(cwd)))
+    return "";
+  key = string(cwd) + "/" + name;
+  for(i = 0; i < key.length(); ++i)
+  {
+    h ^= (unsigned char)key[i];
+    h *= 0x100000001b3ULL;
+  }
+  snprintf(path, sizeof(path), "cache/%016llx.jbc", (unsigned long long)h);
+  return path;
+}
+
+/* parses the page and stores the result as its bytecode, as jst does after compiling it */
+static string store(const string& name)
+{
+  char* buf;
+  size_t len;
+  string code;
+
+  if(!load_template_file(name.c_str(), &buf, &len, 1))
+    return "";
+  code.assign(buf, len);
+  if(!store_template_cached(buf, len))
+    code.clear();
+  free(buf);
+  return code;
+}
+
+/* 1 if the page was a hit and gave back the bytecode stored */
+static int cached(const string& name, const string& code)
+{
+  char* buf;
+  size_t len;
+  int rc;
+
+  if(!load_template_cached(name.c_str(), &buf, &len))
+    return 0;
+  rc = string(buf, len) == code;
+  free(buf);
+  return rc;
+}
+
+TEST(cache, invalidation) {
+  string code;
+
+  write_file("page.jst", "<?% include('include/edited.jst'); include('include/missing.jst'); ?>\n<p>page</p>\n");
+  write_file("include/edited.jst", "<p>edited</p>\n");
+
+  code = store("page.jst");
+  ASSERT_FALSE(code.empty());
+  EXPECT_EQ(access(entry_path("page.jst").c_str(), F_OK), 0);
+  EXPECT_EQ(cached("page.jst", code), 1);
+
+  /* each change has to miss, then the page is stored again for the next one */
+  write_file("include/edited.jst", "<p>edited again</p>\n");
+  set_mtime("include/edited.jst");
+  EXPECT_EQ(cached("page.jst", code), 0);
+  code = store("page.jst");
+  ASSERT_FALSE(code.empty());
+  EXPECT_EQ(cached("page.jst", code), 1);
+
+  write_file("include/missing.jst", "<p>not missing any more</p>\n");
+  EXPECT_EQ(cached("page.jst", code), 0);
+  code = store("page.jst");
+  ASSERT_FALSE(code.empty());
+  EXPECT_EQ(cached("page.jst", code), 1);
+
+  set_mtime("page.jst");
+  EXPECT_EQ(cached("page.jst", code), 0);
+  code = store("page.jst");
+  ASSERT_FALSE(code.empty());
+  EXPECT_EQ(cached("page.jst", code), 1);
+}
+
+TEST(cache, key_mismatch) {
+  string code;
+  std::ifstream in;
+  std::ofstream out;
+
+  /* the entry of one page under the name of another, as if their keys hashed the same */
+  write_file("one.jst", "<p>one</p>\n");
+  write_file("two.jst", "<p>two</p>\n");
+  code = store("one.jst");
+  ASSERT_FALSE(code.empty());
+  EXPECT_EQ(cached("one.jst", code), 1);
+
+  in.open(entry_path("one.jst").c_str(), std::ios::binary);
+  ASSERT_TRUE(in.is_open());
+  out.open(entry_path("two.jst").c_str(), std::ios::binary);
+  out << in.rdbuf();
+  out.close();
+  ASSERT_EQ(chmod(entry_path("two.jst").c_str(), 0600), 0);
+
+  EXPECT_EQ(cached("two.jst", code), 0);
+  EXPECT_EQ(cached("one.jst", code), 1);
+}
@@ -0,0 +1,177 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "jst_test_util.h"
+#include <string>
+
+using namespace std;
+
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+
+/* prints what a request can see of its own and of the previous request's state */
+static const char* g_script =
+  "ccsp_output.echo('query=' + ccsp.getenv('QUERY_STRING') + '\\n');\n"
+  "ccsp_output.echo('post=' + ccsp_post.getPost() + '\\n');\n"
+  "ccsp_output.echo('global=' + typeof leaked + '\\n');\n"
+  "ccsp_output.echo('var=' + typeof kept + '\\n');\n"
+  "leaked = 1;\n"
+  "var kept = 1;\n"
+  "ccsp_output.finish();\n";
+
+static string record(unsigned char type, unsigned short id, const string& content, unsigned char padding = 0)
+{
+  string r;
+  r += (char)1;
+  r += (char)type;
+  r += (char)(id >> 8);
+  r += (char)(id & 0xff);
+  r += (char)(content.length() >> 8);
+  r += (char)(content.length() & 0xff);
+  r += (char)padding;
+  r += (char)0;
+  r += content;
+  r.append(padding, '\0');
+  return r;
+}
+
+static string begin_request(unsigned short id, bool keep_conn)
+{
+  string body(8, '\0');
+  body[1] = 1; /* FCGI_RESPONDER */
+  body[2] = keep_conn ? 1 : 0;
+  return record(FCGI_BEGIN_REQUEST, id, body);
+}
+
+/* names and values used here are all short enough for the one byte length form */
+static string name_value(const string& name, const string& value)
+{
+  return string(1, (char)name.length()) + string(1, (char)value.length()) + name + value;
+}
+
+class FastcgiWorker : public ServerTest
+{
+protected:
+  virtual void SetUp()
+  {
+    ASSERT_NO_FATAL_FAILURE(ServerTest::SetUp());
+    script_ = dir_ + "/page.js";
+    write_file(script_, g_script);
+    ASSERT_NO_FATAL_FAILURE(start_server());
+    ASSERT_NO_FATAL_FAILURE(connect_server());
+  }
+
+  virtual int run_server(duk_context* ctx)
+  {
+    return jst_fastcgi_run(ctx, socket_.c_str(), run_script, 0);
+  }
+
+  /* collects the stdout stream of request id up to its end request record */
+  bool response(unsigned short id, string& out)
+  {
+    string header;
+    string content;
+
+    out.clear();
+    while(take(8, header))
+    {
+      unsigned short rid = ((unsigned char)header[2] << 8) | (unsigned char)header[3];
+      size_t content_len = ((unsigned char)header[4] << 8) | (unsigned char)header[5];
+
+      if(!take(content_len + (unsigned char)header[6], content))
+        return false;
+      if(rid != id)
+        continue;
+      if(header[1] == FCGI_STDOUT)
+        out.append(content, 0, content_len);
+      else if(header[1] == FCGI_END_REQUEST)
+        return content_len == 8 && content[4] == 0;
+    }
+    return false;
+  }
+
+  string params(const string& method, const string& query)
+  {
+    return name_value("SCRIPT_FILENAME", script_) +
+           name_value("REQUEST_METHOD", method) +
+           name_value("QUERY_STRING", query);
+  }
+
+  string script_;
+};
+
+TEST_F(FastcgiWorker, ParamsSplitAcrossRecords) {
+  string p = params("GET", "a=split");
+  string out;
+
+  /* split inside the SCRIPT_FILENAME name and again inside the query value, with padding */
+  send(begin_request(1, false));
+  send(record(FCGI_PARAMS, 1, p.substr(0, 5), 3));
+  send(record(FCGI_PARAMS, 1, p.substr(5, p.length() - 8)));
+  send(record(FCGI_PARAMS, 1, p.substr(p.length() - 3), 5));
+  send(record(FCGI_PARAMS, 1, ""));
+  send(record(FCGI_STDIN, 1, ""));
+
+  ASSERT_TRUE(response(1, out));
+  EXPECT_NE(out.find("query=a=split\n"), string::npos) << out;
+}
+
+TEST_F(FastcgiWorker, EmptyStdin) {
+  string out;
+
+  /* the only stdin record is the empty one which ends the stream */
+  send(begin_request(1, false));
+  send(record(FCGI_PARAMS, 1, params("GET", "")));
+  send(record(FCGI_PARAMS, 1, ""));
+  send(record(FCGI_STDIN, 1, ""));
+
+  ASSERT_TRUE(response(1, out));
+  EXPECT_NE(out.find("post=false\n"), string::npos) << out;
+}
+
+TEST_F(FastcgiWorker, TwoRequestsOneConnection) {
+  string out;
+
+  send(begin_request(1, true));
+  send(record(FCGI_PARAMS, 1, params("POST", "first") +
+                              name_value("CONTENT_LENGTH", "7") +
+                              name_value("CONTENT_TYPE", "application/x-www-form-urlencoded")));
+  send(record(FCGI_PARAMS, 1, ""));
+  send(record(FCGI_STDIN, 1, "a=first", 1));
+  send(record(FCGI_STDIN, 1, ""));
+
+  ASSERT_TRUE(response(1, out));
+  EXPECT_NE(out.find("query=first\n"), string::npos) << out;
+  EXPECT_NE(out.find("post=a=first\n"), string::npos) << out;
+  EXPECT_NE(out.find("global=undefined\n"), string::npos) << out;
+
+  /* neither the post data, the params nor the globals of the first request may be seen */
+  send(begin_request(2, false));
+  send(record(FCGI_PARAMS, 2, params("GET", "second")));
+  send(record(FCGI_PARAMS, 2, ""));
+  send(record(FCGI_STDIN, 2, ""));
+
+  ASSERT_TRUE(response(2, out));
+  EXPECT_NE(out.find("query=second\n"), string::npos) << out;
+  EXPECT_NE(out.find("post=false\n"), string::npos) << out;
+  EXPECT_NE(out.find("global=undefined\n"), string::npos) << out;
+  EXPECT_NE(out.find("var=undefined\n"), string::npos) << out;
+}
@@ -0,0 +1,304 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "jst_test_util.h"
+#include <string>
+#include <map>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/* the test build sets this way down from the 15s of jst_http.c */
+#ifndef HTTP_KEEPALIVE_TIMEOUT
+#define HTTP_KEEPALIVE_TIMEOUT 15
+#endif
+
+#define BIG_LEN (1024 * 1024)
+
+struct http_response
+{
+  int status;
+  map<string, string> headers; /* names lower cased */
+  string body;
+
+  bool has(const string& name) const
+  {
+    return headers.find(name) != headers.end();
+  }
+};
+
+class HttpServer : public ServerTest
+{
+protected:
+  virtual void SetUp()
+  {
+    ASSERT_NO_FATAL_FAILURE(ServerTest::SetUp());
+    root_ = dir_ + "/root";
+    ASSERT_EQ(mkdir(root_.c_str(), 0700), 0);
+    ASSERT_EQ(mkdir((root_ + "/sub").c_str(), 0700), 0);
+
+    /* outside the root, must never be served */
+    write_file(dir_ + "/secret.txt", "secret\n");
+    write_file(root_ + "/static.txt", "static\n");
+    write_file(root_ + "/flush.jst",
+      "ccsp_output.echo('first');\n"
+      "ccsp_output.flush();\n"
+      "ccsp_output.echo('second');\n"
+      "ccsp_output.finish();\n");
+    write_file(root_ + "/notmod.jst",
+      "ccsp_output.header('Status: 304 Not Modified');\n"
+      "ccsp_output.echo('no body for a 304');\n"
+      "ccsp_output.finish();\n");
+
+    /* both much larger than a socket buffer, so they take as long to send as the client takes */
+    write_file(root_ + "/big.txt", string(BIG_LEN, 'b'));
+    write_file(root_ + "/post.jst",
+      "ccsp_output.echo('post ' + ccsp_post.getPost().length);\n"
+      "ccsp_output.finish();\n");
+    write_file(root_ + "/slow.jst",
+      "ccsp.sleep(" + to_string(HTTP_KEEPALIVE_TIMEOUT + 2) + ");\n"
+      "var s = 'x';\n"
+      "while(s.length < " + to_string(BIG_LEN) + ")\n"
+      "  s += s;\n"
+      "ccsp_output.echo(s.substr(0, " + to_string(BIG_LEN) + "));\n"
+      "ccsp_output.finish();\n");
+
+    ASSERT_NO_FATAL_FAILURE(start_server());
+    ASSERT_NO_FATAL_FAILURE(connect_server());
+  }
+
+  virtual int run_server(duk_context* ctx)
+  {
+    return jst_http_run(ctx, socket_.c_str(), root_.c_str(), run_script);
+  }
+
+  bool take_line(string& line)
+  {
+    size_t eol;
+    while((eol = in_.find("\r\n")) == string::npos)
+      if(!fill())
+        return false;
+    if(!take(eol + 2, line))
+      return false;
+    line.resize(eol);
+    return true;
+  }
+
+  /* reads one response, framed by its own headers only, so anything the server sends
+     beyond what they announce shows up at the start of the next response */
+  bool response(http_response& res)
+  {
+    string line;
+    size_t sp;
+
+    res = http_response();
+    if(!take_line(line) || line.compare(0, 9, "HTTP/1.1 ") != 0)
+      return false;
+    res.status = atoi(line.c_str() + 9);
+
+    while(take_line(line) && !line.empty())
+    {
+      size_t colon = line.find(':');
+      string name = line.substr(0, colon);
+      for(sp = 0; sp < name.length(); ++sp)
+        name[sp] = tolower(name[sp]);
+      res.headers[name] = line.substr(line.find_first_not_of(' ', colon + 1));
+    }
+
+    if(res.status == 304 || res.status < 200)
+      return true;
+
+    if(res.has("transfer-encoding"))
+    {
+      for(;;)
+      {
+        string chunk;
+        size_t len;
+        if(!take_line(line))
+          return false;
+        len = strtoul(line.c_str(), NULL, 16);
+        if(!take(len, chunk) || !take_line(line) || !line.empty())
+          return false;
+        if(len == 0)
+          return true;
+        res.body += chunk;
+      }
+    }
+
+    if(res.has("content-length"))
+      return take(strtoul(res.headers["content-length"].c_str(), NULL, 10), res.body);
+
+    while(fill())
+      ;
+    res.body = in_;
+    in_.clear();
+    return true;
+  }
+
+  int get_status(const string& target)
+  {
+    http_response res;
+    send("GET " + target + " HTTP/1.1\r\nHost: test\r\n\r\n");
+    return response(res) ? res.status : -1;
+  }
+
+  string root_;
+};
+
+TEST_F(HttpServer, DecodePath) {
+  http_response res;
+
+  send("GET /static.txt HTTP/1.1\r\nHost: test\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "static\n");
+
+  /* all on one connection, a 400 keeps it open */
+  EXPECT_EQ(get_status("/../secret.txt"), 400);
+  EXPECT_EQ(get_status("/%2e%2e/secret.txt"), 400);
+  EXPECT_EQ(get_status("/%2E%2E/secret.txt"), 400);
+  EXPECT_EQ(get_status("/sub/%2e%2e/%2e%2e/secret.txt"), 400);
+  EXPECT_EQ(get_status("/sub/.."), 400);
+  EXPECT_EQ(get_status("/sub/%2e%2e"), 400);
+  EXPECT_EQ(get_status("/static.txt%00"), 400);
+  EXPECT_EQ(get_status("/static.txt%2"), 400);
+  EXPECT_EQ(get_status("static.txt"), 400);
+
+  /* a . or .. which is only part of a name is fine */
+  EXPECT_EQ(get_status("/sub/..static.txt"), 404);
+  EXPECT_EQ(get_status("/sub/./../static.txt"), 400);
+  EXPECT_EQ(get_status("/./static.txt?x=/../"), 200);
+}
+
+TEST_F(HttpServer, HeaderLimit) {
+  http_response res;
+
+  /* no end of the headers in sight after more than HTTP_MAX_HEADER_LEN */
+  send("GET /static.txt HTTP/1.1\r\nX-Big: " + string(17000, 'a'));
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 431);
+  EXPECT_EQ(res.headers["connection"], "close");
+
+  connect_server();
+  send("GET /static.txt HTTP/1.1\r\nX-Big: " + string(16000, 'a') + "\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+}
+
+TEST_F(HttpServer, BodyLimit) {
+  http_response res;
+
+  send("POST /flush.jst HTTP/1.1\r\nContent-Length: 16777217\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 413);
+  EXPECT_EQ(res.headers["connection"], "close");
+
+  connect_server();
+  send("POST /flush.jst HTTP/1.1\r\nContent-Length: 12x\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 400);
+
+  connect_server();
+  send("POST /flush.jst HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 501);
+}
+
+TEST_F(HttpServer, BodyReadOverManyEvents) {
+  http_response res;
+
+  /* far more than is read for a connection at a time */
+  send("POST /post.jst HTTP/1.1\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(BIG_LEN) + "\r\n\r\n" +
+       string(BIG_LEN, 'p'));
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "post " + to_string(BIG_LEN) + "\n");
+}
+
+TEST_F(HttpServer, ChunkedFlushHttp11) {
+  http_response res;
+
+  send("GET /flush.jst HTTP/1.1\r\nHost: test\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.headers["transfer-encoding"], "chunked");
+  EXPECT_FALSE(res.has("content-length"));
+  EXPECT_EQ(res.body, "firstsecond\n");
+
+  /* the terminating chunk ended the response, the connection is still usable */
+  EXPECT_EQ(get_status("/static.txt"), 200);
+}
+
+TEST_F(HttpServer, FlushHttp10) {
+  http_response res;
+
+  /* an HTTP/1.0 client can't take chunks and gets it all at the end */
+  send("GET /flush.jst HTTP/1.0\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_FALSE(res.has("transfer-encoding"));
+  EXPECT_EQ(res.headers["connection"], "close");
+  EXPECT_EQ(res.body, "firstsecond\n");
+}
+
+TEST_F(HttpServer, NotModifiedHasNoBody) {
+  http_response res;
+
+  send("GET /notmod.jst HTTP/1.1\r\nHost: test\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 304);
+  EXPECT_FALSE(res.has("content-length"));
+  EXPECT_FALSE(res.has("transfer-encoding"));
+
+  /* a body after the 304 would be read as the start of this response */
+  send("GET /static.txt HTTP/1.1\r\nHost: test\r\n\r\n");
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "static\n");
+}
+
+TEST_F(HttpServer, SlowClientGetsWholeResponse) {
+  http_response res;
+
+  /* takes about three times the keep-alive timeout to read it all */
+  send("GET /big.txt HTTP/1.1\r\nHost: test\r\n\r\n");
+  while(in_.length() < BIG_LEN)
+  {
+    usleep(HTTP_KEEPALIVE_TIMEOUT * 3 * 1000000 / (BIG_LEN / 16384));
+    ASSERT_TRUE(fill()) << "closed after " << in_.length() << " bytes";
+  }
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body.length(), (size_t)BIG_LEN);
+}
+
+TEST_F(HttpServer, SlowPageGetsWholeResponse) {
+  http_response res;
+
+  /* the page runs for longer than the keep-alive timeout and its output
+     still has to go out after it is done */
+  send("GET /slow.jst HTTP/1.1\r\nHost: test\r\n\r\n");
+  while(in_.length() < BIG_LEN)
+    ASSERT_TRUE(fill()) << "closed after " << in_.length() << " bytes";
+  ASSERT_TRUE(response(res));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body.length(), (size_t)BIG_LEN + 1);
+}
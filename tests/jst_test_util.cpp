@@ -0,0 +1,160 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "jst_test_util.h"
+#include <fstream>
+#include <streambuf>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* normally defined by duk_cmdline.c */
+extern "C" const char* jst_debug_file_name;
+const char* jst_debug_file_name = NULL;
+
+int run_script(duk_context* ctx, const char* filename)
+{
+  std::ifstream fscript(filename);
+  std::string code((std::istreambuf_iterator<char>(fscript)), std::istreambuf_iterator<char>());
+  int rc;
+
+  ccsp_extensions_request_begin(ctx);
+  rc = duk_peval_lstring_noresult(ctx, code.c_str(), code.length());
+  ccsp_extensions_request_end(ctx);
+  return rc;
+}
+
+void write_file(const string& path, const string& content)
+{
+  std::ofstream f(path.c_str());
+  f << content;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw)
+{
+  (void)sb;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+void remove_tree(const string& path)
+{
+  nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+void ServerTest::SetUp()
+{
+  char dir[] = "/tmp/jst_testXXXXXX";
+
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  dir_ = dir;
+  socket_ = dir_ + "/sock";
+}
+
+void ServerTest::TearDown()
+{
+  if(fd_ >= 0)
+    close(fd_);
+  if(server_ > 0)
+  {
+    kill(server_, SIGTERM);
+    waitpid(server_, NULL, 0);
+  }
+  if(!dir_.empty())
+    remove_tree(dir_);
+}
+
+void ServerTest::start_server()
+{
+  server_ = fork();
+  ASSERT_GE(server_, 0);
+  if(server_ == 0)
+  {
+    duk_context* ctx = duk_create_heap_default();
+    ccsp_extensions_load(ctx);
+    _exit(run_server(ctx) == 0 ? 0 : 1);
+  }
+}
+
+void ServerTest::connect_server()
+{
+  struct sockaddr_un sun;
+  struct timeval tv;
+  int i;
+
+  if(fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+  in_.clear();
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, socket_.c_str());
+
+  /* the server binds the socket after the fork, give it a moment */
+  for(i = 0; i < 200; ++i)
+  {
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd_, 0);
+    if(connect(fd_, (struct sockaddr*)&sun, sizeof(sun)) == 0)
+      break;
+    close(fd_);
+    fd_ = -1;
+    usleep(10000);
+  }
+  ASSERT_GE(fd_, 0);
+
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+void ServerTest::send(const string& data)
+{
+  ASSERT_EQ(write(fd_, data.c_str(), data.length()), (ssize_t)data.length());
+}
+
+bool ServerTest::fill()
+{
+  char buf[16384];
+  ssize_t n = read(fd_, buf, sizeof(buf));
+  if(n <= 0)
+    return false;
+  in_.append(buf, n);
+  return true;
+}
+
+bool ServerTest::take(size_t len, string& out)
+{
+  while(in_.length() < len)
+    if(!fill())
+      return false;
+  out = in_.substr(0, len);
+  in_.erase(0, len);
+  return true;
+}
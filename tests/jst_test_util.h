@@ -0,0 +1,63 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#ifndef JST_TEST_UTIL_H
+#define JST_TEST_UTIL_H
+
+#include "gtest/gtest.h"
+#include <string>
+#include <sys/types.h>
+#include "jst.h"
+
+/* runs the page as plain javascript, between the same request_begin/end calls jst makes */
+int run_script(duk_context* ctx, const char* filename);
+
+void write_file(const std::string& path, const std::string& content);
+
+/* removes path and everything below it */
+void remove_tree(const std::string& path);
+
+/* a jst server (FastCGI worker or HTTP server) forked off in a fresh heap, listening on a unix
+   socket in a temp dir which is removed again with everything in it.
+   a test's SetUp writes its pages to dir_ and calls start_server and connect_server */
+class ServerTest : public ::testing::Test
+{
+protected:
+  virtual void SetUp();
+  virtual void TearDown();
+
+  /* runs in the forked child, returns what jst_fastcgi_run/jst_http_run returned */
+  virtual int run_server(duk_context* ctx) = 0;
+
+  void start_server();
+  void connect_server();
+  void send(const std::string& data);
+
+  /* reads more of the connection into in_, false once it is closed or times out */
+  bool fill();
+  /* takes the next len bytes of the connection */
+  bool take(size_t len, std::string& out);
+
+  std::string dir_;
+  std::string socket_;
+  std::string in_;
+  pid_t server_ = -1;
+  int fd_ = -1;
+};
+
+#endif
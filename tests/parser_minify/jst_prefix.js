@@ -0,0 +1,3 @@
+/* test prefix for the JST_MINIFY_HTML build */
+try
+{
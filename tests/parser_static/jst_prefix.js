@@ -0,0 +1,3 @@
+/* JST_PRELUDE_VERSION 2: test prefix, the content of the pages is written as __jst_static(n) */
+try
+{
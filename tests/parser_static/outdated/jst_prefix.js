@@ -0,0 +1,3 @@
+/* test prefix from before the static blocks, the content of the pages is written with echo() */
+try
+{
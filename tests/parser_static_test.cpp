@@ -0,0 +1,174 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "gtest/gtest.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <streambuf>
+#include "jst.h"
+extern "C" {
+#include "jst_internal.h"
+}
+#include <dirent.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+/* built with TEMPL_PATH "./", so the prefix and suffix are the ones in the directory the test
+   runs in. in tests/parser_static they have the JST_PRELUDE_VERSION marker, in
+   tests/parser_static/outdated they don't and the content has to be written with echo() */
+
+static string read_golden(const string& path)
+{
+  std::ifstream f(path.c_str());
+  return string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+/* the parsed page followed by the static blocks of the request, as in the .static goldens */
+static string parsed_with_blocks(const char* code, size_t len)
+{
+  string out(code, len);
+  const char* data;
+  size_t n;
+  uint32_t i;
+
+  for(i = 0; template_static_block(i, &data, &n); ++i)
+    out += "\n--- static block " + to_string(i) + " ---\n" + string(data, n);
+  return out;
+}
+
+/* the image stored with the bytecode in the cache and the bundle must hold the same blocks, their
+   crc32s and, for the longer ones, a raw deflate of each which inflates back to the block */
+static void check_static_image(const string& file, const char* code, size_t code_len)
+{
+  char* image;
+  size_t image_len;
+  uint32_t hdr[4];
+  const uint32_t* ends;
+  const uint32_t* deflated_ends;
+  const uint32_t* crcs;
+  const char* data;
+  const char* deflated;
+  size_t size;
+  uint32_t i;
+
+  SCOPED_TRACE(file);
+  ASSERT_NE(template_static_image(code, code_len, &image, &image_len), 0);
+
+  memcpy(hdr, image, sizeof(hdr));
+  ends = (const uint32_t*)(image + sizeof(hdr));
+  deflated_ends = ends + hdr[0];
+  crcs = deflated_ends + hdr[0];
+  data = (const char*)(crcs + hdr[0]);
+  deflated = data + hdr[1];
+  size = (sizeof(hdr) + 3 * hdr[0] * sizeof(uint32_t) + hdr[1] + hdr[2] + 7) & ~(size_t)7;
+
+  ASSERT_EQ(hdr[3], 0u);
+  ASSERT_LE(size, image_len);
+  EXPECT_EQ(string(image + size, image_len - size), string(code, code_len));
+
+  for(i = 0; i < hdr[0]; ++i)
+  {
+    uint32_t start = i ? ends[i - 1] : 0;
+    uint32_t deflated_start = i ? deflated_ends[i - 1] : 0;
+    const char* block;
+    size_t block_len;
+
+    ASSERT_NE(template_static_block(i, &block, &block_len), 0);
+    ASSERT_EQ(string(data + start, ends[i] - start), string(block, block_len));
+    EXPECT_EQ(crcs[i], (uint32_t)crc32(0, (const Bytef*)block, block_len));
+
+    if(deflated_ends[i] != deflated_start)
+    {
+      vector<char> inflated(block_len + 1);
+      z_stream z;
+
+      memset(&z, 0, sizeof(z));
+      ASSERT_EQ(inflateInit2(&z, -MAX_WBITS), Z_OK);
+      z.next_in = (Bytef*)(deflated + deflated_start);
+      z.avail_in = deflated_ends[i] - deflated_start;
+      z.next_out = (Bytef*)&inflated[0];
+      z.avail_out = inflated.size();
+      inflate(&z, Z_SYNC_FLUSH);
+      EXPECT_EQ(z.avail_in, 0u);
+      EXPECT_EQ(string(&inflated[0], z.total_out), string(block, block_len));
+      inflateEnd(&z);
+    }
+  }
+  EXPECT_EQ(template_static_block(hdr[0], &data, &size), 0);
+  free(image);
+}
+
+TEST(static_blocks, parser) {
+  vector<string> files;
+  struct dirent* ent;
+  DIR* dir;
+  char* buf;
+  size_t len;
+
+  dir = opendir(".");
+  ASSERT_TRUE(dir != NULL);
+  while((ent = readdir(dir)) != NULL)
+  {
+    string file = ent->d_name;
+    if(file.length() > 4 && file.substr(file.length() - 4) == ".jst" && access((file + ".static").c_str(), F_OK) == 0)
+      files.push_back(file);
+  }
+  closedir(dir);
+  ASSERT_FALSE(files.empty());
+
+  template_set_static_blocks(1);
+  for(auto file: files) {
+    fprintf(stderr, "\n\n%s\n", file.c_str());
+    ASSERT_NE(load_template_file(file.c_str(), &buf, &len, 1), 0);
+    EXPECT_EQ(parsed_with_blocks(buf, len), read_golden(file + ".static"));
+    check_static_image(file, buf, len);
+    free(buf);
+  }
+  template_set_static_blocks(0);
+}
+
+/* the page loaded with an outdated prefix, 0 if it is parsed as its golden and has no blocks */
+static int parse_outdated(void)
+{
+  const char* data;
+  size_t n;
+  char* buf;
+  size_t len;
+  int rc;
+
+  if(chdir("outdated") != 0)
+    return 2;
+  template_set_static_blocks(1);
+  if(!load_template_file("jst_static_basic.jst", &buf, &len, 1))
+    return 3;
+  rc = string(buf, len) == read_golden("jst_static_basic.jst.parsed") ? 0 : 4;
+  if(template_static_block(0, &data, &n))
+    rc = 5;
+  free(buf);
+  return rc;
+}
+
+TEST(static_blocks, outdated_prelude) {
+  /* the prelude is loaded once per process, so this runs in a fresh one */
+  ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+  EXPECT_EXIT(exit(parse_outdated()), ::testing::ExitedWithCode(0), "has no JST_PRELUDE_VERSION 2");
+}
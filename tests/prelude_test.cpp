@@ -0,0 +1,109 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+#include "gtest/gtest.h"
+#include <string>
+#include <fstream>
+#include <streambuf>
+#include "duktape.h"
+
+using namespace std;
+
+/* built with JSTS_PATH set to the jsts directory of the source tree */
+#ifndef JSTS_PATH
+#define JSTS_PATH "../jsts/"
+#endif
+
+/* stands in for the native objects the prefix uses. the session store counts its saves */
+static const char* g_natives =
+  "var saves = 0;\n"
+  "var stored = '{}';\n"
+  "function getenv(name) { return false; }\n"
+  "var ccsp = { getenv: getenv, timingBegin: function() {}, timingEnd: function() {}, include: function() {} };\n"
+  "var ccsp_output = { header: function() {}, echo: function() {}, finish: function() {} };\n"
+  "var ccsp_post = { getPost: function() { return false; }, getFiles: function() { return false; } };\n"
+  "var ccsp_session = {\n"
+  "  start: function() { return true; },\n"
+  "  create: function() { return true; },\n"
+  "  getId: function() { return 'jst_sesstest'; },\n"
+  "  getStatus: function() { return true; },\n"
+  "  getData: function() { return JSON.parse(stored); },\n"
+  "  setData: function(data) { saves++; stored = JSON.stringify(data); return true; },\n"
+  "  destroy: function() { stored = '{}'; return true; }\n"
+  "};\n";
+
+static string read_file(const string& path)
+{
+  std::ifstream f(path.c_str());
+  return string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+/* runs page between the prefix and suffix, as a request for it would, and returns how often the
+   session was saved and what it held after the last save */
+static int run_page(const string& page, string& stored)
+{
+  string code = string(g_natives) + read_file(JSTS_PATH "jst_prefix.js") + page + "\n" + read_file(JSTS_PATH "jst_suffix.js");
+  duk_context* ctx = duk_create_heap_default();
+  int saves = -1;
+
+  if(duk_peval_lstring_noresult(ctx, code.c_str(), code.length()) == 0)
+  {
+    duk_get_global_string(ctx, "saves");
+    saves = duk_get_int(ctx, -1);
+    duk_get_global_string(ctx, "stored");
+    stored = duk_safe_to_string(ctx, -1);
+  }
+  duk_destroy_heap(ctx);
+  return saves;
+}
+
+TEST(session, saved_once_at_finish) {
+  string stored;
+
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; $_SESSION.b = 2; delete $_SESSION.b;", stored), 1);
+  EXPECT_EQ(stored, "{\"a\":1}");
+
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; exit(0); $_SESSION.b = 2;", stored), 1);
+  EXPECT_EQ(stored, "{\"a\":1}");
+
+  /* nothing changed, nothing to save */
+  EXPECT_EQ(run_page("session_start(); var a = $_SESSION.a;", stored), 0);
+  EXPECT_EQ(run_page("", stored), 0);
+}
+
+TEST(session, saved_on_error) {
+  string stored;
+
+  /* the suffix catches the error, what was changed before it is still saved */
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; undefined_function(); $_SESSION.b = 2;", stored), 1);
+  EXPECT_EQ(stored, "{\"a\":1}");
+}
+
+TEST(session, changes_after_close_dropped) {
+  string stored;
+
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; session_write_close(); $_SESSION.b = 2; delete $_SESSION.a;", stored), 1);
+  EXPECT_EQ(stored, "{\"a\":1}");
+
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; session_write_close(); session_write_close(); $_SESSION.b = 2; undefined_function();", stored), 1);
+  EXPECT_EQ(stored, "{\"a\":1}");
+
+  /* until the session is started again, which reads it back */
+  EXPECT_EQ(run_page("session_start(); $_SESSION.a = 1; session_write_close(); session_start(); $_SESSION.b = 2;", stored), 2);
+  EXPECT_EQ(stored, "{\"a\":1,\"b\":2}");
+}
@@ -0,0 +1,141 @@
+/*
+ If not stated otherwise in this file or this component's Licenses.txt file the
+ following copyright and licenses apply:
+
+ Copyright 2018 RDK Management
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+/* Build time tool which generates a C file embedding the jst prelude files into the jst binary.
+
+   usage: jst_embed output.c [-s name file] [-b name file] ...
+
+     -s  embed the file as is (jst_prefix.js/jst_suffix.js are spliced around each page so must stay source)
+     -b  compile the file (.jst files are run through the template parser first) and embed the bytecode
+
+   The bytecode is only valid for the duktape version and configuration this tool was built with,
+   so it must be built from the same sources and flags as jst itself */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jst.h"
+#include "jst_internal.h"
+
+static void write_array(FILE* out, int index, const unsigned char* data, size_t len)
+{
+  size_t i;
+
+  fprintf(out, "static const unsigned char embedded_%d[] = {", index);
+  for(i = 0; i < len; ++i)
+    fprintf(out, "%s0x%02x,", (i % 16) ? "" : "\n  ", data[i]);
+  fprintf(out, "\n  0x00\n};\n\n");
+}
+
+static int compile_file(duk_context* ctx, const char* name, const char* filename, unsigned char** bufout, size_t* lenout)
+{
+  char* src;
+  size_t srclen;
+  void* bc;
+  duk_size_t bclen;
+
+  if(!load_template_preload(filename, &src, &srclen))
+    return 0;
+
+  duk_push_string(ctx, name);
+  if(duk_pcompile_lstring_filename(ctx, 0, src, srclen) != 0)
+  {
+    fprintf(stderr, "jst_embed: %s: %s\n", filename, duk_safe_to_string(ctx, -1));
+    free(src);
+    return 0;
+  }
+  free(src);
+
+  duk_dump_function(ctx);
+  bc = duk_get_buffer(ctx, -1, &bclen);
+  *bufout = (unsigned char*)malloc(bclen);
+  if(!*bufout)
+    return 0;
+  memcpy(*bufout, bc, bclen);
+  *lenout = bclen;
+  duk_pop(ctx);
+  return 1;
+}
+
+int main(int argc, char* argv[])
+{
+  duk_context* ctx;
+  FILE* out;
+  unsigned char* data;
+  size_t len;
+  int count = 0;
+  int i;
+
+  if(argc < 2 || (argc - 2) % 3 != 0)
+  {
+    fprintf(stderr, "usage: jst_embed output.c [-s name file] [-b name file] ...\n");
+    return 1;
+  }
+
+  ctx = duk_create_heap_default();
+  if(!ctx)
+    return 1;
+
+  out = fopen(argv[1], "w");
+  if(!out)
+  {
+    fprintf(stderr, "jst_embed: cannot open %s\n", argv[1]);
+    return 1;
+  }
+
+  fprintf(out, "/* generated by jst_embed, do not edit */\n");
+  fprintf(out, "#include \"jst_internal.h\"\n\n");
+
+  for(i = 2; i < argc; i += 3)
+  {
+    if(strcmp(argv[i], "-b") == 0)
+    {
+      if(!compile_file(ctx, argv[i+1], argv[i+2], &data, &len))
+        goto error;
+    }
+    else if(strcmp(argv[i], "-s") == 0)
+    {
+      if(!read_file(argv[i+2], (char**)&data, &len))
+        goto error;
+    }
+    else
+    {
+      fprintf(stderr, "jst_embed: unknown option %s\n", argv[i]);
+      goto error;
+    }
+    write_array(out, count++, data, len);
+    free(data);
+  }
+
+  fprintf(out, "const jst_embedded_file jst_embedded_files[] = {\n");
+  for(i = 2, count = 0; i < argc; i += 3, count++)
+    fprintf(out, "  { \"%s\", embedded_%d, sizeof(embedded_%d) - 1, %d },\n",
+      argv[i+1], count, count, strcmp(argv[i], "-b") == 0);
+  fprintf(out, "  { 0, 0, 0, 0 }\n};\n");
+
+  fclose(out);
+  duk_destroy_heap(ctx);
+  return 0;
+
+error:
+  fclose(out);
+  remove(argv[1]);
+  duk_destroy_heap(ctx);
+  return 1;
+}
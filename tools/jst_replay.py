@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+#
+# If not stated otherwise in this file or this component's Licenses.txt file the
+# following copyright and licenses apply:
+#
+# Copyright 2018 RDK Management
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Replays requests captured by jst (see source/jst_capture.c) and reports throughput,
+# latency percentiles and peak RSS, e.g. to compare two builds on real web ui traffic.
+#
+# Capture on the device by touching /tmp/jst_enable_capture (the corpus is written to
+# /tmp/jst_capture.jcr), copy the corpus off and replay it:
+#
+#   jst_replay.py corpus.jcr --list
+#   jst_replay.py corpus.jcr --jst build/jst --root /path/to/www -c 4 -n 10
+#   jst_replay.py corpus.jcr --http 127.0.0.1:8080 --pid <server pid> -c 4
+#
+# By default each request is run as a cgi, i.e. a jst process per request with the captured
+# environment and post body. --root maps the document root the requests were captured under
+# onto a local copy of the web ui. With --http the requests are sent to a running server
+# (jst --serve, or lighttpd in front of jst) instead, and --pid names the process whose
+# peak RSS is reported.
+
+import argparse
+import concurrent.futures
+import http.client
+import os
+import statistics
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+MAGIC = b'JSTQ'
+
+
+class Request(object):
+    def __init__(self, cwd, argv, env, body):
+        self.cwd = cwd
+        self.argv = argv
+        self.env = env
+        self.body = body
+
+    def script(self):
+        return self.env.get('SCRIPT_NAME') or (self.argv[1] if len(self.argv) > 1 else '?')
+
+
+def read_corpus(path):
+    requests = []
+    with open(path, 'rb') as f:
+        data = f.read()
+    pos = 0
+    while pos < len(data):
+        if data[pos:pos + 4] != MAGIC:
+            sys.exit('%s: bad record at offset %d' % (path, pos))
+        length, = struct.unpack_from('<I', data, pos + 4)
+        end = pos + 8 + length
+        if end > len(data):
+            print('%s: ignoring truncated record at offset %d' % (path, pos), file=sys.stderr)
+            break
+        argc, envc, body_len = struct.unpack_from('<III', data, pos + 8)
+        cur = pos + 20
+
+        def string():
+            nonlocal cur
+            n, = struct.unpack_from('<I', data, cur)
+            s = data[cur + 4:cur + 4 + n].decode('utf-8', 'surrogateescape')
+            cur += 4 + n
+            return s
+
+        cwd = string()
+        argv = [string() for _ in range(argc)]
+        env = {}
+        for _ in range(envc):
+            name, _, value = string().partition('=')
+            env[name] = value
+        body = data[cur:cur + body_len]
+        requests.append(Request(cwd, argv, env, body))
+        pos = end
+    return requests
+
+
+def captured_root(req):
+    # the same way jst works out the document root of a cgi request
+    filename = req.env.get('SCRIPT_FILENAME', '')
+    name = req.env.get('SCRIPT_NAME', '').lstrip('/')
+    if name and filename.endswith(name):
+        return filename[:len(filename) - len(name)]
+    return None
+
+
+def remap(req, root):
+    old = captured_root(req)
+    if not old:
+        return req
+    new = root.rstrip('/') + '/'
+
+    def fix(s):
+        if s + '/' == old:
+            return new.rstrip('/')
+        return new + s[len(old):] if s.startswith(old) else s
+
+    env = dict((k, fix(v)) for k, v in req.env.items())
+    argv = [fix(a) for a in req.argv]
+    cwd = fix(req.cwd)
+    if not os.path.isdir(cwd):
+        cwd = new
+    return Request(cwd, argv, env, req.body)
+
+
+def run_cgi(jst, req):
+    env = dict(req.env)
+    start = time.perf_counter()
+    proc = subprocess.Popen([jst] + req.argv[1:], cwd=req.cwd, env=env,
+                            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    proc.stdin.write(req.body)
+    proc.stdin.close()
+    out = proc.stdout.read()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    proc.returncode = 0  # reaped above
+    elapsed = time.perf_counter() - start
+    return elapsed, rusage.ru_maxrss, status == 0 and len(out) > 0
+
+
+class HttpClient(object):
+    # one keep-alive connection per worker thread
+    def __init__(self, addr):
+        host, _, port = addr.rpartition(':')
+        self.host = host or '127.0.0.1'
+        self.port = int(port)
+        self.local = threading.local()
+
+    def connection(self):
+        conn = getattr(self.local, 'conn', None)
+        if conn is None:
+            conn = http.client.HTTPConnection(self.host, self.port, timeout=60)
+            self.local.conn = conn
+        return conn
+
+    def run(self, req):
+        env = req.env
+        method = env.get('REQUEST_METHOD', 'GET')
+        target = env.get('REQUEST_URI')
+        if not target:
+            target = env.get('SCRIPT_NAME', '/')
+            if env.get('QUERY_STRING'):
+                target += '?' + env['QUERY_STRING']
+        headers = {}
+        for k, v in env.items():
+            if k.startswith('HTTP_') and k not in ('HTTP_CONNECTION', 'HTTP_CONTENT_LENGTH'):
+                headers[k[5:].replace('_', '-').title()] = v
+        if 'CONTENT_TYPE' in env:
+            headers['Content-Type'] = env['CONTENT_TYPE']
+        start = time.perf_counter()
+        try:
+            conn = self.connection()
+            conn.request(method, target, body=req.body if req.body else None, headers=headers)
+            resp = conn.getresponse()
+            resp.read()
+            ok = resp.status < 500
+        except (OSError, http.client.HTTPException):
+            self.local.conn = None
+            ok = False
+        return time.perf_counter() - start, 0, ok
+
+
+def peak_rss_kb(pid):
+    try:
+        with open('/proc/%d/status' % pid) as f:
+            for line in f:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='replay captured jst requests')
+    parser.add_argument('corpus', help='corpus written by jst request capture')
+    parser.add_argument('--list', action='store_true', help='list the requests in the corpus and exit')
+    parser.add_argument('--jst', help='jst binary to run each request with as a cgi')
+    parser.add_argument('--root', help='local document root to map the captured one onto')
+    parser.add_argument('--http', metavar='HOST:PORT', help='send the requests to a running server instead')
+    parser.add_argument('--pid', type=int, help='with --http, server process to report the peak RSS of')
+    parser.add_argument('-c', '--concurrency', type=int, default=1, help='requests in flight at once')
+    parser.add_argument('-n', '--repeat', type=int, default=1, help='times to replay the corpus')
+    args = parser.parse_args()
+
+    requests = read_corpus(args.corpus)
+    if args.list:
+        for i, req in enumerate(requests):
+            print('%4d %-6s %-40s body=%d' % (i, req.env.get('REQUEST_METHOD', '?'), req.script(), len(req.body)))
+        return
+    if not requests:
+        sys.exit('no requests in %s' % args.corpus)
+    if bool(args.jst) == bool(args.http):
+        sys.exit('exactly one of --jst or --http is needed')
+
+    if args.root:
+        requests = [remap(req, args.root) for req in requests]
+
+    if args.jst:
+        jst = os.path.abspath(args.jst)
+        run = lambda req: run_cgi(jst, req)
+    else:
+        client = HttpClient(args.http)
+        run = client.run
+
+    run(requests[0])  # warm up
+    work = requests * args.repeat
+    times = []
+    rss = 0
+    failed = 0
+    start = time.perf_counter()
+    with concurrent.futures.ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        for elapsed, kb, ok in pool.map(run, work):
+            times.append(elapsed * 1000.0)
+            rss = max(rss, kb)
+            failed += not ok
+    wall = time.perf_counter() - start
+    if args.pid:
+        rss = peak_rss_kb(args.pid)
+
+    times.sort()
+    print('requests     %d (%d failed), concurrency %d' % (len(times), failed, args.concurrency))
+    print('throughput   %.1f req/s' % (len(times) / wall))
+    print('latency ms   mean %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f' % (
+        statistics.mean(times), percentile(times, 0.50), percentile(times, 0.95),
+        percentile(times, 0.99), times[-1]))
+    print('peak rss     %s' % ('%d kB' % rss if rss else 'unknown (use --pid with --http)'))
+
+
+if __name__ == '__main__':
+    main()
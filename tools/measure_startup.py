@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+#
+# If not stated otherwise in this file or this component's Licenses.txt file the
+# following copyright and licenses apply:
+#
+# Copyright 2018 RDK Management
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Measures per request startup time and peak RSS of one or more jst binaries
+# running a page the way the web server runs it in cgi mode, e.g. to compare
+# the default build against a JST_ROM_BUILTINS build:
+#
+#   measure_startup.py --root /www --page index.jst build/jst build-rom/jst
+#
+# With no --page an empty script is run, which measures heap creation alone.
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run_once(jst, root, page):
+    env = dict(os.environ)
+    env.update({
+        'GATEWAY_INTERFACE': 'CGI/1.1',
+        'REQUEST_METHOD': 'GET',
+        'SCRIPT_FILENAME': os.path.join(root, page),
+        'SCRIPT_NAME': '/' + page,
+    })
+    start = time.perf_counter()
+    proc = subprocess.Popen([jst, page], cwd=root, env=env,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    if status != 0:
+        sys.exit('%s exited with status %d' % (jst, status))
+    return elapsed * 1000.0, rusage.ru_maxrss
+
+
+def main():
+    parser = argparse.ArgumentParser(description='measure jst per request startup time and RSS')
+    parser.add_argument('binaries', nargs='+', help='jst binaries to compare')
+    parser.add_argument('--root', help='document root the page lives in')
+    parser.add_argument('--page', help='page relative to the root (default: an empty script)')
+    parser.add_argument('-n', type=int, default=200, help='requests per binary')
+    args = parser.parse_args()
+
+    tmp = None
+    if args.page:
+        root, page = args.root or os.getcwd(), args.page
+    else:
+        tmp = tempfile.TemporaryDirectory()
+        root, page = tmp.name, 'empty.js'
+        open(os.path.join(root, page), 'w').close()
+
+    print('%-40s %10s %10s %10s %12s' % ('binary', 'mean ms', 'p50 ms', 'p95 ms', 'max rss kB'))
+    for jst in args.binaries:
+        jst = os.path.abspath(jst)
+        run_once(jst, root, page)  # warm the page cache
+        times = []
+        rss = 0
+        for _ in range(args.n):
+            ms, kb = run_once(jst, root, page)
+            times.append(ms)
+            rss = max(rss, kb)
+        times.sort()
+        print('%-40s %10.2f %10.2f %10.2f %12d' % (
+            jst[-40:], statistics.mean(times), times[len(times) // 2],
+            times[int(len(times) * 0.95)], rss))
+
+
+if __name__ == '__main__':
+    main()